@@ -0,0 +1,76 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "aggregate.h"
+
+/**
+ * Wrap the data of a port in frames
+ *
+ * @frame_length will hold the length of the frames
+ * @return the frames, the caller frees them
+ */
+char *aggregate_frame(int tag, char *data, int length, int *frame_length)
+{
+  int frames = (length + AGGREGATE_PAYLOAD_MAX - 1) / AGGREGATE_PAYLOAD_MAX;
+  char *frame = (char *) malloc(length + frames * AGGREGATE_HEADER_SIZE);
+  char *pos = frame;
+  int size;
+
+  while(length > 0) {
+    size = length > AGGREGATE_PAYLOAD_MAX ? AGGREGATE_PAYLOAD_MAX : length;
+    pos[0] = tag;
+    pos[1] = size >> 8;
+    pos[2] = size;
+    memcpy(pos + AGGREGATE_HEADER_SIZE, data, size);
+    pos += AGGREGATE_HEADER_SIZE + size;
+    data += size;
+    length -= size;
+  }
+  *frame_length = pos - frame;
+  return frame;
+}
+
+/**
+ * Take the next piece of payload out of the data of a client
+ *
+ * @tag will hold the port of the payload
+ * @payload will point to the payload in data
+ * @payload_length will hold the length of the payload, 0 when
+ *                 the consumed data only held a header
+ * @return the amount of consumed bytes of data
+ */
+int aggregate_parse(struct s_aggregate_parser *parser, char *data, int length,
+                    int *tag, char **payload, int *payload_length)
+{
+  int consumed = 0;
+
+  *payload_length = 0;
+  while(parser->remaining == 0 && consumed < length) {
+    parser->header[parser->header_length++] = data[consumed++];
+    if(parser->header_length == AGGREGATE_HEADER_SIZE) {
+      parser->header_length = 0;
+      parser->tag = parser->header[0];
+      parser->remaining = (parser->header[1] << 8) | parser->header[2];
+    }
+  }
+  if(parser->remaining == 0 || consumed == length) {
+    return consumed;
+  }
+  *tag = parser->tag;
+  *payload = data + consumed;
+  *payload_length = length - consumed;
+  if(*payload_length > parser->remaining) {
+    *payload_length = parser->remaining;
+  }
+  parser->remaining -= *payload_length;
+  return consumed + *payload_length;
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+// ports behind one link, the tag of the first port is 0
+#define AGGREGATE_PORTS_MAX              64
+// the tag and the payload length in network order
+#define AGGREGATE_HEADER_SIZE            3
+#define AGGREGATE_PAYLOAD_MAX            65535
+
+/**
+ * The frames a client writes, a payload can
+ * arrive in pieces over several reads
+ */
+struct s_aggregate_parser {
+  unsigned char header[AGGREGATE_HEADER_SIZE];
+  int header_length;
+  // the port of the payload being read
+  int tag;
+  // bytes of the payload still to come
+  int remaining;
+};
+
+/**
+ * Wrap the data of a port in frames
+ *
+ * @frame_length will hold the length of the frames
+ * @return the frames, the caller frees them
+ */
+char *aggregate_frame(int tag, char *data, int length, int *frame_length);
+
+/**
+ * Take the next piece of payload out of the data of a client
+ *
+ * @tag will hold the port of the payload
+ * @payload will point to the payload in data
+ * @payload_length will hold the length of the payload, 0 when
+ *                 the consumed data only held a header
+ * @return the amount of consumed bytes of data
+ */
+int aggregate_parse(struct s_aggregate_parser *parser, char *data, int length,
+                    int *tag, char **payload, int *payload_length);
+
+#endif
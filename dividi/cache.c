@@ -0,0 +1,182 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "util.h"
+
+/**
+ * Allocate the entries of a cache, does nothing
+ * when the cache is disabled
+ */
+void cache_create(struct s_cache *cache)
+{
+  if(cache->ttl <= 0) {
+    return;
+  }
+  if(cache->size <= 0) {
+    cache->size = DEFAULT_CACHE_SIZE;
+  }
+  cache->entries = (struct s_cache_entry *) calloc(cache->size, sizeof(struct s_cache_entry));
+  if(cache->entries == NULL) {
+    perror("calloc failed");
+    exit(-1);
+  }
+  mutex_create(&cache->lock);
+}
+
+/**
+ * Free the request and reply of an entry
+ */
+static void cache_clear(struct s_cache_entry *entry)
+{
+  free(entry->request);
+  free(entry->reply);
+  memset(entry, 0, sizeof(struct s_cache_entry));
+}
+
+/**
+ * Find the entry of a request, expired replies are dropped
+ */
+static struct s_cache_entry *cache_find(struct s_cache *cache, char *request, int length,
+                                        long long now)
+{
+  struct s_cache_entry *entry;
+  int i;
+
+  for(i = 0; i < cache->size; i++) {
+    entry = &cache->entries[i];
+    if(entry->request == NULL || entry->request_length != length ||
+       memcmp(entry->request, request, length) != 0) {
+      continue;
+    }
+    if(entry->expires && entry->expires <= now) {
+      cache_clear(entry);
+      return NULL;
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+/**
+ * Find a free entry, evicts an expired or else the least recently
+ * used reply, requests in flight are never evicted
+ *
+ * @return the entry, NULL when every entry is in flight
+ */
+static struct s_cache_entry *cache_slot(struct s_cache *cache, long long now)
+{
+  struct s_cache_entry *entry;
+  struct s_cache_entry *oldest = NULL;
+  int i;
+
+  for(i = 0; i < cache->size; i++) {
+    entry = &cache->entries[i];
+    if(entry->request == NULL) {
+      return entry;
+    }
+    if(entry->expires == 0) {
+      continue;
+    }
+    if(entry->expires <= now) {
+      cache_clear(entry);
+      return entry;
+    }
+    if(oldest == NULL || entry->used < oldest->used) {
+      oldest = entry;
+    }
+  }
+  if(oldest != NULL) {
+    cache_clear(oldest);
+  }
+  return oldest;
+}
+
+/**
+ * Look up a request
+ *
+ * @conn @tag identify the caller when it has to wait
+ * @reply will hold a copy of the reply on a hit, the caller frees it
+ */
+enum e_cache_result cache_lookup(struct s_cache *cache, char *request, int length,
+                                 struct s_conn *conn, unsigned int tag,
+                                 char **reply, int *reply_length)
+{
+  struct s_cache_entry *entry;
+  struct s_cache_waiter *waiter;
+  enum e_cache_result result = CACHE_MISS;
+  long long now = time_ms();
+
+  mutex_lock(&cache->lock);
+  if((entry = cache_find(cache, request, length, now)) != NULL) {
+    if(entry->expires) {
+      *reply = (char *) malloc(entry->reply_length);
+      memcpy(*reply, entry->reply, entry->reply_length);
+      *reply_length = entry->reply_length;
+      entry->used = now;
+      cache->hits++;
+      result = CACHE_HIT;
+    } else {
+      waiter = (struct s_cache_waiter *) malloc(sizeof(struct s_cache_waiter));
+      waiter->conn = conn;
+      waiter->tag = tag;
+      waiter->next = entry->waiters;
+      entry->waiters = waiter;
+      cache->collapsed++;
+      result = CACHE_IN_FLIGHT;
+    }
+  } else {
+    cache->misses++;
+    // Without a free entry the request just isn't cached
+    if((entry = cache_slot(cache, now)) != NULL) {
+      entry->request = (char *) malloc(length);
+      memcpy(entry->request, request, length);
+      entry->request_length = length;
+      entry->used = now;
+    }
+  }
+  mutex_unlock(&cache->lock);
+  return result;
+}
+
+/**
+ * Complete a request that was in flight
+ *
+ * @reply the reply to store, NULL when there is none
+ * @return the clients waiting on the reply, the caller
+ *         answers and frees them
+ */
+struct s_cache_waiter *cache_complete(struct s_cache *cache, char *request, int length,
+                                      char *reply, int reply_length)
+{
+  struct s_cache_entry *entry;
+  struct s_cache_waiter *waiters = NULL;
+  long long now = time_ms();
+
+  mutex_lock(&cache->lock);
+  entry = cache_find(cache, request, length, now);
+  if(entry != NULL && entry->expires == 0) {
+    waiters = entry->waiters;
+    entry->waiters = NULL;
+    if(reply != NULL) {
+      entry->reply = (char *) malloc(reply_length);
+      memcpy(entry->reply, reply, reply_length);
+      entry->reply_length = reply_length;
+      entry->expires = now + cache->ttl;
+    } else {
+      cache_clear(entry);
+    }
+  }
+  mutex_unlock(&cache->lock);
+  return waiters;
+}
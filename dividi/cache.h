@@ -0,0 +1,95 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "thread.h"
+
+#define DEFAULT_CACHE_SIZE               64
+
+struct s_conn;
+
+/**
+ * A client waiting on the reply of an identical
+ * request that is already in flight
+ */
+struct s_cache_waiter {
+  struct s_conn *conn;
+  unsigned int tag;
+  struct s_cache_waiter *next;
+};
+
+/**
+ * A request and its reply
+ */
+struct s_cache_entry {
+  char *request;
+  int request_length;
+  char *reply;
+  int reply_length;
+  // ms, 0 while the request is in flight
+  long long expires;
+  // ms, for evicting the least recently used entry
+  long long used;
+  struct s_cache_waiter *waiters;
+};
+
+/**
+ * Replies of a link keyed on the exact request bytes
+ */
+struct s_cache {
+  // ms a reply stays valid, 0 disables the cache
+  int ttl;
+  // maximum amount of entries
+  int size;
+  struct s_cache_entry *entries;
+  MUTEX lock;
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long collapsed;
+};
+
+enum e_cache_result {
+  // the caller sends the request and completes it
+  CACHE_MISS,
+  // the reply is returned
+  CACHE_HIT,
+  // the caller is added to the waiters of the same request
+  CACHE_IN_FLIGHT
+};
+
+/**
+ * Allocate the entries of a cache, does nothing
+ * when the cache is disabled
+ */
+void cache_create(struct s_cache *cache);
+
+/**
+ * Look up a request
+ *
+ * @conn @tag identify the caller when it has to wait
+ * @reply will hold a copy of the reply on a hit, the caller frees it
+ */
+enum e_cache_result cache_lookup(struct s_cache *cache, char *request, int length,
+                                 struct s_conn *conn, unsigned int tag,
+                                 char **reply, int *reply_length);
+
+/**
+ * Complete a request that was in flight
+ *
+ * @reply the reply to store, NULL when there is none
+ * @return the clients waiting on the reply, the caller
+ *         answers and frees them
+ */
+struct s_cache_waiter *cache_complete(struct s_cache *cache, char *request, int length,
+                                      char *reply, int reply_length);
+
+#endif
@@ -0,0 +1,275 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "capture.h"
+#include "thread.h"
+#include "util.h"
+#include "dividi.h"
+
+// staging buffer of a trace file
+#define CAPTURE_WRITE_SIZE               (256*1024)
+
+/**
+ * Records of one thread, only the thread moves the
+ * head and only the writer moves the tail
+ */
+struct s_capture_ring {
+  volatile unsigned int head;
+  volatile unsigned int tail;
+  unsigned long long dropped;
+  char data[CAPTURE_RING_SIZE];
+};
+
+struct s_capture_file {
+  char path[CAPTURE_PATH_MAX];
+  int fd;
+  char *buffer;
+  int length;
+};
+
+static struct s_capture_file files[CAPTURE_FILES_MAX];
+static int total_files = 0;
+static struct s_capture_ring *rings[CAPTURE_THREADS_MAX];
+static volatile int total_rings = 0;
+static unsigned long long dropped_threads = 0;
+static __thread struct s_capture_ring *ring = NULL;
+static __thread int ring_failed = 0;
+
+/**
+ * Open a trace file, links writing to the same
+ * path share it, exits on failure
+ *
+ * @return the file, always > 0
+ */
+int capture_open(char *path)
+{
+  struct s_capture_header header;
+  struct s_capture_file *file;
+  int i;
+
+  for(i = 0; i < total_files; i++) {
+    if(strcmp(files[i].path, path) == 0) {
+      return i + 1;
+    }
+  }
+  if(total_files == CAPTURE_FILES_MAX) {
+    fprintf(stderr, "CAPTURE_FILES_MAX exceeded\n");
+    exit(-1);
+  }
+  file = &files[total_files];
+  if((file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0) {
+    perror("capture open failed");
+    exit(-1);
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  if(write(file->fd, &header, sizeof(header)) != sizeof(header)) {
+    perror("capture write failed");
+    exit(-1);
+  }
+  file->buffer = (char *) malloc(CAPTURE_WRITE_SIZE);
+  strncpy(file->path, path, CAPTURE_PATH_MAX - 1);
+  return ++total_files;
+}
+
+/**
+ * Copy into a ring, wrapping at the end
+ */
+static void ring_copy_in(struct s_capture_ring *ring, unsigned int position,
+                         const void *src, unsigned int length)
+{
+  unsigned int offset = position & (CAPTURE_RING_SIZE - 1);
+  unsigned int first = CAPTURE_RING_SIZE - offset;
+
+  if(first > length) {
+    first = length;
+  }
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, (const char *) src + first, length - first);
+}
+
+/**
+ * Copy out of a ring, wrapping at the end
+ */
+static void ring_copy_out(struct s_capture_ring *ring, unsigned int position,
+                          void *dst, unsigned int length)
+{
+  unsigned int offset = position & (CAPTURE_RING_SIZE - 1);
+  unsigned int first = CAPTURE_RING_SIZE - offset;
+
+  if(first > length) {
+    first = length;
+  }
+  memcpy(dst, ring->data + offset, first);
+  memcpy((char *) dst + first, ring->data, length - first);
+}
+
+/**
+ * The ring of the calling thread, created on first use
+ */
+static struct s_capture_ring *capture_ring()
+{
+  int index;
+
+  if(ring != NULL || ring_failed) {
+    return ring;
+  }
+  index = __sync_fetch_and_add(&total_rings, 1);
+  if(index >= CAPTURE_THREADS_MAX || (ring = calloc(1, sizeof(*ring))) == NULL) {
+    fprintf(stderr, "capture: no buffer for thread, its chunks are dropped\n");
+    ring_failed = 1;
+    return NULL;
+  }
+  // Published last, the writer skips the slot untill then
+  __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+  return ring;
+}
+
+/**
+ * Record a chunk, never blocks, the chunk is dropped
+ * when the buffer of the thread is full
+ */
+void capture_add(int file, int link, int client, enum e_capture_direction direction,
+                 char *data, int length)
+{
+  struct s_capture_ring *ring = capture_ring();
+  struct s_capture_record record;
+  unsigned int head;
+  unsigned int size = sizeof(record) + length;
+
+  if(ring == NULL || size > CAPTURE_WRITE_SIZE) {
+    __sync_add_and_fetch(&dropped_threads, 1);
+    return;
+  }
+  head = ring->head;
+  if(CAPTURE_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < size) {
+    ring->dropped++;
+    return;
+  }
+  record.time = time_us();
+  record.length = length;
+  record.client = client;
+  record.link = link;
+  record.direction = direction;
+  record.reserved = 0;
+  record.file = file;
+  ring_copy_in(ring, head, &record, sizeof(record));
+  ring_copy_in(ring, head + sizeof(record), data, length);
+  __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+/**
+ * The amount of chunks dropped
+ */
+unsigned long long capture_dropped()
+{
+  unsigned long long dropped = dropped_threads;
+  int i;
+
+  for(i = 0; i < total_rings && i < CAPTURE_THREADS_MAX; i++) {
+    if(rings[i] != NULL) {
+      dropped += rings[i]->dropped;
+    }
+  }
+  return dropped;
+}
+
+/**
+ * Write the staging buffer of a file
+ */
+static void capture_flush(struct s_capture_file *file)
+{
+  if(file->length > 0 && write(file->fd, file->buffer, file->length) != file->length) {
+    perror("capture write failed");
+  }
+  file->length = 0;
+}
+
+/**
+ * Move the records of a ring to the staging
+ * buffers of their files
+ */
+static void capture_drain(struct s_capture_ring *ring)
+{
+  struct s_capture_record record;
+  struct s_capture_file *file;
+  unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  unsigned int tail = ring->tail;
+  unsigned int size;
+
+  while(tail != head) {
+    ring_copy_out(ring, tail, &record, sizeof(record));
+    size = sizeof(record) + record.length;
+    file = &files[record.file - 1];
+    if(file->length + size > CAPTURE_WRITE_SIZE) {
+      capture_flush(file);
+    }
+    record.file = 0;
+    memcpy(file->buffer + file->length, &record, sizeof(record));
+    ring_copy_out(ring, tail + sizeof(record), file->buffer + file->length + sizeof(record),
+                  record.length);
+    file->length += size;
+    tail += size;
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * The capture writer thread
+ * thread buffers -> trace files
+ */
+#ifdef __linux__
+static void *capture_handler(void *arg)
+#elif _WIN32
+static DWORD WINAPI capture_handler(LPVOID arg)
+#endif
+{
+  struct s_capture_ring *ring;
+  int i;
+
+  while(1) {
+#ifdef __linux__
+    usleep(CAPTURE_FLUSH_MS * 1000);
+#elif _WIN32
+    Sleep(CAPTURE_FLUSH_MS);
+#endif
+    for(i = 0; i < total_rings && i < CAPTURE_THREADS_MAX; i++) {
+      if((ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE)) != NULL) {
+        capture_drain(ring);
+      }
+    }
+    for(i = 0; i < total_files; i++) {
+      capture_flush(&files[i]);
+    }
+  }
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * Start writing the buffers of the threads to the
+ * trace files, does nothing when none are open
+ */
+void capture_start()
+{
+  if(total_files > 0 &&
+     thread_start((THREAD_FUNC) capture_handler, NULL, NO_CPU_AFFINITY) < 0) {
+    exit(-1);
+  }
+}
@@ -0,0 +1,81 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#define CAPTURE_MAGIC                    "DIVTRACE"
+#define CAPTURE_VERSION                  1
+#define CAPTURE_PATH_MAX                 256
+#define CAPTURE_FILES_MAX                16
+#define CAPTURE_THREADS_MAX              256
+// bytes buffered per thread, a power of two
+#define CAPTURE_RING_SIZE                (1024*1024)
+#define CAPTURE_FLUSH_MS                 10
+
+enum e_capture_direction {
+  CAPTURE_FROM_SERIAL,
+  CAPTURE_TO_SERIAL
+};
+
+/**
+ * Start of a trace file
+ */
+struct s_capture_header {
+  char magic[8];
+  unsigned int version;
+  unsigned int reserved;
+};
+
+/**
+ * Every chunk in a trace file, followed by
+ * length bytes of data
+ */
+struct s_capture_record {
+  // monotonic time in us
+  unsigned long long time;
+  unsigned int length;
+  // the client that wrote the data, 0 for serial output
+  unsigned int client;
+  // tcp port of the link
+  unsigned short link;
+  unsigned char direction;
+  unsigned char reserved;
+  // 0 on disk, the file while buffered
+  unsigned int file;
+};
+
+/**
+ * Open a trace file, links writing to the same
+ * path share it, exits on failure
+ *
+ * @return the file, always > 0
+ */
+int capture_open(char *path);
+
+/**
+ * Start writing the buffers of the threads to the
+ * trace files, does nothing when none are open
+ */
+void capture_start();
+
+/**
+ * Record a chunk, never blocks, the chunk is dropped
+ * when the buffer of the thread is full
+ */
+void capture_add(int file, int link, int client, enum e_capture_direction direction,
+                 char *data, int length);
+
+/**
+ * The amount of chunks dropped
+ */
+unsigned long long capture_dropped();
+
+#endif
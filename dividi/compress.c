@@ -0,0 +1,112 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <time.h>
+#endif
+#include "compress.h"
+
+// room for the sync flush marker and the block headers
+#define COMPRESS_FLUSH_MARGIN            64
+
+/**
+ * The cpu time of the calling thread in ns, 0 when unknown
+ */
+static unsigned long long compress_cpu_ns()
+{
+#ifdef __linux__
+  struct timespec now;
+
+  if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) {
+    return (unsigned long long) now.tv_sec * 1000000000 + now.tv_nsec;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * The name of a compression, as used in the handshake
+ */
+const char *compress_name(enum e_compression compression)
+{
+  return compression == COMPRESSION_ZLIB ? "zlib" : "none";
+}
+
+/**
+ * Start the compression stream
+ *
+ * @level the zlib level, DEFAULT_COMPRESSION_LEVEL for the default
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int compress_start(struct s_compress *compress, int level)
+{
+  memset(compress, 0, sizeof(struct s_compress));
+  if(deflateInit(&compress->stream, level) != Z_OK) {
+    fprintf(stderr, "deflateInit failed: %s\n",
+            compress->stream.msg ? compress->stream.msg : "invalid level");
+    return -1;
+  }
+  compress->active = 1;
+  return 0;
+}
+
+/**
+ * Compress data, only a flush guarantees all of it
+ * is in the output
+ *
+ * @flush end a burst, the client can decompress
+ *        everything up to here
+ * @compressed_length will hold the amount of compressed bytes, can be 0
+ * @return the compressed data, the caller frees it
+ */
+char *compress_data(struct s_compress *compress, char *data, int length, int flush,
+                    int *compressed_length)
+{
+  z_stream *stream = &compress->stream;
+  unsigned long long start = compress_cpu_ns();
+  int size = deflateBound(stream, length) + COMPRESS_FLUSH_MARGIN;
+  char *output = (char *) malloc(size);
+
+  stream->next_in = (Bytef *) data;
+  stream->avail_in = length;
+  stream->next_out = (Bytef *) output;
+  stream->avail_out = size;
+  while(1) {
+    deflate(stream, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    // A full output buffer can hide pending output
+    if(stream->avail_in == 0 && stream->avail_out > 0) {
+      break;
+    }
+    output = (char *) realloc(output, size * 2);
+    stream->next_out = (Bytef *) output + size;
+    stream->avail_out = size;
+    size *= 2;
+  }
+  *compressed_length = size - stream->avail_out;
+  compress->bytes_in += length;
+  compress->bytes_out += *compressed_length;
+  compress->cpu_ns += compress_cpu_ns() - start;
+  return output;
+}
+
+/**
+ * Free the compression stream
+ */
+void compress_end(struct s_compress *compress)
+{
+  if(compress->active) {
+    deflateEnd(&compress->stream);
+    compress->active = 0;
+  }
+}
@@ -0,0 +1,72 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <zlib.h>
+
+// zlib's trade-off between ratio and cpu
+#define DEFAULT_COMPRESSION_LEVEL        Z_DEFAULT_COMPRESSION
+
+/**
+ * The compressions a link can offer
+ */
+enum e_compression {
+  COMPRESSION_NONE,
+  COMPRESSION_ZLIB
+};
+
+/**
+ * The compression stream of the output to one client
+ */
+struct s_compress {
+  z_stream stream;
+  // set once the client negotiated compression
+  int active;
+  // bytes before and after compression
+  unsigned long long bytes_in;
+  unsigned long long bytes_out;
+  // ns of cpu time spent compressing
+  unsigned long long cpu_ns;
+};
+
+/**
+ * The name of a compression, as used in the handshake
+ */
+const char *compress_name(enum e_compression compression);
+
+/**
+ * Start the compression stream
+ *
+ * @level the zlib level, DEFAULT_COMPRESSION_LEVEL for the default
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int compress_start(struct s_compress *compress, int level);
+
+/**
+ * Compress data, only a flush guarantees all of it
+ * is in the output
+ *
+ * @flush end a burst, the client can decompress
+ *        everything up to here
+ * @compressed_length will hold the amount of compressed bytes, can be 0
+ * @return the compressed data, the caller frees it
+ */
+char *compress_data(struct s_compress *compress, char *data, int length, int flush,
+                    int *compressed_length);
+
+/**
+ * Free the compression stream
+ */
+void compress_end(struct s_compress *compress);
+
+#endif
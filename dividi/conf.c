@@ -20,12 +20,169 @@
 
 static struct s_link *active_link = NULL;
 
+/**
+ * Parse a comma separated list of listen
+ * addresses for the current parsed link
+ */
+static int conf_parse_listen(char *value)
+{
+  char *address;
+
+  active_link->total_listen = 0;
+  while((address = strsep_delim(&value, ",")) != NULL) {
+    strtrim(address);
+    if(active_link->total_listen == MAX_LISTEN_ADDRESSES ||
+       strlen(address) == 0 || strlen(address) >= LISTEN_ADDRESS_MAX) {
+      return -1;
+    }
+    strcpy(active_link->listen[active_link->total_listen++], address);
+  }
+  return 0;
+}
+
+/**
+ * Convert a parity name to the parity mode
+ *
+ * @return the parity, < 0 for an unknown name
+ */
+static int conf_parse_parity(char *value)
+{
+  if(strcmp(value, "none") == 0) {
+    return PARITY_NONE;
+  } else if(strcmp(value, "odd") == 0) {
+    return PARITY_ODD;
+  } else if(strcmp(value, "even") == 0) {
+    return PARITY_EVEN;
+  }
+  return -1;
+}
+
+/**
+ * Convert a flow control name to the flow mode
+ *
+ * @return the flow control, < 0 for an unknown name
+ */
+static int conf_parse_flow(char *value)
+{
+  if(strcmp(value, "none") == 0) {
+    return FLOW_NONE;
+  } else if(strcmp(value, "xon_xoff") == 0) {
+    return FLOW_XON_XOFF;
+  } else if(strcmp(value, "rts_cts") == 0) {
+    return FLOW_RTS_CTS;
+  } else if(strcmp(value, "dsr_dtr") == 0) {
+    return FLOW_DSR_DTR;
+  }
+  return -1;
+}
+
+/**
+ * Convert a virtual device name to the device type
+ *
+ * @return the type, < 0 for an unknown name
+ */
+static int conf_parse_virtual(char *value)
+{
+  if(strcmp(value, "none") == 0) {
+    return VSERIAL_NONE;
+  } else if(strcmp(value, "loopback") == 0) {
+    return VSERIAL_LOOPBACK;
+  } else if(strcmp(value, "generator") == 0) {
+    return VSERIAL_GENERATOR;
+  } else if(strcmp(value, "sink") == 0) {
+    return VSERIAL_SINK;
+  }
+  return -1;
+}
+
+/**
+ * Parse the <edge name>:<tcp port> of the edge link
+ * the current parsed link re-exports
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+static int conf_parse_relay_from(char *value)
+{
+  char *sep = strrchr(value, ':');
+
+  if(sep == NULL || atoi(sep + 1) <= 0 || sep - value >= CLIENT_NAME_MAX) {
+    return -1;
+  }
+  *sep = '\0';
+  strtrim(value);
+  if(strlen(value) == 0) {
+    return -1;
+  }
+  strcpy(active_link->relay_peer, value);
+  active_link->relay_port = atoi(sep + 1);
+  active_link->vserial.type = VSERIAL_RELAY;
+  return 0;
+}
+
+/**
+ * Parse a comma separated list of serial ports the clients
+ * of the current parsed link reach next to its own port,
+ * the ports are tagged in the order of the list from 1 on
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+static int conf_parse_aggregate(char *value)
+{
+  struct s_link *member;
+  char tcp_port[8];
+  char *device;
+
+  snprintf(tcp_port, sizeof(tcp_port), "%d", active_link->tcp_port);
+  if(active_link->aggregate == NULL) {
+    active_link->aggregate = active_link;
+    active_link->members[active_link->total_members++] = active_link;
+  }
+  while((device = strsep_delim(&value, ",")) != NULL) {
+    strtrim(device);
+    if(active_link->total_members == AGGREGATE_PORTS_MAX ||
+       strlen(device) == 0 || strlen(device) >= SERIAL_NAME_MAX) {
+      return -1;
+    }
+    member = add_link(device, tcp_port);
+    member->aggregate = active_link;
+    member->aggregate_tag = active_link->total_members;
+    active_link->members[active_link->total_members++] = member;
+  }
+  return 0;
+}
+
+/**
+ * Parse a <client name>:<value> client setting
+ * for the current parsed link
+ */
+static struct s_client_policy *conf_parse_client(char *value, int *setting)
+{
+  struct s_client_policy *policy;
+  char *sep = strrchr(value, ':');
+
+  if(sep == NULL) {
+    return NULL;
+  }
+  *sep = '\0';
+  strtrim(value);
+  *setting = atoi(sep + 1);
+  if((policy = sched_get_policy(active_link->client_policies, value)) == NULL) {
+    fprintf(stderr, "Maximum %d client settings per link\n", MAX_CLIENT_POLICIES);
+  }
+  return policy;
+}
+
 /**
  * Parse the settigns for the current
  * parsed link
  */
 static int conf_parse_link_settings(char *key, char *value)
 {
+  struct s_client_policy *policy;
+  int setting;
+
   dbg("Config link: %s=%s\n", key, value);
   if(strcmp(key, "timeout") == 0) {
     active_link->serial.timeout = atoi(value);
@@ -35,10 +192,160 @@ static int conf_parse_link_settings(char *key, char *value)
     active_link->serial.data_bits = atoi(value);
   } else if(strcmp(key, "stop_bits") == 0) {
     active_link->serial.stop_bits = atoi(value);
+  } else if(strcmp(key, "write_latency") == 0) {
+    active_link->serial.write_latency = atoi(value);
+  } else if(strcmp(key, "low_latency") == 0) {
+    active_link->serial.low_latency = atoi(value);
+  } else if(strcmp(key, "protocol") == 0) {
+    if(strcmp(value, "raw") == 0) {
+      active_link->protocol = PROTOCOL_RAW;
+    } else if(strcmp(value, "modbus_rtu") == 0) {
+      active_link->protocol = PROTOCOL_MODBUS_RTU;
+    } else if(strcmp(value, "modbus_tcp") == 0) {
+      active_link->protocol = PROTOCOL_MODBUS_TCP;
+    } else if(strcmp(value, "request_reply") == 0) {
+      active_link->protocol = PROTOCOL_REQUEST_REPLY;
+    } else {
+      return -1;
+    }
+  } else if(strcmp(key, "reply_timeout") == 0) {
+    active_link->reply_timeout = atoi(value);
+  } else if(strcmp(key, "broadcast_delay") == 0) {
+    active_link->broadcast_delay = atoi(value);
+  } else if(strcmp(key, "reply_end") == 0) {
+    if((setting = strunescape(active_link->reply_end, value, REPLY_END_MAX)) < 0) {
+      return -1;
+    }
+    active_link->reply_end_length = setting;
+  } else if(strcmp(key, "reply_gap") == 0) {
+    active_link->reply_gap = atoi(value);
+  } else if(strcmp(key, "cache_ttl") == 0) {
+    active_link->cache.ttl = atoi(value);
+  } else if(strcmp(key, "cache_size") == 0) {
+    active_link->cache.size = atoi(value);
+  } else if(strcmp(key, "history") == 0) {
+    active_link->history.size = atoi(value);
+  } else if(strcmp(key, "resume_timeout") == 0) {
+    active_link->resume_timeout = atoi(value);
+  } else if(strcmp(key, "spill") == 0) {
+    if(strlen(value) >= SPILL_DIR_MAX) {
+      return -1;
+    }
+    strcpy(active_link->spill.dir, value);
+  } else if(strcmp(key, "spill_threshold") == 0) {
+    active_link->spill.threshold = atoi(value);
+  } else if(strcmp(key, "spill_segment_size") == 0) {
+    active_link->spill.segment_size = atoi(value);
+  } else if(strcmp(key, "spill_segments") == 0) {
+    active_link->spill.segments = atoi(value);
+  } else if(strcmp(key, "capture") == 0) {
+    if(strlen(value) >= CAPTURE_PATH_MAX) {
+      return -1;
+    }
+    strcpy(active_link->capture_path, value);
+  } else if(strcmp(key, "shm") == 0) {
+    if(strlen(value) >= SHM_PATH_MAX) {
+      return -1;
+    }
+    strcpy(active_link->shm.path, value);
+  } else if(strcmp(key, "shm_mode") == 0) {
+    active_link->shm.mode = strtol(value, NULL, 8);
+  } else if(strcmp(key, "shm_size") == 0) {
+    active_link->shm.size = atoi(value);
+  } else if(strcmp(key, "mode") == 0) {
+    if(strcmp(value, "rs232") == 0) {
+      active_link->serial.mode = SERIAL_MODE_RS232;
+    } else if(strcmp(value, "rs485") == 0) {
+      active_link->serial.mode = SERIAL_MODE_RS485;
+    } else {
+      return -1;
+    }
+  } else if(strcmp(key, "rs485_delay_before") == 0) {
+    active_link->serial.rs485_delay_before = atoi(value);
+  } else if(strcmp(key, "rs485_delay_after") == 0) {
+    active_link->serial.rs485_delay_after = atoi(value);
+  } else if(strcmp(key, "rs485_turnaround") == 0) {
+    active_link->serial.rs485_turnaround = atoi(value);
+  } else if(strcmp(key, "listen") == 0) {
+    return conf_parse_listen(value);
+  } else if(strcmp(key, "interface") == 0) {
+    if(strlen(value) >= INTERFACE_NAME_MAX) {
+      return -1;
+    }
+    strcpy(active_link->interface, value);
+  } else if(strcmp(key, "socket_profile") == 0) {
+    int profile = socket_profile_from_string(value);
+    if(profile < 0) {
+      return -1;
+    }
+    active_link->socket_profile = profile;
+  } else if(strcmp(key, "weight") == 0) {
+    active_link->sched_policy.weight = atoi(value);
+  } else if(strcmp(key, "rate_limit") == 0) {
+    active_link->sched_policy.rate_limit = atoi(value);
+  } else if(strcmp(key, "rate_burst") == 0) {
+    active_link->sched_policy.rate_burst = atoi(value);
+  } else if(strcmp(key, "client_weight") == 0) {
+    if((policy = conf_parse_client(value, &setting)) == NULL) {
+      return -1;
+    }
+    policy->weight = setting;
+  } else if(strcmp(key, "client_rate_limit") == 0) {
+    if((policy = conf_parse_client(value, &setting)) == NULL) {
+      return -1;
+    }
+    policy->rate_limit = setting;
+  } else if(strcmp(key, "client_rate_burst") == 0) {
+    if((policy = conf_parse_client(value, &setting)) == NULL) {
+      return -1;
+    }
+    policy->rate_burst = setting;
   } else if(strcmp(key, "parity") == 0) {
-    //XXX
+    if((setting = conf_parse_parity(value)) < 0) {
+      return -1;
+    }
+    active_link->serial.parity = setting;
   } else if(strcmp(key, "flow") == 0) {
-    //XXX
+    if((setting = conf_parse_flow(value)) < 0) {
+      return -1;
+    }
+    active_link->serial.flow = setting;
+  } else if(strcmp(key, "virtual") == 0) {
+    if((setting = conf_parse_virtual(value)) < 0) {
+      return -1;
+    }
+    active_link->vserial.type = setting;
+  } else if(strcmp(key, "compression") == 0) {
+    if(strcmp(value, "none") == 0) {
+      active_link->compression = COMPRESSION_NONE;
+    } else if(strcmp(value, "zlib") == 0) {
+      active_link->compression = COMPRESSION_ZLIB;
+    } else {
+      return -1;
+    }
+  } else if(strcmp(key, "batch_delay") == 0) {
+    active_link->batch_delay = atoi(value);
+  } else if(strcmp(key, "compression_level") == 0) {
+    // -1 is the zlib default
+    if((setting = atoi(value)) < -1 || setting > 9) {
+      return -1;
+    }
+    active_link->compression_level = setting;
+  } else if(strcmp(key, "frame_size") == 0) {
+    active_link->vserial.frame_size = atoi(value);
+  } else if(strcmp(key, "relay_from") == 0) {
+    if(conf_parse_relay_from(value) < 0) {
+      return -1;
+    }
+  } else if(strcmp(key, "server_name") == 0) {
+    if(strlen(value) == 0 || strlen(value) >= SERVER_NAME_MAX) {
+      return -1;
+    }
+    strcpy(active_link->server_name, value);
+  } else if(strcmp(key, "aggregate") == 0) {
+    if(conf_parse_aggregate(value) < 0) {
+      return -1;
+    }
   } else {
     return -1;
   }
@@ -57,6 +364,30 @@ static int conf_parse_settings(char *key, char *value)
     set_key_file(value);
   } else if(strcmp(key, "rootCA") == 0) {
     set_root_file(value);
+  } else if(strcmp(key, "workers") == 0) {
+    set_workers(value);
+  } else if(strcmp(key, "worker_cpus") == 0) {
+    set_worker_cpus(value);
+  } else if(strcmp(key, "io_engine") == 0) {
+    set_io_engine(value);
+  } else if(strcmp(key, "acceptors") == 0) {
+    set_acceptors(value);
+  } else if(strcmp(key, "crypto_workers") == 0) {
+    set_crypto_workers(value);
+  } else if(strcmp(key, "metrics_interval") == 0) {
+    set_metrics_interval(value);
+  } else if(strcmp(key, "relay_hub_name") == 0) {
+    set_relay_hub_name(value);
+  } else if(strcmp(key, "relay_hub") == 0) {
+    set_relay_hub(value);
+  } else if(strcmp(key, "shared_port") == 0) {
+    set_shared_port(value);
+  } else if(strcmp(key, "shared_listen") == 0) {
+    set_shared_listen(value);
+  } else if(strcmp(key, "relay_port") == 0) {
+    set_relay_port(value);
+  } else if(strcmp(key, "relay_listen") == 0) {
+    set_relay_listen(value);
   } else {
     return -1;
   }
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <fcntl.h>
 #include <time.h>
@@ -29,9 +30,11 @@
   #include <termios.h>
   #include <arpa/inet.h>
   #include <netinet/in.h>
+  #include <netdb.h>
   #include <sys/socket.h>
   #include <pthread.h>
   #include <poll.h>
+  #include <signal.h>
   #include <semaphore.h>
   #include <linux/limits.h>
 #endif
@@ -43,14 +46,24 @@
 #include "conf.h"
 #include "dividi.h"
 #include "serial.h"
+#include "thread.h"
+#include "queue.h"
+#include "uring.h"
+#include "net.h"
+#include "fair.h"
+#include "metrics.h"
 #include "util.h"
 #include <getopt.h>
 
 #define MAX_message                      100
-#define QUEUE_SIZE                       1000
-#define MAX_ACTIVE_CONNECTIONS           50
-#define MAX_SEM_COUNT                    QUEUE_SIZE
 #define MAX_LINKS                        100
+#define WORKER_POLL_TIMEOUT              100
+#define SERIAL_FULL_RETRY_MS             10
+// the user_data of the timeout of the serial in ring
+#define URING_TIMEOUT                    MAX_LINKS
+// and the shared port
+#define MAX_LISTENERS                    ((MAX_LINKS + 1)*MAX_LISTEN_ADDRESSES)
+#define DEFAULT_LISTEN_ADDRESS           "0.0.0.0"
 
 #ifdef __linux__
 #define DEFAULT_CONFIG_FILE              "/etc/dividi.conf"
@@ -62,10 +75,9 @@
 
 #define TCP_DATA_CHUNK_SIZE 512
 #define TCP_DATA_MAX        50*TCP_DATA_CHUNK_SIZE
-#define DIVIDI_SERIAL2TCP_QUEUE  0
-#define DIVIDI_TCP2SERIAL_QUEUE 1
 
 static struct s_link links[MAX_LINKS];
+static struct s_worker workers[MAX_WORKERS];
 
 #ifdef _WIN32
 struct pollfd {
@@ -73,70 +85,72 @@ struct pollfd {
 };
 #endif
 
-struct s_conn {
-  int tcp_socket;
-  SSL *socket;
-  struct s_link *link;
-};
-// queue entry
-struct s_entry {
-  struct s_conn *conn;
-  char *message;
-};
-
-static void allocate_queues();
-static void deallocate_queues();
-static void release_queue_sem(int queue, int inc);
 static char *receive_message(SSL *ns, int *bytes_read);
-static int send_message(SSL *ns, char *message);
-static void tcp2serial_queue_add(struct s_conn *conn, char *message);
-static void serial2tcp_queue_add(struct s_link *link, char *message);
+static int client_send(struct s_conn *conn, char *data, int length);
+static int client_flush(struct s_conn *conn);
+static int client_send_entry(struct s_conn *conn, struct s_entry *entry);
+static int batch_write_rest(struct s_conn *conn);
+static int batch_delay(struct s_link *link);
+static void conn_wakeup(struct s_conn *conn);
+static void tcp2serial_queue_add(struct s_conn *conn, char *message, int length,
+                                 unsigned int tag);
+static void serial2tcp_queue_add(struct s_link *link, char *message, int length);
+static void client_queue_add(struct s_conn *conn, char *message, int length,
+                             unsigned int tag);
+static int spill_send(struct s_conn *conn);
 static void close_socket(int s);
 
 static int get_empty_link_slot();
+static int get_worker_ports(struct s_worker *worker, struct s_link **ports);
 #ifdef __linux__
-static void *serial_in_handler();
-static void *serial_out_handler();
-static void *tcp_in_handler();
-static void *tcp_out_handler();
-static pthread_mutex_t serial2tcp_queue_lock;
-static pthread_mutex_t serial_lock;
-static pthread_mutex_t tcp2serial_queue_lock;
-static sem_t serial2tcp_queue_sem;
-static sem_t tcp2serial_queue_sem;
-static sem_t thread_started_sem;
+static void *serial_in_handler(void *_worker);
+static void *serial_out_handler(void *_worker);
+static void *tcp_in_handler(void *_conn);
+static void *tcp_out_handler(void *_conn);
 #elif _WIN32
-static DWORD WINAPI serial_in_handler();
-static DWORD WINAPI serial_out_handler();
-static DWORD WINAPI tcp_in_handler(LPVOID lpParam);
-static DWORD WINAPI tcp_out_handler(LPVOID lpParam);
-static HANDLE serial2tcp_queue_lock;
-static HANDLE serial_lock;
-static HANDLE tcp2serial_queue_lock;
-static HANDLE serial2tcp_queue_sem;
-static HANDLE tcp2serial_queue_sem;
-static HANDLE thread_started_sem;
+static DWORD WINAPI serial_in_handler(LPVOID _worker);
+static DWORD WINAPI serial_out_handler(LPVOID _worker);
+static DWORD WINAPI tcp_in_handler(LPVOID _conn);
+static DWORD WINAPI tcp_out_handler(LPVOID _conn);
+#endif
+#ifdef __linux__
+static void *shm_handler(void *_link);
 #endif
-
-static struct s_entry **serial2tcp_queue;
-static struct s_entry **tcp2serial_queue;
-static volatile int serial2tcp_queue_index = 0;
-static volatile int serial2tcp_queue_start = 0;
-static volatile int tcp2serial_queue_index = 0;
-static volatile int tcp2serial_queue_start = 0;
-
 
 static char config_file[PATH_MAX];
 static char cert_file[PATH_MAX];
 static char key_file[PATH_MAX];
 static char root_file[PATH_MAX];
 
-static volatile int in_tcp_running = 0;
-static volatile int out_tcp_running = 0;
-static volatile int serial2tcp_queue_running = 0;
-static volatile int tcp2serial_queue_running = 0;
 static volatile int dividi_running = 0;
 static int total_links = 0;
+static int total_workers = 1;
+static int worker_cpus[MAX_WORKERS];
+static int total_worker_cpus = 0;
+static int total_acceptors = 1;
+static int metrics_interval = 0;
+// 0 gives every connection its own output thread
+static int crypto_workers = 0;
+static struct s_pool crypto_pool;
+// the hub an edge tunnels its links to, none when empty
+static char relay_hub_host[RELAY_HOST_MAX];
+static int relay_hub_port = 0;
+// the name the certificate of the hub has to carry, the host when empty
+static char relay_hub_name[RELAY_HOST_MAX];
+// the port a hub accepts tunnels on, 0 when it isn't a hub
+static int relay_port = 0;
+// addresses of the relay port, all IPv4 addresses when none are given
+static char relay_listen[MAX_LISTEN_ADDRESSES][LISTEN_ADDRESS_MAX];
+static int total_relay_listen = 0;
+// guards the tunnels of the relay links
+static MUTEX relay_lock;
+// the port of the links picked by name in the handshake, 0 when unused
+static int shared_port = 0;
+// addresses of the shared port, all IPv4 addresses when none are given
+static char shared_listen[MAX_LISTEN_ADDRESSES][LISTEN_ADDRESS_MAX];
+static int total_shared_listen = 0;
+static int next_conn_id = 0;
+static enum e_io_engine io_engine = IO_ENGINE_POLL;
 
 ////////////////////////////////////PRIVATE////////////////////////////////////////////////
 /**
@@ -145,835 +159,3311 @@ static int total_links = 0;
  */
 static void destroy_everything()
 {
-  /* exit queue_handler thread */
-  serial2tcp_queue_running = 0;
-  tcp2serial_queue_running = 0;
-
-  /* exit all connections */
-  out_tcp_running = 0;
-  if(in_tcp_running) {
-    in_tcp_running = 0;
-    while(in_tcp_running !=-1);
+  int i;
+  /* exit the worker threads, the queues are released with the process
+   * because the threads can still be blocked on them */
+  for(i = 0; i < total_workers; i++) {
+    workers[i].running = 0;
+    if(workers[i].tcp2serial_queue.entries) {
+      queue_wakeup(&workers[i].tcp2serial_queue);
+    }
+  }
+  for(i = 0; i < MAX_LINKS; i++) {
+    shm_destroy(&links[i].shm);
   }
-  deallocate_queues();
 }
 
 /**
- * Block untill the semaphore is incremented by one
+ * Take a reference on a connection
  */
-static void get_queue_sem(int queue)
+static void conn_get(struct s_conn *conn)
 {
-  if(queue == DIVIDI_SERIAL2TCP_QUEUE) {
-#ifdef __linux__
-    sem_wait(&serial2tcp_queue_sem);
-#elif _WIN32
-    WaitForSingleObject(serial2tcp_queue_sem, INFINITE);
-#endif
-  } else if(queue == DIVIDI_TCP2SERIAL_QUEUE) {
-#ifdef __linux__
-    sem_wait(&tcp2serial_queue_sem);
-#elif _WIN32
-    WaitForSingleObject(tcp2serial_queue_sem, INFINITE);
-#endif
-  }
+  mutex_lock(&conn->link->conns_lock);
+  conn->references++;
+  mutex_unlock(&conn->link->conns_lock);
 }
 
 /**
- * Increment the semaphore
- *
- * @queue which semaphore
- * @inc the amount of the times the sem needs
- *      to be incremented
+ * Drop a reference on a connection, the last
+ * reference frees it
  */
-static void release_queue_sem(int queue, int inc)
+static void conn_put(struct s_conn *conn)
 {
-  if(queue == DIVIDI_SERIAL2TCP_QUEUE) {
+  int references;
+  mutex_lock(&conn->link->conns_lock);
+  references = --conn->references;
+  mutex_unlock(&conn->link->conns_lock);
+  if(references == 0) {
+    dbg("freeing connection %d\n", conn->id);
+    if(conn->shm == NULL && conn->relay == NULL) {
+      SSL_free(conn->socket);
 #ifdef __linux__
-    int i;
-    for(i = 0; i < inc; i++) {
-      if(sem_post(&serial2tcp_queue_sem)<0) {
-        perror("sem_post failed");
-        exit(-1);
-      }
-    }
+      close(conn->tcp_socket);
 #elif _WIN32
-    if(inc && !ReleaseSemaphore(serial2tcp_queue_sem, inc, NULL)) {
-      fprintf(stderr, "%d", WSAGetLastError());
-      exit(-1);
-    }
+      closesocket(conn->tcp_socket);
 #endif
-  } else if(queue == DIVIDI_TCP2SERIAL_QUEUE) {
-#ifdef __linux__
-    int i;
-    for(i = 0; i < inc; i++) {
-      if(sem_post(&tcp2serial_queue_sem)<0) {
-        perror("sem_post failed");
-        exit(-1);
-      }
     }
-#elif _WIN32
-    if(inc && !ReleaseSemaphore(tcp2serial_queue_sem, inc, NULL)) {
-      fprintf(stderr, "%d", WSAGetLastError());
-      exit(-1);
+    if(conn->relay != NULL) {
+      relay_put(conn->relay);
     }
-#endif
+    queue_destroy(&conn->out_queue);
+    semaphore_destroy(&conn->backlog_sem);
+    free(conn->batch.data);
+    compress_end(&conn->compress);
+    free(conn);
   }
 }
 
 /**
- * Block untill the thread started semaphore is
- * incremented by inc
+ * Let the output of a connection notice new work
+ * or that it should stop
  */
-static void get_thread_started_sem(int inc)
+static void conn_wakeup(struct s_conn *conn)
 {
-  int i;
-  for(i = 0; i < inc; i++) {
-#ifdef __linux__
-    sem_wait(&thread_started_sem);
-#elif _WIN32
-    WaitForSingleObject(thread_started_sem, INFINITE);
-#endif
+  if(conn->relay != NULL) {
+    semaphore_post(&conn->relay->sem, 1);
+  } else if(crypto_workers > 0) {
+    pool_schedule(&crypto_pool, &conn->output);
+  } else {
+    queue_wakeup(&conn->out_queue);
   }
 }
 
 /**
- * Increment the thread started semaphore by 1
+ * Hand a connection with new output to the crypto pool or
+ * its tunnel, the queue wakes its output thread otherwise
  */
-static void release_thread_started_sem()
+static void conn_output_added(struct s_conn *conn)
 {
-#ifdef __linux__
-  if(sem_post(&thread_started_sem)<0) {
-    perror("sem_post failed");
-    exit(-1);
-  }
-#elif _WIN32
-  if(!ReleaseSemaphore(thread_started_sem, 1, NULL)) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
+  if(conn->relay != NULL) {
+    semaphore_post(&conn->relay->sem, 1);
+  } else if(crypto_workers > 0) {
+    pool_schedule(&crypto_pool, &conn->output);
   }
-#endif
 }
 
 /**
- * Initialise the semaphores
+ * Add a connection to the connections of its link
+ *
+ * @return 0 on succes
+ *       < 0 when MAX_ACTIVE_CONNECTIONS is reached
  */
-static void init_sem()
+static int attach_connection(struct s_conn *conn)
 {
-#ifdef __linux__
-  if(sem_init(&serial2tcp_queue_sem, 1, 0) < 0) {
-    perror("sem_init failed");
-    exit(-1);
-  }
-  if(sem_init(&tcp2serial_queue_sem, 1, 0) < 0) {
-    perror("sem_init failed");
-    exit(-1);
-  }
-  if(sem_init(&thread_started_sem, 1, 0) < 0) {
-    perror("sem_init failed");
-    exit(-1);
-  }
-#elif _WIN32
-  serial2tcp_queue_sem = CreateSemaphore(NULL, 0, MAX_SEM_COUNT, NULL);
-  if(serial2tcp_queue_sem == NULL) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
-  }
-  tcp2serial_queue_sem = CreateSemaphore(NULL, 0, MAX_SEM_COUNT, NULL);
-  if(tcp2serial_queue_sem == NULL) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
-  }
-  thread_started_sem = CreateSemaphore(NULL, 0, MAX_SEM_COUNT, NULL);
-  if(thread_started_sem == NULL) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
+  int i;
+  int ret = -1;
+  struct s_link *link = conn->link;
+
+  mutex_lock(&link->conns_lock);
+  for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+    if(link->conns[i] == NULL) {
+      link->conns[i] = conn;
+      ret = 0;
+      break;
+    }
   }
-#endif
+  // The output from here on is replayed when it goes live,
+  // without history it is queued right away
+  conn->history_seq = link->history.head;
+  conn->live = (link->history.size <= 0 || conn->shm != NULL || conn->relay != NULL);
+  mutex_unlock(&link->conns_lock);
+  return ret;
 }
 
 /**
- * Lock the queue
+ * Stop a connection, must hold the conns lock
  */
-static void lock_queue(int queue)
+static void stop_connection(struct s_conn *conn)
 {
-  if(queue == DIVIDI_SERIAL2TCP_QUEUE) {
-#ifdef __linux__
-    if(pthread_mutex_lock(&serial2tcp_queue_lock) < 0) {
-      perror("pthread_mutex_lock failed");
-      exit(-1);
+  int i;
+  struct s_link *link = conn->link;
+
+  if(conn->running) {
+    conn->running = 0;
+    if(conn->spilling) {
+      conn->spilling = 0;
+      link->spill.readers--;
     }
-#elif _WIN32
-    if(WaitForSingleObject(serial2tcp_queue_lock, INFINITE) < 0) {
-      fprintf(stderr, "%d", WSAGetLastError());
-      exit(-1);
+    for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+      if(link->conns[i] == conn) {
+        link->conns[i] = NULL;
+      }
     }
-#endif
-  } else if(queue == DIVIDI_TCP2SERIAL_QUEUE) {
+    if(conn->shm == NULL && conn->relay == NULL) {
 #ifdef __linux__
-    if(pthread_mutex_lock(&tcp2serial_queue_lock) < 0) {
-      perror("pthread_mutex_lock failed");
-      exit(-1);
-    }
+      shutdown(conn->tcp_socket, SHUT_RDWR);
 #elif _WIN32
-    if(WaitForSingleObject(tcp2serial_queue_lock, INFINITE) < 0) {
-      fprintf(stderr, "%d", WSAGetLastError());
-      exit(-1);
-    }
+      shutdown(conn->tcp_socket, SD_BOTH);
 #endif
+    }
+    conn_wakeup(conn);
   }
 }
 
 /**
- * Unlock the queue mutex
+ * Stop a connection, both connection handlers
+ * will exit and release their reference
  */
-static void unlock_queue(int queue)
+static void close_connection(struct s_conn *conn)
 {
-  if(queue == DIVIDI_SERIAL2TCP_QUEUE) {
-#ifdef __linux__
-    if(pthread_mutex_unlock(&serial2tcp_queue_lock) < 0) {
-      perror("pthread_mutex_lock failed");
-      exit(-1);
+  struct s_link *link = conn->link;
+
+  mutex_lock(&link->conns_lock);
+  stop_connection(conn);
+  mutex_unlock(&link->conns_lock);
+}
+
+/**
+ * Start the connection handlers thread
+ */
+static int start_connection_handlers(struct s_conn *conn)
+{
+  int nbr_of_references = 0;
+  int cpu = conn->link->worker->cpu;
+
+  if(thread_start((THREAD_FUNC) tcp_in_handler, conn, cpu) == 0) {
+    nbr_of_references++;
+  }
+  // The pool holds the reference of the output thread
+  if(crypto_workers > 0 ||
+     thread_start((THREAD_FUNC) tcp_out_handler, conn, cpu) == 0) {
+    nbr_of_references++;
+  }
+  return nbr_of_references;
+}
+
+/**
+ * Divide the links over the workers, links sharing
+ * a serial device are handled by the same worker,
+ * the first of them owns the port
+ */
+static void assign_workers()
+{
+  int i, j;
+  int next = 0;
+
+  for(i = 0; i < total_workers; i++) {
+    workers[i].id = i;
+    workers[i].cpu = (i < total_worker_cpus) ? worker_cpus[i] : NO_CPU_AFFINITY;
+    workers[i].total_links = 0;
+  }
+  for(i = 0; i < MAX_LINKS; i++) {
+    if(links[i].tcp_port == 0) {
+      continue;
     }
-#elif _WIN32
-    if(!ReleaseMutex(serial2tcp_queue_lock)) {
-      fprintf(stderr, "%d", WSAGetLastError());
-      exit(-1);
+    links[i].worker = NULL;
+    links[i].port = &links[i];
+    for(j = 0; j < i; j++) {
+      if(links[j].tcp_port != 0 &&
+         strcmp(links[i].serial.str_serial_port, links[j].serial.str_serial_port) == 0) {
+        links[i].worker = links[j].worker;
+        links[i].port = &links[j];
+        break;
+      }
     }
-#endif
-  } else if(queue == DIVIDI_TCP2SERIAL_QUEUE) {
-#ifdef __linux__
-    if(pthread_mutex_unlock(&tcp2serial_queue_lock) < 0) {
-      perror("pthread_mutex_lock failed");
-      exit(-1);
+    // The ports of an aggregate are written by the worker of its first port
+    if(links[i].worker == NULL && links[i].aggregate != NULL &&
+       links[i].aggregate != &links[i]) {
+      links[i].worker = links[i].aggregate->worker;
     }
-#elif _WIN32
-    if(!ReleaseMutex(tcp2serial_queue_lock)) {
-      fprintf(stderr, "%d", WSAGetLastError());
+    if(links[i].worker == NULL) {
+      links[i].worker = &workers[next];
+      next = (next + 1) % total_workers;
+    }
+    if(links[i].aggregate != NULL && links[i].worker != links[i].aggregate->worker) {
+      fprintf(stderr, "%s: shared with a link outside of the aggregate on port %d\n",
+              links[i].serial.str_serial_port, links[i].tcp_port);
       exit(-1);
     }
-#endif
+    links[i].worker->total_links++;
+    dbg("link %d (%s) -> worker %d\n", links[i].tcp_port,
+        links[i].serial.str_serial_port, links[i].worker->id);
   }
 }
 
 /**
- * Initialise the queue mutex
+ * This function will start the worker
+ * threads
  */
-static void create_queues_lock()
+static void start_workers()
 {
-#ifdef __linux__
-  if(pthread_mutex_init(&serial2tcp_queue_lock, NULL) != 0) {
-    perror("phthread_mutex_init failed");
-    exit(-1);
-  }
-  if(pthread_mutex_init(&tcp2serial_queue_lock, NULL) != 0) {
-    perror("phthread_mutex_init failed");
-    exit(-1);
-  }
-#elif _WIN32
-  serial2tcp_queue_lock = CreateMutex(NULL, FALSE, NULL);
-  if(serial2tcp_queue_lock == NULL) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
+  int i;
+  struct s_worker *worker;
+
+  if(io_engine == IO_ENGINE_URING && !uring_available()) {
+    fprintf(stderr, "io_uring unavailable, falling back to poll\n");
+    io_engine = IO_ENGINE_POLL;
   }
-  tcp2serial_queue_lock = CreateMutex(NULL, FALSE, NULL);
-  if(tcp2serial_queue_lock == NULL) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
+#ifdef HAVE_URING
+  if(io_engine == IO_ENGINE_URING) {
+    // Reads stay armed in the kernel, they must block instead of failing
+    for(i = 0; i < MAX_LINKS; i++) {
+      if(links[i].tcp_port != 0) {
+        fcntl(links[i].serial.serial_port, F_SETFL,
+              fcntl(links[i].serial.serial_port, F_GETFL) & ~O_NONBLOCK);
+      }
+    }
   }
 #endif
+  for(i = 0; i < total_workers; i++) {
+    worker = &workers[i];
+    queue_create(&worker->tcp2serial_queue);
+    worker->running = 1;
+    if(thread_start((THREAD_FUNC) serial_in_handler, worker, worker->cpu) < 0 ||
+       thread_start((THREAD_FUNC) serial_out_handler, worker, worker->cpu) < 0) {
+      exit(-1);
+    }
+  }
 }
 
 /**
- * Initialise the serial mutex
+ * Queue a reply for a client, in the protocol of the client
  */
-static void create_serial_lock()
+static void deliver_reply(struct s_conn *conn, unsigned int tag,
+                          unsigned char *reply, int length)
 {
-#ifdef __linux__
-  if(pthread_mutex_init(&serial_lock, NULL) != 0) {
-    perror("phthread_mutex_init failed");
-    exit(-1);
-  }
-#elif _WIN32
-  serial_lock = CreateMutex(NULL, FALSE, NULL);
-  if(serial_lock == NULL) {
-    fprintf(stderr, "%d", WSAGetLastError());
-    exit(-1);
+  char *message;
+
+  if(conn->link->protocol == PROTOCOL_MODBUS_TCP) {
+    message = (char *) malloc(MODBUS_TCP_MAX_ADU);
+    length = modbus_rtu_to_tcp(reply, length, (unsigned char *) message, tag);
+  } else {
+    message = (char *) malloc(length);
+    memcpy(message, reply, length);
   }
-#endif
+  client_queue_add(conn, message, length, 0);
 }
 
-
 /**
- * Start the connection handlers thread
+ * Tell a Modbus TCP client the device didn't answer,
+ * RTU clients just time out like on a real bus
  */
-static int start_connection_handlers(struct s_conn *conn)
+static void deliver_failure(struct s_conn *conn, unsigned int tag,
+                            unsigned char unit, unsigned char function)
 {
-  int nbr_of_references = 0;
-#ifdef __linux__
-  pthread_t in_tcp;
-  pthread_t out_tcp;
-  nbr_of_references++;
-  pthread_create( &in_tcp, NULL, tcp_in_handler, conn);
-  nbr_of_references++;
-  pthread_create( &out_tcp, NULL, tcp_out_handler, conn);
-#elif _WIN32
-  nbr_of_references++;
-  CreateThread(NULL, 0, tcp_in_handler, conn, 0, NULL);
-  nbr_of_references++;
-  CreateThread(NULL, 0, tcp_out_handler, conn, 0, NULL);
-#endif
-  return nbr_of_references;
+  unsigned char reply[MODBUS_RTU_MAX_ADU];
+  int length;
+
+  if(conn->link->protocol == PROTOCOL_MODBUS_TCP) {
+    length = modbus_exception(unit, function, MODBUS_GATEWAY_TARGET_FAILED, reply);
+    deliver_reply(conn, tag, reply, length);
+  }
 }
 
 /**
- * This function will start the queue
- * handler thread
+ * Queue a reply for the requester of the transaction
+ * of a port
  */
-static void start_queues_handlers()
+static void transaction_reply(struct s_link *port, unsigned char *reply, int length)
 {
-#ifdef __linux__
-  pthread_t in;
-  pthread_t out;
-  pthread_create( &in, NULL, serial_in_handler, NULL);
-  pthread_create( &out, NULL, serial_out_handler, NULL);
-#elif _WIN32
-  CreateThread(NULL, 0, serial_in_handler, NULL, 0, NULL);
-  CreateThread(NULL, 0, serial_out_handler, NULL, 0, NULL);
-#endif
+  deliver_reply(port->transaction.conn, port->transaction.tag, reply, length);
 }
 
 /**
- * The serial out handler thread
- * The messages are threated according
- * the first in- first out principle
+ * Tell the requester of the transaction of a port
+ * the device didn't answer
  */
-#ifdef __linux__
-static void *serial_out_handler()
-#elif _WIN32
-static DWORD WINAPI serial_out_handler()
-#endif
+static void transaction_fail(struct s_link *port)
 {
-  struct s_entry *entry;
-  struct s_link *link;
-  int index = 0;
-  HANDLE serial_port;
-
-  tcp2serial_queue_running = 1;
-  while(tcp2serial_queue_running) {
-    get_queue_sem(DIVIDI_TCP2SERIAL_QUEUE);
-    index = tcp2serial_queue_start;
-    lock_queue(DIVIDI_TCP2SERIAL_QUEUE);
-    entry = tcp2serial_queue[index];
-    //Check if conn is still active
-    if(entry->conn != NULL) {
-      link = entry->conn->link;
-      serial_port = link->serial.serial_port;
-
-      dbg("serial_write %s", entry->message);
-      if(serial_write(serial_port, entry->message) < 0) {
-        exit(-1);
-      }
-    }
-    // Don't free conn! It's still used by the conenction thread
-    free(entry->message);
-    free(entry);
+  struct s_transaction *transaction = &port->transaction;
 
-    tcp2serial_queue_start = (tcp2serial_queue_start+1) % QUEUE_SIZE;
-    unlock_queue(DIVIDI_TCP2SERIAL_QUEUE);
-  }
-  tcp2serial_queue_running = -1;
-#ifdef __linux__
-  return NULL;
-#elif _WIN32
-  return 0;
-#endif
+  deliver_failure(transaction->conn, transaction->tag, transaction->unit, transaction->function);
 }
 
 /**
- * The queue handler thread
- * The messages are threated according
- * the first in- first out principle
+ * Answer the clients that were waiting on an identical request
+ * that was in flight, the reply is cached for the next ones
+ *
+ * @reply NULL when the device didn't answer
+ * @retry the waiters send their own request instead, the
+ *        request didn't make it or the reply can't be cached
  */
-#ifdef __linux__
-static void *tcp_in_handler(void *_conn)
-#elif _WIN32
-static DWORD WINAPI tcp_in_handler( LPVOID _conn )
-#endif
+static void request_complete(struct s_link *link, char *request, int length,
+                             unsigned char *reply, int reply_length, int retry)
 {
-  struct s_conn conn;
-  char *message;
-  int bytes_read;
+  struct s_cache_waiter *waiter;
+  struct s_cache_waiter *next;
+  char *copy;
 
-  memcpy(&conn, _conn, sizeof(struct s_conn));
-  release_thread_started_sem();
-  in_tcp_running = 1;
-  while(in_tcp_running) {
-    message = receive_message(conn.socket, &bytes_read);
-    if(bytes_read) {
-      tcp2serial_queue_add(&conn, message);
-      release_queue_sem(DIVIDI_TCP2SERIAL_QUEUE, 1);
+  if(link->cache.ttl <= 0) {
+    return;
+  }
+  waiter = cache_complete(&link->cache, request, length,
+                          retry ? NULL : (char *) reply, reply_length);
+  for(; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    if(retry) {
+      copy = (char *) malloc(length);
+      memcpy(copy, request, length);
+      tcp2serial_queue_add(waiter->conn, copy, length, waiter->tag);
+    } else if(reply != NULL) {
+      deliver_reply(waiter->conn, waiter->tag, reply, reply_length);
+    } else {
+      deliver_failure(waiter->conn, waiter->tag, request[0], request[1]);
     }
+    conn_put(waiter->conn);
+    free(waiter);
   }
-  SSL_free(conn.socket);
-  close(conn.tcp_socket);
-#ifdef __linux__
-  return NULL;
-#elif _WIN32
-  return 0;
-#endif
 }
 
 /**
- * The serial2tcp_queue handler thread
- * The messages are threated according
- * the first in- first out principle
+ * Complete the request of the transaction of a port,
+ * must hold the transaction lock
  *
- * in = serial device -> tcp
+ * @ok the reply in the transaction is complete
  */
-#ifdef __linux__
-static void *serial_in_handler()
-#elif _WIN32
-static DWORD WINAPI serial_in_handler()
-#endif
+static void transaction_complete(struct s_link *port, int ok)
 {
-  int index = 0;
-  int index2 = 0;
-  char *message;
-  int bytes_read;
+  struct s_transaction *transaction = &port->transaction;
+  struct s_entry *request = port->pending;
 
-  serial2tcp_queue_running = 1;
-  while(serial2tcp_queue_running) {
-    for(index=0; index<total_links; index++) {
-      message = serial_read(links[index].serial.serial_port, &bytes_read);
-      if(bytes_read > 0) {
-        serial2tcp_queue_add(&links[index], message);
-        //are other ports listening to the same serial device?
-        for(index2=0; index2<total_links; index2++) {
-          if(index2 == index) {
-            continue;
-          }
-          if(links[index].serial.serial_port == links[index2].serial.serial_port) {
-            serial2tcp_queue_add(&links[index2], message);
-          }
-        }
-        // Every socket has to distinguish for itself if the queue entry's
-        // are for him (ugly, to be improved)
-        release_queue_sem(DIVIDI_SERIAL2TCP_QUEUE, total_links);
-      }
-      free(message);
-    }
+  if(!ok) {
+    request_complete(request->conn->link, request->message, request->length, NULL, 0, 0);
+  } else if(transaction->reply_length > TRANSACTION_REPLY_MAX) {
+    request_complete(request->conn->link, request->message, request->length, NULL, 0, 1);
+  } else {
+    request_complete(request->conn->link, request->message, request->length,
+                     transaction->reply, transaction->reply_length, 0);
   }
-  serial2tcp_queue_running = -1;
-#ifdef __linux__
-  return NULL;
-#elif _WIN32
-  return 0;
-#endif
 }
+
 /**
- * The queue handler thread
- * The messages are threated according
- * the first in- first out principle
- * serial_in(serial_in_handler) -> serial2tcp_queue -> tcp_out
- * out_tcp -> tcp2serial_queue -> serial_out(serial_out_handler)
+ * A request was dropped before it reached the port,
+ * the clients waiting on it send their own
  */
-#ifdef __linux__
-static void *tcp_out_handler(void *_conn)
-#elif _WIN32
-static DWORD WINAPI tcp_out_handler( LPVOID _conn )
-#endif
+static void request_dropped(struct s_entry *entry)
 {
-  struct s_conn conn;
-  struct s_link *queue_link;
-  struct s_link *link;
-
-  memcpy(&conn, _conn, sizeof(struct s_conn));
-  release_thread_started_sem();
-  link = conn.link;
-  out_tcp_running = 1;
-  while(out_tcp_running) {
-    get_queue_sem(DIVIDI_SERIAL2TCP_QUEUE);
-    queue_link = serial2tcp_queue[serial2tcp_queue_start]->conn->link;
-    if(queue_link->tcp_port == link->tcp_port)
-    {
-      send_message(conn.socket, serial2tcp_queue[serial2tcp_queue_start]->message);
-      lock_queue(DIVIDI_SERIAL2TCP_QUEUE);
-      free(serial2tcp_queue[serial2tcp_queue_start]->message);
-      // Can free conn, doesnt hold socket
-      free(serial2tcp_queue[serial2tcp_queue_start]->conn);
-      free(serial2tcp_queue[serial2tcp_queue_start]);
-      serial2tcp_queue_start = (serial2tcp_queue_start + 1) % QUEUE_SIZE;
-      unlock_queue(DIVIDI_SERIAL2TCP_QUEUE);
-    }
-  }
-  SSL_free(conn.socket);
-#ifdef __linux__
-  return NULL;
-#elif _WIN32
-  return 0;
-#endif
+  if(entry->conn->link->protocol != PROTOCOL_RAW) {
+    request_complete(entry->conn->link, entry->message, entry->length, NULL, 0, 1);
+  }
 }
 
 /**
- * Add a receive message to
- * the queue
+ * Queue a request for the serial port, unless the cache
+ * of the link can answer it or an identical request is
+ * already in flight
  */
-static void tcp2serial_queue_add(struct s_conn *conn, char *message)
+static void request_add(struct s_conn *conn, char *request, int length, unsigned int tag)
 {
-  struct s_entry *entry = (struct s_entry *) malloc(sizeof(struct s_entry));
-  entry->message = message;
-  entry->conn = conn;
-  lock_queue(DIVIDI_TCP2SERIAL_QUEUE);
-  tcp2serial_queue[tcp2serial_queue_index] = entry;
-  tcp2serial_queue_index = (tcp2serial_queue_index+1) % QUEUE_SIZE;
-  unlock_queue(DIVIDI_TCP2SERIAL_QUEUE);
-  dbg("added %s", message);
+  struct s_link *link = conn->link;
+  char *reply;
+  int reply_length;
+
+  // Nobody answers a Modbus broadcast
+  if(link->cache.ttl <= 0 ||
+     (link->protocol != PROTOCOL_REQUEST_REPLY && request[0] == MODBUS_BROADCAST)) {
+    tcp2serial_queue_add(conn, request, length, tag);
+    return;
+  }
+  // Held by the cache while waiting
+  conn_get(conn);
+  switch(cache_lookup(&link->cache, request, length, conn, tag, &reply, &reply_length)) {
+  case CACHE_HIT:
+    deliver_reply(conn, tag, (unsigned char *) reply, reply_length);
+    free(reply);
+    free(request);
+    conn_put(conn);
+    break;
+  case CACHE_IN_FLIGHT:
+    free(request);
+    break;
+  default:
+    conn_put(conn);
+    tcp2serial_queue_add(conn, request, length, tag);
+  }
 }
 
 /**
- * Add a serial message to
- * the queue
+ * Release the bus of a port, must hold the transaction lock
  */
-static void serial2tcp_queue_add(struct s_link *link, char *message)
+static void transaction_end(struct s_link *port)
 {
-  struct s_entry *entry = (struct s_entry *) malloc(sizeof(struct s_entry));
-  entry->conn = (struct s_conn *) malloc(sizeof(struct s_conn));
-  entry->message = (char *) malloc(strlen(message));
-  memcpy(entry->message, message, strlen(message));
-  entry->conn->link = link;
-  lock_queue(DIVIDI_SERIAL2TCP_QUEUE);
-  serial2tcp_queue[serial2tcp_queue_index] = entry;
-  serial2tcp_queue_index = (serial2tcp_queue_index+1) % QUEUE_SIZE;
-  unlock_queue(DIVIDI_SERIAL2TCP_QUEUE);
-  dbg("added %s", message);
+  struct s_transaction *transaction = &port->transaction;
+
+  transaction->idle = time_us();
+  if(transaction->conn != NULL) {
+    conn_put(transaction->conn);
+    transaction->conn = NULL;
+  }
+  // The writer may be waiting for the reply
+  queue_wakeup(&port->worker->tcp2serial_queue);
 }
 
 /**
- * Receive a message over a given socket
+ * Start the transaction of a request that is
+ * about to be written to a port
  */
-static char *receive_message(SSL *ns, int *total_bytes_read)
+static void transaction_begin(struct s_link *port, struct s_entry *entry)
 {
-  int bytes_read;
-  int total_read = 0;
-  char *data = (char *) malloc(TCP_DATA_CHUNK_SIZE);
-  char *pos = data;
-  while(1) {
-    bytes_read = SSL_read(ns, pos, TCP_DATA_CHUNK_SIZE);
-    if(!bytes_read || ((total_read+=bytes_read) >= TCP_DATA_MAX)) {
-      break;
-    }
-    if(bytes_read != TCP_DATA_CHUNK_SIZE) {
-      // TImeout occured
-      break;
-    }
-    data = (char *) realloc(data, total_read+TCP_DATA_CHUNK_SIZE+1);
-    pos = data + total_read;
+  struct s_transaction *transaction = &port->transaction;
+
+  mutex_lock(&port->transaction_lock);
+  if(entry->conn->link->protocol != PROTOCOL_REQUEST_REPLY) {
+    transaction->unit = entry->message[0];
+    transaction->function = entry->message[1];
   }
-  data[total_read] = '\0';
-  *total_bytes_read = total_read;
-  return data;
+  transaction->tag = entry->tag;
+  transaction->deadline = 0;
+  transaction->idle = 0;
+  transaction->input = 0;
+  transaction->matched = 0;
+  transaction->reply_length = 0;
+  transaction->total++;
+  // Nobody answers a Modbus broadcast
+  if(entry->conn->link->protocol == PROTOCOL_REQUEST_REPLY ||
+     transaction->unit != MODBUS_BROADCAST) {
+    transaction->conn = entry->conn;
+    conn_get(transaction->conn);
+  }
+  mutex_unlock(&port->transaction_lock);
 }
 
 /**
- * send a message over a given socket
+ * Start waiting on the reply once the request
+ * is handed to the driver
  */
-static int send_message(SSL *ns, char *message)
+static void transaction_written(struct s_link *port)
 {
-  if(!SSL_write(ns, message, strlen(message))) {
-    print_error("send failed");
-    return -1;
+  struct s_transaction *transaction = &port->transaction;
+  struct s_link *link = port->pending->conn->link;
+  int rate = serial_line_rate(&port->serial);
+  long long timeout;
+
+  timeout = (transaction->conn == NULL) ? link->broadcast_delay : link->reply_timeout;
+  timeout *= 1000;
+  // The request still has to leave the driver
+  if(rate > 0) {
+    timeout += port->pending_length * 1000000LL / rate;
   }
-  return 0;
+  mutex_lock(&port->transaction_lock);
+  transaction->deadline = time_us() + timeout;
+  mutex_unlock(&port->transaction_lock);
 }
 
 /**
- * This function will close a given socketd
- * @param s the socket identifier
+ * Check if the transaction of a port is done and the
+ * bus was silent for 3.5 characters, so the next request
+ * can follow back to back
+ *
+ * @wait_ms will be lowered to the time untill that happens
  */
-static void close_socket(int s)
+static int transaction_done(struct s_link *port, int *wait_ms)
 {
-  int status = 0;
-#ifdef __linux__
-  status = shutdown(s, SHUT_RDWR);
-  if (status == 0) {
-    status = close(s);
+  struct s_transaction *transaction = &port->transaction;
+  struct s_link *link = port->pending->conn->link;
+  long long now = time_us();
+  long long deadline;
+  long long wait;
+  int gap = 0;
+
+  if(link->protocol != PROTOCOL_REQUEST_REPLY) {
+    gap = modbus_silent_interval(port->serial.actual_baudrate ?
+                                 port->serial.actual_baudrate : port->serial.baudrate);
   }
-#elif _WIN32
-  status = shutdown(s, SD_BOTH);
-  if (status == 0) {
-    status = closesocket(s);
+  mutex_lock(&port->transaction_lock);
+  if(transaction->idle == 0) {
+    deadline = transaction->deadline;
+    // Without reply_end, silence ends a reply
+    if(link->protocol == PROTOCOL_REQUEST_REPLY && link->reply_end_length == 0 &&
+       transaction->input) {
+      deadline = transaction->input + link->reply_gap * 1000LL;
+    }
+    if(now < deadline) {
+      mutex_unlock(&port->transaction_lock);
+      wait = (deadline - now) / 1000 + 1;
+      if(*wait_ms < 0 || wait < *wait_ms) {
+        *wait_ms = wait;
+      }
+      return 0;
+    }
+    // A started reply of request_reply is complete
+    if(transaction->conn != NULL &&
+       (link->protocol != PROTOCOL_REQUEST_REPLY || transaction->reply_length == 0)) {
+      dbg("no reply from unit %d\n", transaction->unit);
+      transaction->timeouts++;
+      transaction_fail(port);
+      transaction_complete(port, 0);
+    } else if(transaction->conn != NULL) {
+      transaction_complete(port, 1);
+    }
+    transaction_end(port);
   }
-  WSACleanup();
+  wait = transaction->idle + gap - now;
+  mutex_unlock(&port->transaction_lock);
+  if(wait >= 1000) {
+    if(*wait_ms < 0 || wait / 1000 < *wait_ms) {
+      *wait_ms = wait / 1000;
+    }
+    return 0;
+  }
+  // Too short to go through the scheduler
+  if(wait > 0) {
+#ifdef __linux__
+    usleep(wait);
+#elif _WIN32
+    Sleep(1);
 #endif
+  }
+  return 1;
 }
 
 /**
- * This function will deallocate the queue
+ * Forward the reply of a request_reply transaction as it
+ * arrives, must hold the transaction lock
+ *
+ * @return the amount of bytes that belong to the reply
  */
-static void deallocate_queues()
+static int transaction_stream(struct s_link *port, char *data, int length)
 {
-  int i;
-  if(serial2tcp_queue) {
-    for(i = 0; i<QUEUE_SIZE; i++) {
-      if(serial2tcp_queue[i] != NULL) {
-        free(serial2tcp_queue[i]);
+  struct s_transaction *transaction = &port->transaction;
+  struct s_link *link = transaction->conn->link;
+  int i = 0;
+
+  if(link->reply_end_length == 0) {
+    i = length;
+  }
+  while(i < length && transaction->matched < link->reply_end_length) {
+    if(data[i] == link->reply_end[transaction->matched]) {
+      transaction->matched++;
+    } else {
+      transaction->matched = (data[i] == link->reply_end[0]);
+    }
+    i++;
+  }
+  transaction_reply(port, (unsigned char *) data, i);
+  // Keep the reply for the cache
+  if(transaction->reply_length + i <= TRANSACTION_REPLY_MAX) {
+    memcpy(transaction->reply + transaction->reply_length, data, i);
+  }
+  transaction->reply_length += i;
+  transaction->input = time_us();
+  if(link->reply_end_length && transaction->matched == link->reply_end_length) {
+    transaction_complete(port, 1);
+    transaction_end(port);
+  } else {
+    // The writer times the silence after the reply
+    queue_wakeup(&port->worker->tcp2serial_queue);
+  }
+  return i;
+}
+
+/**
+ * Hand data read from a serial port to the requester of the
+ * running transaction, or to every client of the port
+ */
+static void serial_input(struct s_link *port, char *data, int length)
+{
+  struct s_transaction *transaction = &port->transaction;
+  int reply_length;
+
+  if(port->capture) {
+    capture_add(port->capture, port->tcp_port, 0, CAPTURE_FROM_SERIAL, data, length);
+  }
+  mutex_lock(&port->transaction_lock);
+  if(transaction->conn == NULL) {
+    mutex_unlock(&port->transaction_lock);
+    serial2tcp_queue_add(port, data, length);
+    return;
+  }
+  if(transaction->conn->link->protocol == PROTOCOL_REQUEST_REPLY) {
+    reply_length = transaction_stream(port, data, length);
+    mutex_unlock(&port->transaction_lock);
+    // What follows the reply is unsolicited
+    if(reply_length < length) {
+      serial2tcp_queue_add(port, data + reply_length, length - reply_length);
+    }
+    return;
+  }
+  if(length > MODBUS_RTU_MAX_ADU - transaction->reply_length) {
+    length = MODBUS_RTU_MAX_ADU - transaction->reply_length;
+  }
+  memcpy(transaction->reply + transaction->reply_length, data, length);
+  transaction->reply_length += length;
+  reply_length = modbus_rtu_reply_length(transaction->reply, transaction->reply_length,
+                                         transaction->function);
+  if(reply_length > 0 && transaction->reply[0] == transaction->unit) {
+    transaction->reply_length = reply_length;
+    transaction_reply(port, transaction->reply, reply_length);
+    transaction_complete(port, 1);
+    transaction_end(port);
+  } else if(reply_length != 0) {
+    dbg("invalid reply from unit %d\n", transaction->unit);
+    transaction_fail(port);
+    transaction_complete(port, 0);
+    transaction_end(port);
+  }
+  mutex_unlock(&port->transaction_lock);
+}
+
+/**
+ * Split the data of a client speaking a framed protocol
+ * in requests, every request is a transaction on the bus
+ */
+static void client_requests(struct s_conn *conn, char *data, int length)
+{
+  unsigned char rtu[MODBUS_RTU_MAX_ADU];
+  unsigned int tid = 0;
+  int request_length;
+  int rtu_length;
+  int copy;
+  char *request;
+
+  while(length > 0) {
+    copy = sizeof(conn->request) - conn->request_length;
+    copy = (length < copy) ? length : copy;
+    memcpy(conn->request + conn->request_length, data, copy);
+    conn->request_length += copy;
+    data += copy;
+    length -= copy;
+    while(conn->request_length > 0) {
+      if(conn->link->protocol == PROTOCOL_MODBUS_TCP) {
+        request_length = modbus_tcp_request_length(conn->request, conn->request_length);
+      } else {
+        request_length = modbus_rtu_request_length(conn->request, conn->request_length);
+      }
+      if(request_length == 0 && conn->request_length < sizeof(conn->request)) {
+        break;
+      }
+      if(request_length <= 0) {
+        // Lost track of the framing, start over
+        dbg("invalid request from client %d\n", conn->id);
+        conn->request_length = 0;
+        break;
+      }
+      if(conn->link->protocol == PROTOCOL_MODBUS_TCP) {
+        rtu_length = modbus_tcp_to_rtu(conn->request, request_length, rtu, &tid);
+      } else {
+        rtu_length = request_length;
+        memcpy(rtu, conn->request, rtu_length);
       }
+      request = (char *) malloc(rtu_length);
+      memcpy(request, rtu, rtu_length);
+      request_add(conn, request, rtu_length, tid);
+      conn->request_length -= request_length;
+      memmove(conn->request, conn->request + request_length, conn->request_length);
+    }
+  }
+}
+
+/**
+ * Split the frames of a client of an aggregate over
+ * the ports, takes the message
+ */
+static void aggregate_input(struct s_conn *conn, char *message, int length)
+{
+  char *payload;
+  char *data;
+  int payload_length;
+  int offset = 0;
+  int tag;
+
+  while(offset < length) {
+    offset += aggregate_parse(&conn->aggregate, message + offset, length - offset,
+                              &tag, &payload, &payload_length);
+    if(payload_length == 0) {
+      continue;
+    }
+    if(tag >= conn->link->total_members) {
+      dbg("client %d wrote to unknown port %d\n", conn->id, tag);
+      continue;
+    }
+    data = (char *) malloc(payload_length);
+    memcpy(data, payload, payload_length);
+    tcp2serial_queue_add(conn, data, payload_length, tag);
+  }
+  free(message);
+}
+
+/**
+ * Release a tcp2serial entry and its reference
+ * on the connection
+ */
+static void release_entry(struct s_entry *entry)
+{
+  struct s_conn *conn = entry->conn;
+  int length = entry->length;
+  int backlog = __sync_sub_and_fetch(&conn->serial_backlog, length);
+
+  // Wake up the tcp in handler when the backlog dropped below the limit
+  if(backlog < SERIAL_BACKLOG_MAX && backlog + length >= SERIAL_BACKLOG_MAX) {
+    semaphore_post(&conn->backlog_sem, 1);
+  }
+  conn_put(entry->conn);
+  free(entry->message);
+  free(entry);
+}
+
+/**
+ * Block untill the serial backlog of a client dropped
+ * below SERIAL_BACKLOG_MAX or the client stopped
+ */
+static void serial_backlog_wait(struct s_conn *conn)
+{
+  while(conn->running && conn->serial_backlog >= SERIAL_BACKLOG_MAX) {
+    semaphore_timedwait(&conn->backlog_sem, WORKER_POLL_TIMEOUT);
+  }
+}
+
+/**
+ * Hand the next tcp2serial entries of the scheduler
+ * to the idle serial ports of the worker
+ *
+ * @timeout_ms how long to wait for a first entry, -1 blocks
+ */
+static void fill_ports(struct s_worker *worker, int timeout_ms)
+{
+  struct s_entry *entry;
+  struct s_link *port;
+
+  while((entry = sched_next(worker, timeout_ms)) != NULL) {
+    timeout_ms = 0;
+    //Check if conn is still active
+    if(!entry->conn->running) {
+      request_dropped(entry);
+      release_entry(entry);
+      continue;
+    }
+    port = entry->port;
+    port->pending = entry;
+    port->pending_offset = 0;
+    port->pending_length = entry->length;
+    if(entry->conn->link->protocol != PROTOCOL_RAW) {
+      transaction_begin(port, entry);
     }
-    free(serial2tcp_queue);
   }
-  if(tcp2serial_queue) {
-    for(i = 0; i<QUEUE_SIZE; i++) {
-      if(tcp2serial_queue[i] != NULL) {
-        free(tcp2serial_queue[i]);
+}
+
+/**
+ * Check if the RS-485 transmit window of a port is closed,
+ * the bus is released rs485_turnaround ms after the last
+ * byte left the transmitter so the reply isn't clobbered
+ *
+ * @wait_ms will be lowered to the time untill the window closes
+ */
+static int port_window_closed(struct s_link *port, int *wait_ms)
+{
+  long long now = time_ms();
+  int wait = 1;
+
+  if(port->window_end == 0) {
+    if(!serial_transmit_done(port->serial.serial_port)) {
+      if(*wait_ms < 0 || wait < *wait_ms) {
+        *wait_ms = wait;
       }
+      return 0;
+    }
+    port->window_end = now + port->serial.rs485_delay_after + port->serial.rs485_turnaround;
+  }
+  if(now < port->window_end) {
+    wait = port->window_end - now;
+    if(*wait_ms < 0 || wait < *wait_ms) {
+      *wait_ms = wait;
     }
-    free(tcp2serial_queue);
+    return 0;
   }
+  port->window_end = 0;
+  return 1;
 }
 
 /**
- * Allocates a message queue
+ * Decide how much of the pending entry of a port may be
+ * handed to the driver now, the rest stays queued in dividi
+ *
+ * @wait_ms will be lowered to the time untill the port can
+ *          take more data
+ * @return the amount of bytes, 0 when the port has to drain first
  */
-static void allocate_queues()
+static int port_slice(struct s_link *port, int *wait_ms)
 {
-  int i,j;
-  serial2tcp_queue = (struct s_entry **) malloc(QUEUE_SIZE*sizeof(struct s_entry *));
-  tcp2serial_queue = (struct s_entry **) malloc(QUEUE_SIZE*sizeof(struct s_entry *));
-  if(!serial2tcp_queue || !tcp2serial_queue) {
-    print_error("malloc failed");
+  int remaining = port->pending_length - port->pending_offset;
+  int wait = 0;
+  int budget;
+
+  if(remaining == 0) {
+    // Reply or RS-485 transmit window of a written entry
+    if(port->pending->conn->link->protocol != PROTOCOL_RAW ?
+       transaction_done(port, wait_ms) : port_window_closed(port, wait_ms)) {
+      release_entry(port->pending);
+      port->pending = NULL;
+    }
+    return 0;
+  }
+  budget = serial_write_budget(&port->serial, &wait);
+  if(budget < 0 || budget >= remaining) {
+    return remaining;
+  }
+  if(budget == 0 && (*wait_ms < 0 || wait < *wait_ms)) {
+    *wait_ms = wait;
+  }
+  return budget;
+}
+
+/**
+ * Account written bytes to the pending entry of a port
+ */
+static void port_written(struct s_link *port, int written)
+{
+  if(port->capture && written > 0) {
+    capture_add(port->capture, port->pending->conn->link->tcp_port, port->pending->conn->id,
+                CAPTURE_TO_SERIAL, port->pending->message + port->pending_offset, written);
+  }
+  port->pending_offset += written;
+  if(port->pending_offset < port->pending_length) {
+    return;
+  }
+  // Requests and RS-485 hold the bus untill they are done
+  if(port->pending->conn->link->protocol != PROTOCOL_RAW) {
+    transaction_written(port);
+  } else if(port->serial.mode != SERIAL_MODE_RS485) {
+    release_entry(port->pending);
+    port->pending = NULL;
+  }
+}
+
+/**
+ * Write the slices of the ports one by one
+ * The slices are updated with the amount of bytes written
+ */
+static void write_ports(struct s_link **ports, int *slices, int total_ports)
+{
+  int i;
+  for(i = 0; i < total_ports; i++) {
+    if(slices[i] == 0) {
+      continue;
+    }
+    dbg("serial_write %.*s", slices[i], ports[i]->pending->message + ports[i]->pending_offset);
+    if((slices[i] = serial_write(ports[i]->serial.serial_port,
+                                 ports[i]->pending->message + ports[i]->pending_offset,
+                                 slices[i])) < 0) {
+      exit(-1);
+    }
+    port_written(ports[i], slices[i]);
+  }
+}
+
+#ifdef HAVE_URING
+/**
+ * Write the slices of all ports with a single
+ * io_uring submission, the writes are independent
+ * so a short write on one port doesn't cancel the others
+ * The slices are updated with the amount of bytes written
+ */
+static void write_ports_uring(struct s_uring *ring, struct s_link **ports,
+                              int *slices, int total_ports)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  int submitted = 0;
+  int i;
+
+  for(i = 0; i < total_ports; i++) {
+    if(slices[i] == 0) {
+      continue;
+    }
+    if((sqe = uring_get_sqe(ring)) == NULL) {
+      // Written in the next round
+      slices[i] = 0;
+      continue;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = ports[i]->serial.serial_port;
+    sqe->addr = (unsigned long) (ports[i]->pending->message + ports[i]->pending_offset);
+    sqe->len = slices[i];
+    sqe->user_data = i;
+    submitted++;
+  }
+  if(submitted == 0) {
+    return;
+  }
+  if(uring_submit_and_wait(ring, submitted) < 0) {
+    print_error("io_uring_enter failed");
     exit(-1);
   }
-  for(i = 0; i<QUEUE_SIZE; i++) {
-    serial2tcp_queue[i] = (struct s_entry *) malloc(sizeof(struct s_entry));
-    tcp2serial_queue[i] = (struct s_entry *) malloc(sizeof(struct s_entry));
-    if(!serial2tcp_queue[i] || !tcp2serial_queue[i]) {
-      for(j = 0; j<i; j++) {
-        free(serial2tcp_queue[j]);
-        free(tcp2serial_queue[j]);
-      }
-      free(serial2tcp_queue);
-      free(tcp2serial_queue);
-      print_error("malloc failed");
+  while((cqe = uring_peek_cqe(ring)) != NULL) {
+    i = cqe->user_data;
+    if(cqe->res < 0) {
+      fprintf(stderr, "serial write failed: %s\n", strerror(-cqe->res));
       exit(-1);
     }
+    slices[i] = cqe->res;
+    port_written(ports[i], cqe->res);
+    uring_cqe_seen(ring);
   }
 }
-void set_cert_file(char *value)
+#endif
+
+/**
+ * The serial out handler thread of a worker
+ * The messages of every client are threated
+ * according the first in- first out principle,
+ * the clients share the port through sched_next()
+ * and every port only gets what it can drain in time
+ */
+#ifdef __linux__
+static void *serial_out_handler(void *_worker)
+#elif _WIN32
+static DWORD WINAPI serial_out_handler(LPVOID _worker)
+#endif
 {
-  copy_file_path(cert_file, value);
+  struct s_worker *worker = (struct s_worker *) _worker;
+  struct s_link *ports[MAX_LINKS];
+  int slices[MAX_LINKS];
+  int total_ports;
+  int total_pending;
+  int written;
+  int wait_ms;
+  int i;
+#ifdef HAVE_URING
+  struct s_uring ring;
+
+  if(io_engine == IO_ENGINE_URING && uring_create(&ring, MAX_LINKS) < 0) {
+    print_error("io_uring_setup failed");
+    exit(-1);
+  }
+#endif
+
+  total_ports = get_worker_ports(worker, ports);
+  while(worker->running) {
+    wait_ms = -1;
+    for(i = 0; i < total_ports; i++) {
+      slices[i] = ports[i]->pending ? port_slice(ports[i], &wait_ms) : 0;
+    }
+#ifdef HAVE_URING
+    if(io_engine == IO_ENGINE_URING) {
+      write_ports_uring(&ring, ports, slices, total_ports);
+    } else
+#endif
+    write_ports(ports, slices, total_ports);
+
+    written = 0;
+    total_pending = 0;
+    for(i = 0; i < total_ports; i++) {
+      written |= slices[i];
+      if(ports[i]->pending) {
+        total_pending++;
+      }
+    }
+    if(total_pending == 0) {
+      fill_ports(worker, -1);
+    } else if(written) {
+      fill_ports(worker, 0);
+    } else {
+      // Every busy port is draining or its driver is full
+      fill_ports(worker, wait_ms < 0 ? SERIAL_FULL_RETRY_MS : wait_ms);
+    }
+  }
+#ifdef HAVE_URING
+  if(io_engine == IO_ENGINE_URING) {
+    uring_destroy(&ring);
+  }
+#endif
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
 }
-void set_key_file(char *value)
+
+/**
+ * Hand the data a client wrote to the serial port
+ * in the protocol of its link, takes the message
+ */
+static void client_input(struct s_conn *conn, char *message, int length)
 {
-  copy_file_path(key_file, value);
+  if(conn->link->aggregate != NULL) {
+    aggregate_input(conn, message, length);
+  } else if(conn->link->protocol == PROTOCOL_RAW) {
+    tcp2serial_queue_add(conn, message, length, 0);
+  } else if(conn->link->protocol == PROTOCOL_REQUEST_REPLY) {
+    // Every write of a request_reply client is one request
+    request_add(conn, message, length, 0);
+  } else {
+    client_requests(conn, message, length);
+    free(message);
+  }
 }
-void set_root_file(char *value)
+
+/**
+ * Agree on the compression of the output to a client, the
+ * reply "DIVIDI COMPRESS <name>\n" goes through the out queue
+ * and is the last uncompressed output, "none" when the link
+ * doesn't offer the compression
+ */
+static void session_compress(struct s_conn *conn, char *name)
 {
-  copy_file_path(root_file, value);
+  struct s_link *link = conn->link;
+  char *reply;
+
+  if(link->compression != COMPRESSION_NONE &&
+     strcmp(name, compress_name(link->compression)) == 0) {
+    // The output starts the stream once the queued output went out
+    client_queue_add(conn, NULL, 0, OUT_TAG_COMPRESS);
+    return;
+  }
+  reply = (char *) malloc(SESSION_REPLY_MAX);
+  client_queue_add(conn, reply, snprintf(reply, SESSION_REPLY_MAX, "DIVIDI COMPRESS none\n"), 0);
+}
+
+/**
+ * Give a client of a link with history or compression a moment
+ * to set up its session. The handshake is one write of one or more
+ * lines: "DIVIDI RESUME <seq>\n" replays from a sequence number,
+ * "DIVIDI LAST <bytes>\n" the last bytes and "DIVIDI COMPRESS zlib\n"
+ * asks for compressed output. The reply "DIVIDI SEQ <seq>\n" numbers
+ * the first byte that follows. Without handshake the client gets the
+ * uncompressed output since it attached: replayed from the history,
+ * or queued during the wait on a link without history.
+ *
+ * @return the first message when it isn't a handshake
+ */
+static char *session_start(struct s_conn *conn, int *bytes_read)
+{
+  struct s_link *link = conn->link;
+  unsigned long long seq = conn->history_seq;
+  unsigned long long value = 0;
+  char *message = NULL;
+  char *line;
+  char *replay;
+  char *reply;
+  char name[SESSION_REPLY_MAX];
+  int length;
+  int handshake = 0;
+  int resume = 0;
+
+  *bytes_read = 0;
+  if(SSL_pending(conn->socket) > 0 ||
+     socket_wait_readable(conn->tcp_socket, link->resume_timeout)) {
+    message = receive_message(conn->socket, bytes_read);
+    handshake = (strncmp(message, "DIVIDI ", 7) == 0);
+  }
+  for(line = message; handshake && line != NULL; line = strchr(line, '\n')) {
+    line += (*line == '\n');
+    if(sscanf(line, "DIVIDI RESUME %llu", &value) == 1) {
+      resume = 1;
+    } else if(sscanf(line, "DIVIDI LAST %llu", &value) == 1) {
+      resume = 2;
+    } else if(sscanf(line, "DIVIDI COMPRESS %31s", name) == 1) {
+      session_compress(conn, name);
+    }
+  }
+  mutex_lock(&link->conns_lock);
+  if(resume == 1) {
+    seq = value;
+  } else if(resume == 2) {
+    seq = (value < link->history.head) ? link->history.head - value : 0;
+  }
+  replay = history_read(&link->history, &seq, &length);
+  if(resume) {
+    reply = (char *) malloc(SESSION_REPLY_MAX);
+    client_queue_add(conn, reply, snprintf(reply, SESSION_REPLY_MAX, "DIVIDI SEQ %llu\n", seq), 0);
+  }
+  if(replay != NULL) {
+    client_queue_add(conn, replay, length, 0);
+  }
+  conn->live = 1;
+  mutex_unlock(&link->conns_lock);
+  if(handshake) {
+    free(message);
+    message = NULL;
+  }
+  return message;
+}
+
+/**
+ * The connection in handler thread
+ * tcp -> tcp2serial_queue of the link's worker
+ */
+#ifdef __linux__
+static void *tcp_in_handler(void *_conn)
+#elif _WIN32
+static DWORD WINAPI tcp_in_handler( LPVOID _conn )
+#endif
+{
+  struct s_conn *conn = (struct s_conn *) _conn;
+  char *message = NULL;
+  int bytes_read;
+
+  if(!conn->live || conn->link->compression != COMPRESSION_NONE) {
+    message = session_start(conn, &bytes_read);
+  }
+  while(conn->running) {
+    if(message == NULL) {
+      message = receive_message(conn->socket, &bytes_read);
+    }
+    if(conn->link->socket_profile == SOCKET_PROFILE_LOW_LATENCY) {
+      socket_quickack(conn->tcp_socket);
+    }
+    if(bytes_read > 0) {
+      client_input(conn, message, bytes_read);
+      // Stop reading while the port can't keep up, the
+      // TCP window of the client closes instead of losing data
+      serial_backlog_wait(conn);
+    } else {
+      // Client closed the connection
+      free(message);
+      close_connection(conn);
+    }
+    message = NULL;
+  }
+  conn_put(conn);
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * Read the available data of a serial port and
+ * hand it to every link sharing the port
+ */
+static void read_serial_port(struct s_link *link)
+{
+  char *message;
+  int bytes_read;
+
+  message = serial_read(link->serial.serial_port, &bytes_read);
+  if(bytes_read > 0) {
+    serial_input(link, message, bytes_read);
+  }
+  free(message);
+}
+
+/**
+ * Collect the serial ports owned by a worker, links
+ * sharing a serial device are only listed once
+ *
+ * @return the amount of serial ports
+ */
+static int get_worker_ports(struct s_worker *worker, struct s_link **ports)
+{
+  int i, j;
+  int total_ports = 0;
+
+  for(i = 0; i < MAX_LINKS; i++) {
+    if(links[i].tcp_port == 0 || links[i].worker != worker) {
+      continue;
+    }
+    for(j = 0; j < total_ports; j++) {
+      if(ports[j]->serial.serial_port == links[i].serial.serial_port) {
+        break;
+      }
+    }
+    if(j == total_ports) {
+      ports[total_ports++] = &links[i];
+    }
+  }
+  return total_ports;
+}
+
+#ifdef HAVE_URING
+/**
+ * Arm a read on a serial port, or the timeout of
+ * the ring when index is URING_TIMEOUT
+ */
+static void uring_arm(struct s_uring *ring, struct s_link **ports,
+                      struct iovec *buffers, int index)
+{
+  static struct __kernel_timespec timeout = {
+    .tv_sec = WORKER_POLL_TIMEOUT / 1000,
+    .tv_nsec = (WORKER_POLL_TIMEOUT % 1000) * 1000000
+  };
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+  // The ring has room for every port and the timeout
+  if(sqe == NULL) {
+    fprintf(stderr, "io_uring submission ring full\n");
+    exit(-1);
+  }
+  sqe->user_data = index;
+  if(index == URING_TIMEOUT) {
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) &timeout;
+    sqe->len = 1;
+    return;
+  }
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = ports[index]->serial.serial_port;
+  sqe->addr = (unsigned long) buffers[index].iov_base;
+  sqe->len = SERIAL_DATA_CHUNK_SIZE;
+  sqe->buf_index = index;
+}
+
+/**
+ * Keep a read armed on every serial port of the
+ * worker, into buffers registered with the kernel.
+ * A timeout wakes the worker to see if it should stop.
+ */
+static void serial_in_uring(struct s_worker *worker)
+{
+  struct s_uring ring;
+  struct io_uring_cqe *cqe;
+  struct s_link *ports[MAX_LINKS];
+  struct iovec buffers[MAX_LINKS];
+  char *data;
+  int total_ports;
+  int index;
+
+  total_ports = get_worker_ports(worker, ports);
+  if(uring_create(&ring, MAX_LINKS + 1) < 0) {
+    print_error("io_uring_setup failed");
+    exit(-1);
+  }
+  data = (char *) malloc(total_ports * (SERIAL_DATA_CHUNK_SIZE + 1) + 1);
+  if(data == NULL) {
+    print_error("malloc failed");
+    exit(-1);
+  }
+  for(index = 0; index < total_ports; index++) {
+    buffers[index].iov_base = data + index * (SERIAL_DATA_CHUNK_SIZE + 1);
+    buffers[index].iov_len = SERIAL_DATA_CHUNK_SIZE;
+  }
+  if(total_ports && uring_register_buffers(&ring, buffers, total_ports) < 0) {
+    print_error("io_uring_register failed");
+    exit(-1);
+  }
+  for(index = 0; index < total_ports; index++) {
+    uring_arm(&ring, ports, buffers, index);
+  }
+  uring_arm(&ring, ports, buffers, URING_TIMEOUT);
+  while(worker->running) {
+    if(uring_submit_and_wait(&ring, 1) < 0) {
+      print_error("io_uring_enter failed");
+      exit(-1);
+    }
+    while((cqe = uring_peek_cqe(&ring)) != NULL) {
+      index = cqe->user_data;
+      if(index == URING_TIMEOUT) {
+        // -ETIME, the loop checks if the worker still runs
+      } else if(cqe->res > 0) {
+        serial_input(ports[index], buffers[index].iov_base, cqe->res);
+      } else if(cqe->res < 0) {
+        dbg("serial read failed: %s\n", strerror(-cqe->res));
+      }
+      uring_cqe_seen(&ring);
+      // Re-arm the read or the timeout
+      uring_arm(&ring, ports, buffers, index);
+    }
+  }
+  uring_destroy(&ring);
+  free(data);
 }
+#endif
+
+/**
+ * The serial in handler thread of a worker
+ *
+ * in = serial device -> tcp
+ */
+#ifdef __linux__
+static void *serial_in_handler(void *_worker)
+#elif _WIN32
+static DWORD WINAPI serial_in_handler(LPVOID _worker)
+#endif
+{
+  struct s_worker *worker = (struct s_worker *) _worker;
+  struct s_link *ports[MAX_LINKS];
+  int total_ports;
+  int index = 0;
+#ifdef __linux__
+  struct pollfd fds[MAX_LINKS];
+  int polled;
+#endif
+
+#ifdef HAVE_URING
+  if(io_engine == IO_ENGINE_URING) {
+    serial_in_uring(worker);
+    return NULL;
+  }
+#endif
+  total_ports = get_worker_ports(worker, ports);
+#ifdef __linux__
+  for(index = 0; index < total_ports; index++) {
+    fds[index].fd = ports[index]->serial.serial_port;
+    fds[index].events = POLLIN;
+  }
+#endif
+  while(worker->running) {
+#ifdef __linux__
+    polled = poll(fds, total_ports, WORKER_POLL_TIMEOUT);
+    if(polled < 0 && errno != EINTR) {
+      perror("poll failed");
+      exit(-1);
+    }
+    for(index = 0; polled > 0 && index < total_ports; index++) {
+      if(fds[index].revents & POLLIN) {
+        read_serial_port(ports[index]);
+      }
+    }
+#elif _WIN32
+    for(index = 0; index < total_ports; index++) {
+      read_serial_port(ports[index]);
+    }
+#endif
+  }
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * The connection out handler thread
+ * serial_in(serial_in_handler) -> out_queue -> tcp_out
+ * tcp_in -> tcp2serial_queue -> serial_out(serial_out_handler)
+ */
+#ifdef __linux__
+static void *tcp_out_handler(void *_conn)
+#elif _WIN32
+static DWORD WINAPI tcp_out_handler( LPVOID _conn )
+#endif
+{
+  struct s_conn *conn = (struct s_conn *) _conn;
+  struct s_entry *entry;
+  int delay = batch_delay(conn->link);
+  int wait;
+
+  while(conn->running) {
+    if(conn->batch.pending) {
+      // Queued output joins the record, new output only untill the delay passed
+      wait = (int) (conn->batch.since + delay - time_ms());
+      entry = queue_get_timeout(&conn->out_queue, wait > 0 ? wait : 0);
+      if(entry == NULL && client_flush(conn) < 0) {
+        close_connection(conn);
+      }
+    } else if(conn->link->socket_profile == SOCKET_PROFILE_THROUGHPUT) {
+      // Flush the corked socket once the queue runs dry
+      entry = queue_get_timeout(&conn->out_queue, SOCKET_CORK_FLUSH_MS);
+      if(entry == NULL && !conn->spilling) {
+        socket_flush_cork(conn->tcp_socket);
+        entry = queue_get(&conn->out_queue);
+      }
+    } else {
+      entry = queue_get(&conn->out_queue);
+    }
+    // The memory queue is older than the spill log
+    if(entry == NULL) {
+      while(conn->running && spill_send(conn));
+      continue;
+    }
+    if(client_send_entry(conn, entry) < 0 ||
+       (delay == 0 && conn->out_queue.count == 0 && client_flush(conn) < 0)) {
+      close_connection(conn);
+    }
+    __sync_sub_and_fetch(&conn->out_backlog, entry->length);
+    free(entry->message);
+    free(entry);
+  }
+  conn_put(conn);
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * The output of a connection on the crypto pool, does what
+ * tcp_out_handler does without blocking the pool worker
+ */
+static enum e_pool_result conn_output(void *_conn, int *wait_ms)
+{
+  struct s_conn *conn = (struct s_conn *) _conn;
+  struct s_entry *entry;
+  int budget = CRYPTO_BUDGET;
+  int wait;
+  int ret = 0;
+
+  if(!conn->running) {
+    conn_put(conn);
+    return POOL_GONE;
+  }
+  // A slow client waits for room instead of holding a worker
+  if(conn->batch.blocked) {
+    ret = batch_write_rest(conn);
+  }
+  while(ret == 0 && budget > 0 &&
+        (entry = queue_get_timeout(&conn->out_queue, 0)) != NULL) {
+    ret = client_send_entry(conn, entry);
+    budget -= entry->length;
+    __sync_sub_and_fetch(&conn->out_backlog, entry->length);
+    free(entry->message);
+    free(entry);
+  }
+  if(ret == 0 && budget > 0 && conn->batch.pending) {
+    wait = (int) (conn->batch.since + batch_delay(conn->link) - time_ms());
+    if(wait > 0) {
+      *wait_ms = wait;
+      return POOL_WAIT;
+    }
+    ret = client_flush(conn);
+    if(ret == 0 && conn->link->socket_profile == SOCKET_PROFILE_THROUGHPUT) {
+      socket_flush_cork(conn->tcp_socket);
+    }
+  }
+  if(ret < 0) {
+    // The next turn releases the connection
+    close_connection(conn);
+    return POOL_AGAIN;
+  }
+  if(ret > 0) {
+    *wait_ms = CRYPTO_WRITABLE_POLL_MS;
+    return POOL_WAIT;
+  }
+  if(budget <= 0) {
+    return POOL_AGAIN;
+  }
+  // The memory queue is older than the spill log
+  return spill_send(conn) ? POOL_AGAIN : POOL_DONE;
+}
+
+/**
+ * Check if a connection got output or has to stop
+ */
+static int conn_output_ready(void *_conn)
+{
+  struct s_conn *conn = (struct s_conn *) _conn;
+
+  return !conn->running || conn->out_queue.count > 0 || conn->spilling;
+}
+
+/**
+ * Add a receive message to
+ * the queue of the link's worker
+ */
+static void tcp2serial_queue_add(struct s_conn *conn, char *message, int length,
+                                 unsigned int tag)
+{
+  struct s_entry *entry = (struct s_entry *) malloc(sizeof(struct s_entry));
+  entry->message = message;
+  entry->length = length;
+  entry->tag = tag;
+  entry->conn = conn;
+  // The tag of an aggregate is the port
+  entry->port = (conn->link->aggregate != NULL) ? conn->link->members[tag]->port
+                                                : conn->link->port;
+  conn_get(conn);
+  __sync_add_and_fetch(&conn->serial_backlog, length);
+  dbg("added %.*s", length, message);
+  if(queue_add(&conn->link->worker->tcp2serial_queue, entry) < 0) {
+    request_dropped(entry);
+    release_entry(entry);
+  }
+}
+
+/**
+ * Hand data to a shared memory client, the serial data
+ * is dropped when the client doesn't keep up
+ */
+static void shm_queue_add(struct s_conn *conn, char *message, int length)
+{
+  mutex_lock(&conn->shm->lock);
+  // The rings are reset once the client stopped
+  if(conn->running && shm_send(conn->shm, message, length) < 0) {
+    dbg("dropping %d bytes for shm client %d\n", length, conn->id);
+  }
+  mutex_unlock(&conn->shm->lock);
+}
+
+/**
+ * Add a message to the out queue of a connection,
+ * the queue takes the message
+ *
+ * @tag OUT_TAG_COMPRESS for the compression reply, 0 otherwise
+ */
+static void client_queue_add(struct s_conn *conn, char *message, int length,
+                             unsigned int tag)
+{
+  struct s_entry *entry;
+
+  if(conn->shm != NULL) {
+    shm_queue_add(conn, message, length);
+    free(message);
+    return;
+  }
+  entry = (struct s_entry *) malloc(sizeof(struct s_entry));
+  entry->conn = conn;
+  entry->message = message;
+  entry->length = length;
+  entry->tag = tag;
+  if(queue_add(&conn->out_queue, entry) < 0) {
+    free(entry->message);
+    free(entry);
+    return;
+  }
+  __sync_add_and_fetch(&conn->out_backlog, length);
+  conn_output_added(conn);
+}
+
+/**
+ * The lowest position of the spill log the clients
+ * of a link still have to read, must hold the conns lock
+ */
+static unsigned long long spill_keep(struct s_link *link)
+{
+  struct s_conn *conn;
+  unsigned long long keep = link->spill.head;
+  int i;
+
+  for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+    if((conn = link->conns[i]) != NULL && conn->spilling && conn->spill_cursor < keep) {
+      keep = conn->spill_cursor;
+    }
+  }
+  return keep;
+}
+
+/**
+ * Append serial output to the spill log of a link for
+ * the clients that are behind, must hold the conns lock
+ */
+static void spill_add(struct s_link *link, char *message, int length)
+{
+  struct s_conn *conn;
+  unsigned long long keep = spill_keep(link);
+  unsigned long long segment;
+  int i;
+
+  // The log is full, the clients holding the oldest segment are dropped
+  // instead of silently skipping the output they didn't read yet
+  while(spill_room(&link->spill, keep) < (unsigned long long) length &&
+        keep < link->spill.head) {
+    segment = keep / link->spill.segment_size;
+    for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+      conn = link->conns[i];
+      if(conn != NULL && conn->spilling &&
+         conn->spill_cursor / link->spill.segment_size == segment) {
+        fprintf(stderr, "port %d: client %d dropped, %llu bytes behind and the spill log full\n",
+                link->tcp_port, conn->id, link->spill.head - conn->spill_cursor);
+        stop_connection(conn);
+      }
+    }
+    keep = spill_keep(link);
+  }
+  if(spill_append(&link->spill, message, length, keep) < 0) {
+    fprintf(stderr, "port %d: %d bytes lost for the clients behind\n", link->tcp_port, length);
+  }
+  for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+    if((conn = link->conns[i]) != NULL && conn->spilling) {
+      conn_wakeup(conn);
+    }
+  }
+}
+
+/**
+ * Send the next part of the spilled serial output to a client,
+ * the client goes back to the memory queue once it caught up
+ *
+ * @return 1 when there is more to send
+ */
+static int spill_send(struct s_conn *conn)
+{
+  struct s_link *link = conn->link;
+  char data[TCP_DATA_MAX];
+  char *spilled;
+  int length;
+
+  mutex_lock(&link->conns_lock);
+  if(!conn->spilling) {
+    mutex_unlock(&link->conns_lock);
+    return 0;
+  }
+  if((spilled = spill_read(&link->spill, conn->spill_cursor, &length)) == NULL) {
+    dbg("client %d caught up\n", conn->id);
+    conn->spilling = 0;
+    link->spill.readers--;
+    mutex_unlock(&link->conns_lock);
+    return 0;
+  }
+  // Copied under the lock, the segment can be recycled once the cursor passed it
+  if(length > TCP_DATA_MAX) {
+    length = TCP_DATA_MAX;
+  }
+  memcpy(data, spilled, length);
+  mutex_unlock(&link->conns_lock);
+  if(client_send(conn, data, length) < 0 || client_flush(conn) < 0) {
+    close_connection(conn);
+    return 0;
+  }
+  mutex_lock(&link->conns_lock);
+  conn->spill_cursor += length;
+  mutex_unlock(&link->conns_lock);
+  return 1;
+}
+
+/**
+ * Add serial output to the queue of every
+ * connection of a link
+ */
+static void link_output(struct s_link *link, char *message, int length)
+{
+  struct s_conn *conn;
+  struct s_entry *entry;
+  int j;
+
+  mutex_lock(&link->conns_lock);
+  if(link->history.size > 0) {
+    history_add(&link->history, message, length);
+  }
+  for(j = 0; j < MAX_ACTIVE_CONNECTIONS; j++) {
+    conn = link->conns[j];
+    if(conn == NULL || !conn->live) {
+      continue;
+    }
+    // Straight into the ring of a shared memory client
+    if(conn->shm != NULL) {
+      shm_queue_add(conn, message, length);
+      continue;
+    }
+    // A stream without credit is held back by the hub, not spilled
+    if(link->spill.dir[0] != '\0' && conn->relay == NULL && !conn->spilling &&
+       (conn->out_backlog >= link->spill.threshold ||
+        conn->out_queue.count >= QUEUE_SIZE - 1)) {
+      dbg("client %d spills to disk\n", conn->id);
+      conn->spilling = 1;
+      conn->spill_cursor = link->spill.head;
+      link->spill.readers++;
+    }
+    if(conn->spilling) {
+      continue;
+    }
+    entry = (struct s_entry *) malloc(sizeof(struct s_entry));
+    entry->conn = conn;
+    entry->message = (char *) malloc(length);
+    entry->length = length;
+    entry->tag = 0;
+    memcpy(entry->message, message, length);
+    if(queue_add(&entry->conn->out_queue, entry) < 0) {
+      free(entry->message);
+      free(entry);
+    } else {
+      __sync_add_and_fetch(&conn->out_backlog, length);
+      conn_output_added(conn);
+    }
+  }
+  if(link->spill.readers > 0) {
+    spill_add(link, message, length);
+  }
+  mutex_unlock(&link->conns_lock);
+}
+
+/**
+ * Add a serial message to the out queue of
+ * every connection on the links sharing the
+ * serial port
+ */
+static void serial2tcp_queue_add(struct s_link *link, char *message, int length)
+{
+  struct s_link *queue_link;
+  char *frame;
+  int frame_length;
+  int i;
+
+  for(i = 0; i < MAX_LINKS; i++) {
+    queue_link = &links[i];
+    // Modbus TCP clients only get replies
+    if(queue_link->tcp_port == 0 || queue_link->worker != link->worker ||
+       queue_link->serial.serial_port != link->serial.serial_port ||
+       queue_link->protocol == PROTOCOL_MODBUS_TCP) {
+      continue;
+    }
+    // The clients of an aggregate are on its first port
+    if(queue_link->aggregate != NULL) {
+      frame = aggregate_frame(queue_link->aggregate_tag, message, length, &frame_length);
+      link_output(queue_link->aggregate, frame, frame_length);
+      free(frame);
+    } else {
+      link_output(queue_link, message, length);
+    }
+  }
+  dbg("added %.*s", length, message);
+}
+
+/**
+ * Wait for the socket of a non-blocking SSL call that returned ret
+ *
+ * @return 1 when the call should be retried
+ */
+static int ssl_wait(SSL *ns, int ret)
+{
+  switch(SSL_get_error(ns, ret)) {
+    case SSL_ERROR_WANT_READ:
+      socket_wait_readable(SSL_get_fd(ns), WORKER_POLL_TIMEOUT);
+      return 1;
+    case SSL_ERROR_WANT_WRITE:
+      socket_wait_writable(SSL_get_fd(ns), WORKER_POLL_TIMEOUT);
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Receive a message over a given socket
+ */
+static char *receive_message(SSL *ns, int *total_bytes_read)
+{
+  int bytes_read;
+  int total_read = 0;
+  // Room for the terminating 0 of a full chunk
+  char *data = (char *) malloc(TCP_DATA_CHUNK_SIZE+1);
+  char *pos = data;
+  while(1) {
+    bytes_read = SSL_read(ns, pos, TCP_DATA_CHUNK_SIZE);
+    // The socket of a client on the crypto pool doesn't wait for data
+    if(bytes_read <= 0 && total_read == 0 && ssl_wait(ns, bytes_read)) {
+      continue;
+    }
+    if(bytes_read <= 0 || ((total_read+=bytes_read) >= TCP_DATA_MAX)) {
+      break;
+    }
+    // A full chunk with nothing left in the record doesn't mean more
+    // is coming, reading on would hold this data untill it does
+    if(bytes_read != TCP_DATA_CHUNK_SIZE || SSL_pending(ns) == 0) {
+      break;
+    }
+    data = (char *) realloc(data, total_read+TCP_DATA_CHUNK_SIZE+1);
+    pos = data + total_read;
+  }
+  data[total_read] = '\0';
+  *total_bytes_read = total_read;
+  return data;
+}
+
+/**
+ * The ms serial output of a link may wait for more
+ * output, low latency links never wait
+ */
+static int batch_delay(struct s_link *link)
+{
+  if(link->socket_profile == SOCKET_PROFILE_LOW_LATENCY || link->batch_delay < 0) {
+    return 0;
+  }
+  return link->batch_delay;
+}
+
+/**
+ * Send the first length bytes of the collected output as one TLS record
+ *
+ * @return 0 on succes
+ *         1 when the socket has no room, the record is kept
+ *       < 0 on error
+ */
+static int batch_write(struct s_conn *conn, int length)
+{
+  int ret;
+
+  if(length == 0) {
+    return 0;
+  }
+  ret = SSL_write(conn->socket, conn->batch.data + conn->batch.start, length);
+  if(ret <= 0) {
+    ret = SSL_get_error(conn->socket, ret);
+    if(ret == SSL_ERROR_WANT_WRITE || ret == SSL_ERROR_WANT_READ) {
+      conn->batch.blocked = length;
+      return 1;
+    }
+    print_error("send failed");
+    return -1;
+  }
+  conn->batch.records++;
+  conn->batch.blocked = 0;
+  conn->batch.start += length;
+  if(conn->batch.start == conn->batch.length) {
+    conn->batch.start = 0;
+    conn->batch.length = 0;
+  }
+  return 0;
+}
+
+/**
+ * Send the full records of the collected output, the
+ * record the socket had no room for goes first
+ *
+ * @return see batch_write
+ */
+static int batch_write_full(struct s_conn *conn)
+{
+  int ret = 0;
+
+  if(conn->batch.blocked) {
+    ret = batch_write(conn, conn->batch.blocked);
+  }
+  while(ret == 0 && conn->batch.length - conn->batch.start >= TLS_RECORD_MAX) {
+    ret = batch_write(conn, TLS_RECORD_MAX);
+  }
+  return ret;
+}
+
+/**
+ * Send the output the socket had no room for, the
+ * output of a flush goes out completely
+ *
+ * @return see batch_write
+ */
+static int batch_write_rest(struct s_conn *conn)
+{
+  int ret = batch_write_full(conn);
+
+  if(ret == 0 && conn->batch.pending == 0) {
+    ret = batch_write(conn, conn->batch.length - conn->batch.start);
+  }
+  return ret;
+}
+
+/**
+ * Collect output for the next TLS record, full records
+ * are sent right away
+ *
+ * @return see batch_write
+ */
+static int batch_add(struct s_conn *conn, char *data, int length)
+{
+  if(conn->batch.start > 0) {
+    // The socket BIO accepts a moved record, see open_connection
+    conn->batch.length -= conn->batch.start;
+    memmove(conn->batch.data, conn->batch.data + conn->batch.start, conn->batch.length);
+    conn->batch.start = 0;
+  }
+  if(conn->batch.length + length > conn->batch.size) {
+    conn->batch.size = conn->batch.length + length;
+    if(conn->batch.size < TLS_RECORD_MAX) {
+      conn->batch.size = TLS_RECORD_MAX;
+    }
+    conn->batch.data = (char *) realloc(conn->batch.data, conn->batch.size);
+    if(conn->batch.data == NULL) {
+      print_error("malloc");
+      exit(-1);
+    }
+  }
+  memcpy(conn->batch.data + conn->batch.length, data, length);
+  conn->batch.length += length;
+  return batch_write_full(conn);
+}
+
+/**
+ * Count the writes of the socket BIO of a connection,
+ * every write is a syscall
+ */
+static long batch_count_writes(BIO *bio, int oper, const char *argp, size_t len,
+                               int argi, long argl, int ret, size_t *processed)
+{
+  struct s_conn *conn = (struct s_conn *) BIO_get_callback_arg(bio);
+
+  if(oper == (BIO_CB_WRITE | BIO_CB_RETURN)) {
+    conn->batch.syscalls++;
+  }
+  return ret;
+}
+
+/**
+ * Add serial output for a client, compressed once the
+ * client negotiated it. Nothing is sent untill the
+ * output fills a TLS record or is flushed.
+ *
+ * @return see batch_write
+ */
+static int client_send(struct s_conn *conn, char *data, int length)
+{
+  char *compressed;
+  int compressed_length;
+  int ret;
+
+  if(conn->batch.pending == 0) {
+    conn->batch.since = time_ms();
+  }
+  conn->batch.pending += length;
+  if(!conn->compress.active) {
+    return batch_add(conn, data, length);
+  }
+  compressed = compress_data(&conn->compress, data, length, 0, &compressed_length);
+  ret = batch_add(conn, compressed, compressed_length);
+  free(compressed);
+  return ret;
+}
+
+/**
+ * Send all the output added for a client
+ *
+ * @return see batch_write, on 1 the rest goes
+ *         out with batch_write_rest
+ */
+static int client_flush(struct s_conn *conn)
+{
+  char *compressed;
+  int compressed_length;
+  int ret = 0;
+
+  if(conn->compress.active && conn->batch.pending) {
+    compressed = compress_data(&conn->compress, NULL, 0, 1, &compressed_length);
+    ret = batch_add(conn, compressed, compressed_length);
+    free(compressed);
+  }
+  conn->batch.pending = 0;
+  if(ret != 0) {
+    return ret;
+  }
+  return batch_write_rest(conn);
+}
+
+
+/**
+ * Answer the compression handshake of a client, the reply is the
+ * last uncompressed output, "none" when the stream doesn't start
+ *
+ * @return see batch_write
+ */
+static int client_compress(struct s_conn *conn)
+{
+  struct s_link *link = conn->link;
+  char reply[SESSION_REPLY_MAX];
+  int started = conn->compress.active ||
+                compress_start(&conn->compress, link->compression_level) == 0;
+  int ret;
+
+  conn->compress.active = 0;
+  ret = client_send(conn, reply,
+                    snprintf(reply, SESSION_REPLY_MAX, "DIVIDI COMPRESS %s\n",
+                             started ? compress_name(link->compression) : "none"));
+  if(ret >= 0) {
+    ret = client_flush(conn);
+  }
+  conn->compress.active = started;
+  return ret;
+}
+
+/**
+ * Send an entry of the out queue of a client
+ *
+ * @return see batch_write
+ */
+static int client_send_entry(struct s_conn *conn, struct s_entry *entry)
+{
+  if(entry->tag == OUT_TAG_COMPRESS) {
+    return client_compress(conn);
+  }
+  return client_send(conn, entry->message, entry->length);
+}
+
+/**
+ * This function will close a given socketd
+ * @param s the socket identifier
+ */
+static void close_socket(int s)
+{
+  int status = 0;
+#ifdef __linux__
+  status = shutdown(s, SHUT_RDWR);
+  if (status == 0) {
+    status = close(s);
+  }
+#elif _WIN32
+  status = shutdown(s, SD_BOTH);
+  if (status == 0) {
+    status = closesocket(s);
+  }
+  WSACleanup();
+#endif
+}
+
+void set_cert_file(char *value)
+{
+  copy_file_path(cert_file, value);
+}
+void set_key_file(char *value)
+{
+  copy_file_path(key_file, value);
+}
+void set_root_file(char *value)
+{
+  copy_file_path(root_file, value);
+}
+void set_workers(char *value)
+{
+  total_workers = atoi(value);
+  if(total_workers < 1 || total_workers > MAX_WORKERS) {
+    fprintf(stderr, "workers should be between 1 and %d\n", MAX_WORKERS);
+    exit(-1);
+  }
+}
+void set_acceptors(char *value)
+{
+  total_acceptors = atoi(value);
+  if(total_acceptors < 1 || total_acceptors > MAX_WORKERS) {
+    fprintf(stderr, "acceptors should be between 1 and %d\n", MAX_WORKERS);
+    exit(-1);
+  }
+}
+void set_crypto_workers(char *value)
+{
+  crypto_workers = atoi(value);
+  if(crypto_workers < 0 || crypto_workers > POOL_WORKERS_MAX) {
+    fprintf(stderr, "crypto_workers should be between 0 and %d\n", POOL_WORKERS_MAX);
+    exit(-1);
+  }
+}
+void set_metrics_interval(char *value)
+{
+  metrics_interval = atoi(value);
+}
+void set_relay_hub(char *value)
+{
+  char *sep = strrchr(value, ':');
+
+  if(sep == NULL || sep - value >= RELAY_HOST_MAX || (relay_hub_port = atoi(sep + 1)) <= 0) {
+    fprintf(stderr, "relay_hub should be <host>:<port>\n");
+    exit(-1);
+  }
+  memcpy(relay_hub_host, value, sep - value);
+  relay_hub_host[sep - value] = '\0';
+}
+
+void set_relay_hub_name(char *value)
+{
+  if(strlen(value) >= RELAY_HOST_MAX) {
+    fprintf(stderr, "relay_hub_name exceeds %d characters\n", RELAY_HOST_MAX - 1);
+    exit(-1);
+  }
+  strcpy(relay_hub_name, value);
+}
+void set_relay_port(char *value)
+{
+  relay_port = atoi(value);
+}
+
+void set_shared_port(char *value)
+{
+  shared_port = atoi(value);
+}
+
+/**
+ * Parse a comma separated list of listen addresses
+ *
+ * @return the amount of addresses
+ */
+static int parse_listen(char *key, char *value, char listen[][LISTEN_ADDRESS_MAX])
+{
+  char *address;
+  int total = 0;
+
+  while((address = strsep_delim(&value, ",")) != NULL) {
+    strtrim(address);
+    if(total == MAX_LISTEN_ADDRESSES ||
+       strlen(address) == 0 || strlen(address) >= LISTEN_ADDRESS_MAX) {
+      fprintf(stderr, "%s takes at most %d addresses of less than %d characters\n",
+              key, MAX_LISTEN_ADDRESSES, LISTEN_ADDRESS_MAX);
+      exit(-1);
+    }
+    strcpy(listen[total++], address);
+  }
+  return total;
+}
+
+void set_shared_listen(char *value)
+{
+  total_shared_listen = parse_listen("shared_listen", value, shared_listen);
+}
+
+void set_relay_listen(char *value)
+{
+  total_relay_listen = parse_listen("relay_listen", value, relay_listen);
+}
+void set_io_engine(char *value)
+{
+  if(strcmp(value, "poll") == 0) {
+    io_engine = IO_ENGINE_POLL;
+  } else if(strcmp(value, "uring") == 0) {
+    io_engine = IO_ENGINE_URING;
+  } else {
+    fprintf(stderr, "Unknown io_engine %s\n", value);
+    exit(-1);
+  }
+}
+void set_worker_cpus(char *value)
+{
+  char *cpu;
+  total_worker_cpus = 0;
+  while((cpu = strsep_delim(&value, ",")) != NULL) {
+    if(total_worker_cpus == MAX_WORKERS) {
+      fprintf(stderr, "Maximum %d worker cpus\n", MAX_WORKERS);
+      exit(-1);
+    }
+    strtrim(cpu);
+    worker_cpus[total_worker_cpus] = atoi(cpu);
+    if(!thread_cpu_valid(worker_cpus[total_worker_cpus])) {
+      fprintf(stderr, "worker_cpus: can't pin a worker to cpu %s\n", cpu);
+      exit(-1);
+    }
+    total_worker_cpus++;
+  }
+}
+/**
+ * Print usage
+ */
+static void print_help()
+{
+  printf("Usage: dividi [OPTIONS]\n\n");
+  printf("   -c/--config [FILE]       Set a custom path to the configuration file\n");
+  printf("   -r/--rootca     [FILE]       Set the path to the root certification\n");
+  printf("   -k/--key        [FILE]       Set the path to the private key\n");
+  printf("   -s/--servercert [FILE]       Set the path to the server certification\n");
+}
+
+/**
+ * This function will determine the port number
+ * and the serial port by the applications
+ * arguments
+ */
+static void handle_arguments(int argc, char **argv)
+{
+  int c;
+  int key = 0;
+  int cert = 0;
+  int long_index =0;
+  static struct option long_options[] = {
+    {"conf",       required_argument, 0,  'c' },
+    {"servercert", required_argument, 0,  's' },
+    {"rootca",     required_argument, 0,  'r' },
+    {"key",        required_argument, 0,  'k' },
+    {0,            0,                 0,   0  }
+  };
+  while ((c = getopt_long(argc, argv,"c:s:r:k:",
+                   long_options, &long_index)) != -1) {
+    if(optarg != NULL && strlen(optarg) > PATH_MAX) {
+      printf("File paths may be maximum %d characters long\n", PATH_MAX);
+      exit(-1);
+    }
+    switch(c) {
+      case 'c':
+        memcpy(config_file, optarg, strlen(optarg));
+        break;
+      case 's':
+        cert = 1;
+        memcpy(cert_file, optarg, strlen(optarg));
+        break;
+      case 'k':
+        key = 1;
+        memcpy(key_file, optarg, strlen(optarg));
+        break;
+      case 'r':
+        memcpy(root_file, optarg, strlen(optarg));
+        break;
+      case 'h':
+      default:
+        print_help();
+        exit(-1);
+    }
+  }
+  if(!key && cert) {
+    memcpy(key_file, cert_file, strlen(optarg));
+  }
+}
+
+/**
+ * Open a serial port by a given name
+ * and put it in the lookup table
+ *
+ * @link pointer to the first free entry of the table
+ * @port_name the system name of the serial port
+ */
+static void open_link(struct s_link *link, char *port_name)
+{
+  int fd;
+  dbg("opening %s\n", port_name);
+  if(link->vserial.type != VSERIAL_NONE && vserial_open(&link->vserial, &link->serial) < 0) {
+    exit(-1);
+  }
+  fd = serial_open(&link->serial);
+  if(fd < 0) {
+    print_error("serial_open failed");
+    exit(-1);
+  }
+  serial_report(&link->serial);
+  if(link->vserial.type != VSERIAL_NONE && vserial_start(&link->vserial, &link->serial) < 0) {
+    exit(-1);
+  }
+}
+
+static int get_empty_link_slot()
+{
+  int i;
+  for(i = 0; i < MAX_LINKS; i++) {
+    if(links[i].tcp_port == 0) {
+      memset(&links[i].serial, 0, sizeof(struct s_serial));
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Set up a port of an aggregate like the first port,
+ * the clients of an aggregate send raw data
+ */
+static void aggregate_setup(struct s_link *member)
+{
+  struct s_link *head = member->aggregate;
+  char name[SERIAL_NAME_MAX];
+
+  if(head->protocol != PROTOCOL_RAW || head->vserial.type == VSERIAL_RELAY) {
+    fprintf(stderr, "port %d: an aggregate only carries raw serial ports\n", head->tcp_port);
+    exit(-1);
+  }
+  strcpy(name, member->serial.str_serial_port);
+  member->serial = head->serial;
+  strcpy(member->serial.str_serial_port, name);
+  member->vserial.type = head->vserial.type;
+  member->vserial.frame_size = head->vserial.frame_size;
+}
+
+/**
+ * Open the serial port of every link, links on the
+ * same serial device share the port of the first link
+ */
+static int open_all_serial()
+{
+  int i, j;
+  for(i = 0; i < MAX_LINKS; i++) {
+    if(links[i].tcp_port == 0) {
+      continue;
+    }
+    if(links[i].aggregate != NULL && links[i].aggregate != &links[i]) {
+      aggregate_setup(&links[i]);
+    }
+    for(j = 0; j < i; j++) {
+      if(links[j].tcp_port != 0 &&
+         strcmp(links[i].serial.str_serial_port, links[j].serial.str_serial_port) == 0) {
+        break;
+      }
+    }
+    if(j < i) {
+      links[i].serial.serial_port = links[j].serial.serial_port;
+    } else {
+      open_link(&links[i], links[i].serial.str_serial_port);
+    }
+  }
+  return -1;
+}
+
+/**
+ * Get the common name of the client certificate
+ *
+ * @name will hold the name, empty when there is no certificate
+ */
+static void get_client_name(SSL *ssl, char *name)
+{
+  X509 *cert = SSL_get_peer_certificate(ssl);
+
+  name[0] = '\0';
+  if(cert != NULL) {
+    X509_NAME_get_text_by_NID(X509_get_subject_name(cert), NID_commonName,
+                              name, CLIENT_NAME_MAX);
+    X509_free(cert);
+  }
+}
+
+/**
+ * Find the link a client of the shared port named
+ *
+ * @return the link, NULL when no link has the name
+ */
+static struct s_link *route_link(const char *name, int length)
+{
+  int i, j;
+
+  for(i = 0; i < MAX_LINKS; i++) {
+    if(links[i].tcp_port == 0 || (int) strlen(links[i].server_name) != length) {
+      continue;
+    }
+    // Host names are case insensitive
+    for(j = 0; j < length && tolower((unsigned char) name[j]) ==
+                             tolower((unsigned char) links[i].server_name[j]); j++);
+    if(j == length) {
+      return &links[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Pick the link of a client of the shared port by the server name
+ * it sent, an unknown name is left to the ALPN protocols since
+ * clients send the host name of dividi by default
+ */
+static int route_servername(SSL *ssl, int *alert, void *arg)
+{
+  struct s_conn *conn = (struct s_conn *) SSL_get_app_data(ssl);
+  const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+  if(conn != NULL && conn->link == NULL && name != NULL) {
+    conn->link = route_link(name, strlen(name));
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Pick the link of a client of the shared port by the first
+ * ALPN protocol naming a link, when the server name didn't
+ */
+static int route_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                      const unsigned char *in, unsigned int inlen, void *arg)
+{
+  struct s_conn *conn = (struct s_conn *) SSL_get_app_data(ssl);
+  unsigned int i;
+
+  if(conn == NULL || conn->link != NULL) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  // Every protocol is preceded by its length
+  for(i = 0; i < inlen && i + 1 + in[i] <= inlen; i += 1 + in[i]) {
+    if((conn->link = route_link((const char *) in + i + 1, in[i])) != NULL) {
+      *out = in + i + 1;
+      *outlen = in[i];
+      return SSL_TLSEXT_ERR_OK;
+    }
+  }
+  return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+/**
+ * Accept a client of a link, the link is NULL
+ * for a client of the shared port
+ */
+static void open_connection(SSL_CTX *ctx, int sock, struct s_link *link)
+{
+  BIO     *sbio;
+  SSL     *ssl;
+  int nbr_of_references = 0;
+  int accepted;
+  struct s_conn *conn = (struct s_conn *) calloc(1, sizeof(struct s_conn));
+
+  if(conn == NULL) {
+    print_error("malloc");
+    exit(-1);
+  }
+  if ((conn->tcp_socket = accept(sock, NULL, NULL)) < 0) {
+    print_error("accept failed");
+    free(conn);
+    return;
+  }
+  // The link of a client of the shared port is picked in the handshake
+  conn->link = link;
+  if(link != NULL) {
+    socket_apply_profile(conn->tcp_socket, link->socket_profile);
+  }
+  sbio = BIO_new_socket(conn->tcp_socket, BIO_NOCLOSE);
+  ssl = SSL_new(ctx);
+  SSL_set_app_data(ssl, conn);
+  SSL_set_bio(ssl, sbio, sbio);
+  if ((accepted = SSL_accept(ssl)) <= 0) {
+    ERR_print_errors_fp(stderr);
+  } else if(conn->link == NULL) {
+    fprintf(stderr, "port %d: the client named no link\n", shared_port);
+  }
+  if(accepted <= 0 || conn->link == NULL) {
+    SSL_free(ssl);
+#ifdef __linux__
+    close(conn->tcp_socket);
+#elif _WIN32
+    closesocket(conn->tcp_socket);
+#endif
+    free(conn);
+    return;
+  }
+  if(link == NULL) {
+    link = conn->link;
+    socket_apply_profile(conn->tcp_socket, link->socket_profile);
+  }
+  socket_report(conn->tcp_socket, link->tcp_port);
+  BIO_set_callback_arg(sbio, (char *) conn);
+  BIO_set_callback_ex(sbio, batch_count_writes);
+  // A record the socket had no room for moves along with the batch
+  SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // The crypto pool may not wait on a client
+  if(crypto_workers > 0 && socket_set_nonblocking(conn->tcp_socket) < 0) {
+    print_error("fcntl");
+  }
+  conn->socket = ssl;
+  conn->link = link;
+  conn->output.arg = conn;
+  conn->id = __sync_add_and_fetch(&next_conn_id, 1);
+  get_client_name(ssl, conn->client_name);
+  sched_init_conn(conn);
+  conn->running = 1;
+  queue_create(&conn->out_queue);
+  semaphore_create(&conn->backlog_sem);
+  if(attach_connection(conn) < 0) {
+    fprintf(stderr, "MAX_ACTIVE_CONNECTIONS reached on port %d\n", link->tcp_port);
+    conn->references = 1;
+    conn->running = 0;
+    conn_put(conn);
+    return;
+  }
+  // The connection handlers own the connection
+  conn->references = 2;
+  nbr_of_references = start_connection_handlers(conn);
+  if(nbr_of_references < 2) {
+    close_connection(conn);
+    for(; nbr_of_references < 2; nbr_of_references++) {
+      conn_put(conn);
+    }
+  }
+}
+
+/**
+ * Set up the connection of a stream of an edge tunnel,
+ * the in and out side of the tunnel own it, the
+ * connection keeps the tunnel
+ */
+static struct s_conn *open_relay_connection(struct s_link *link, struct s_relay *relay)
+{
+  struct s_conn *conn = (struct s_conn *) calloc(1, sizeof(struct s_conn));
+
+  if(conn == NULL) {
+    print_error("malloc");
+    exit(-1);
+  }
+  relay_get(relay);
+  conn->relay = relay;
+  conn->tcp_socket = -1;
+  conn->link = link;
+  conn->id = __sync_add_and_fetch(&next_conn_id, 1);
+  snprintf(conn->client_name, CLIENT_NAME_MAX, "relay:%.*s", CLIENT_NAME_MAX - 7, relay->peer);
+  sched_init_conn(conn);
+  conn->running = 1;
+  queue_create(&conn->out_queue);
+  semaphore_create(&conn->backlog_sem);
+  if(attach_connection(conn) < 0) {
+    fprintf(stderr, "MAX_ACTIVE_CONNECTIONS reached on port %d\n", link->tcp_port);
+    conn->references = 1;
+    conn->running = 0;
+    conn_put(conn);
+    return NULL;
+  }
+  conn->references = 2;
+  return conn;
+}
+
+#ifdef __linux__
+/**
+ * Set up the connection of a client that attached
+ * to the shared memory segment of a link, the shm
+ * handler owns it
+ */
+static struct s_conn *open_shm_connection(struct s_link *link)
+{
+  struct s_conn *conn = (struct s_conn *) calloc(1, sizeof(struct s_conn));
+
+  if(conn == NULL) {
+    print_error("malloc");
+    exit(-1);
+  }
+  conn->shm = &link->shm;
+  conn->tcp_socket = -1;
+  conn->link = link;
+  conn->id = __sync_add_and_fetch(&next_conn_id, 1);
+  snprintf(conn->client_name, CLIENT_NAME_MAX, "shm:%d", shm_client_pid(&link->shm));
+  sched_init_conn(conn);
+  conn->running = 1;
+  conn->references = 1;
+  queue_create(&conn->out_queue);
+  semaphore_create(&conn->backlog_sem);
+  if(attach_connection(conn) < 0) {
+    fprintf(stderr, "MAX_ACTIVE_CONNECTIONS reached on port %d\n", link->tcp_port);
+    conn->running = 0;
+    conn_put(conn);
+    return NULL;
+  }
+  dbg("shm client %s attached to %s\n", conn->client_name, link->shm.path);
+  return conn;
+}
+
+/**
+ * Stop the connection of the shared memory client
+ * and free the segment for the next one
+ */
+static void close_shm_connection(struct s_link *link)
+{
+  struct s_conn *conn = link->shm.conn;
+
+  if(conn != NULL) {
+    close_connection(conn);
+  }
+  mutex_lock(&link->shm.lock);
+  shm_reset(&link->shm);
+  link->shm.conn = NULL;
+  mutex_unlock(&link->shm.lock);
+  if(conn != NULL) {
+    dbg("shm client %s detached from %s\n", conn->client_name, link->shm.path);
+    conn_put(conn);
+  }
+}
+
+/**
+ * The shared memory handler thread of a link,
+ * shm client -> tcp2serial_queue of the link's worker,
+ * the serial data is written straight to the client
+ */
+static void *shm_handler(void *_link)
+{
+  struct s_link *link = (struct s_link *) _link;
+  struct s_shm *shm = &link->shm;
+  char *message;
+  int length;
+
+  while(1) {
+    if(!shm_attached(shm)) {
+      if(shm_detached(shm)) {
+        close_shm_connection(link);
+      }
+      shm_wait(shm, WORKER_POLL_TIMEOUT);
+      continue;
+    }
+    if(shm->conn == NULL && (shm->conn = open_shm_connection(link)) == NULL) {
+      close_shm_connection(link);
+      continue;
+    }
+    // The client blocks on a full ring instead of losing data
+    if(shm->conn->serial_backlog >= SERIAL_BACKLOG_MAX) {
+      semaphore_timedwait(&shm->conn->backlog_sem, WORKER_POLL_TIMEOUT);
+      continue;
+    }
+    if((message = shm_receive(shm, &length)) == NULL) {
+      shm_wait(shm, WORKER_POLL_TIMEOUT);
+      continue;
+    }
+    client_input(shm->conn, message, length);
+  }
+  return NULL;
+}
+#endif
+
+/**
+ * Open a listening socket on a given address, a name is
+ * bound on the first of its addresses that accepts it
+ *
+ * @interface the device to bind to, all devices when empty
+ * @reuseport share the port with the other acceptors
+ * @return the socket
+ */
+static int open_listener(int tcp_port, char *interface, char *address, int reuseport)
+{
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  char port[8];
+  int fd = -1;
+  int optval = 1;
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  snprintf(port, sizeof(port), "%d", tcp_port);
+  if((err = getaddrinfo(address, port, &hints, &res)) != 0) {
+    fprintf(stderr, "Can't resolve listen address %s: %s\n", address, gai_strerror(err));
+    exit(-1);
+  }
+  for(ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+      print_error("socket failed");
+      exit(-1);
+    }
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&optval, sizeof(optval)) < 0) {
+      print_error("setsockopt failed");
+      exit(-1);
+    }
+#ifdef IPV6_V6ONLY
+    // "::" next to "0.0.0.0" would take the IPv4 port as well
+    if(ai->ai_family == AF_INET6 &&
+       setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&optval, sizeof(optval)) < 0) {
+      print_error("setsockopt IPV6_V6ONLY failed");
+      exit(-1);
+    }
+#endif
+#ifdef SO_REUSEPORT
+    if(reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&optval, sizeof(optval)) < 0) {
+      print_error("setsockopt SO_REUSEPORT failed");
+      exit(-1);
+    }
+#endif
+#ifdef SO_BINDTODEVICE
+    if(interface[0] != '\0' &&
+       setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, interface, strlen(interface)) < 0) {
+      print_error("setsockopt SO_BINDTODEVICE failed");
+      exit(-1);
+    }
+#endif
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    print_error("bind failed");
+#ifdef __linux__
+    close(fd);
+#elif _WIN32
+    closesocket(fd);
+#endif
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if(fd < 0) {
+    fprintf(stderr, "Can't listen on %s port %d\n", address, tcp_port);
+    exit(-1);
+  }
+  if (listen(fd, MAX_ACTIVE_CONNECTIONS) < 0) {
+    print_error("listen failed");
+    exit(-1);
+  }
+  dbg("listening on %s port %d\n", address, tcp_port);
+  return fd;
+}
+
+/**
+ * Open the listening sockets of all links
+ *
+ * @s will hold the sockets
+ * @owners will hold the link of every socket
+ * @reuseport share the ports with the other acceptors
+ * @return the amount of sockets
+ */
+static int open_listeners(struct pollfd *s, struct s_link **owners, int reuseport)
+{
+  int index, i;
+  int total = 0;
+  int total_listen;
+  char *address;
+
+  total_listen = total_shared_listen ? total_shared_listen : 1;
+  for(i = 0; shared_port > 0 && i < total_listen; i++) {
+    address = total_shared_listen ? shared_listen[i] : DEFAULT_LISTEN_ADDRESS;
+    s[total].fd = open_listener(shared_port, "", address, reuseport);
+#ifdef __linux__
+    s[total].events = POLLIN;
+#endif
+    owners[total++] = NULL;
+  }
+  for(index=0; index<MAX_LINKS; index++) {
+    if(links[index].tcp_port == 0) {
+      break;
+    }
+    // Links with a server name are reached on the shared port
+    if(shared_port > 0 && links[index].server_name[0] != '\0') {
+      continue;
+    }
+    // Clients reach the ports of an aggregate on its first port
+    if(links[index].aggregate != NULL && links[index].aggregate != &links[index]) {
+      continue;
+    }
+    total_listen = links[index].total_listen ? links[index].total_listen : 1;
+    for(i = 0; i < total_listen; i++) {
+      address = links[index].total_listen ? links[index].listen[i] : DEFAULT_LISTEN_ADDRESS;
+      s[total].fd = open_listener(links[index].tcp_port, links[index].interface,
+                                  address, reuseport);
+#ifdef __linux__
+      s[total].events = POLLIN;
+#endif
+      owners[total++] = &links[index];
+    }
+  }
+  return total;
+}
+
+#ifdef __linux__
+/**
+ * Will check the sockets for new connection
+ * requests
+ */
+static int poll_sockets(struct pollfd *s, struct s_link **owners, int total, SSL_CTX *ctx)
+{
+  int index;
+  int polled = 0;
+
+  dbg("Polling for incoming connections\n");
+  polled = poll(s, total, -1);
+  if(polled > 0) {
+    for(index=0; index<total; index++) {
+      if(s[index].revents & POLLIN) {
+        open_connection(ctx, s[index].fd, owners[index]);
+      }
+    }
+  } else if(polled < 0 && errno != EINTR) {
+    perror("poll failed");
+    exit(-1);
+  } else {
+    dbg("Poll timed out, no incoming connections\n");
+  }
+  return 0;
+}
+#elif _WIN32
+/**
+ * Will check the sockets for new connection
+ * requests
+ */
+static int select_sockets(struct pollfd *s, struct s_link **owners, int total, SSL_CTX *ctx)
+{
+  int index;
+  int maxfd = 0;
+  int ret;
+  fd_set set;
+
+  FD_ZERO(&set);
+  for (index = 0; index < total; index++) {
+    FD_SET(s[index].fd, &set);
+    if (s[index].fd > maxfd)
+        maxfd = s[index].fd;
+  }
+
+  dbg("Polling for incoming connections\n");
+  ret = select(maxfd + 1, &set, NULL, NULL, NULL);
+
+  if (ret) {
+    for (index = 0; index < total; index++) {
+      if (FD_ISSET(s[index].fd, &set)) {
+        open_connection(ctx, s[index].fd, owners[index]);
+      }
+    }
+  }
+  return 0;
+}
+
+#endif
+
+/**
+ * Accept connections on every listening
+ * socket untill dividi stops
+ */
+static void accept_connections(SSL_CTX *ctx, int reuseport)
+{
+  struct pollfd s[MAX_LISTENERS];
+  struct s_link *owners[MAX_LISTENERS];
+  int total;
+
+  total = open_listeners(s, owners, reuseport);
+  while(dividi_running) {
+#ifdef __linux__
+    if(poll_sockets(s, owners, total, ctx) < 0) {
+#elif _WIN32
+    if(select_sockets(s, owners, total, ctx) < 0) {
+#endif
+      break;
+    }
+  }
+  for(total--; total>=0; total--) {
+    close_socket(s[total].fd);
+  }
+}
+
+/**
+ * An extra acceptor thread, it listens on the
+ * same ports through SO_REUSEPORT so the kernel
+ * spreads the incoming connections
+ */
+#ifdef __linux__
+static void *acceptor_handler(void *ctx)
+#elif _WIN32
+static DWORD WINAPI acceptor_handler(LPVOID ctx)
+#endif
+{
+  accept_connections((SSL_CTX *) ctx, 1);
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * The metrics thread, reports every
+ * metrics_interval seconds
+ */
+#ifdef __linux__
+static void *metrics_handler(void *arg)
+#elif _WIN32
+static DWORD WINAPI metrics_handler(LPVOID arg)
+#endif
+{
+  int index;
+
+  while(1) {
+#ifdef __linux__
+    sleep(metrics_interval);
+#elif _WIN32
+    Sleep(metrics_interval * 1000);
+#endif
+    for(index = 0; index < MAX_LINKS; index++) {
+      if(links[index].tcp_port != 0) {
+        metrics_report_link(&links[index], metrics_interval);
+      }
+    }
+  }
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * Stop the streams of an edge tunnel, each
+ * side of the tunnel drops its reference
+ */
+static void relay_close_streams(struct s_relay *relay)
+{
+  struct s_conn *conn;
+  int i;
+
+  for(i = 0; i < RELAY_STREAMS_MAX; i++) {
+    if((conn = (struct s_conn *) relay->streams[i].owner) != NULL) {
+      close_connection(conn);
+      conn_put(conn);
+    }
+  }
+}
+
+/**
+ * The out side of an edge tunnel, the serial output of the
+ * streams with credit -> hub. The data of the hub is credited
+ * once the serial port took it.
+ */
+#ifdef __linux__
+static void *relay_edge_out_handler(void *_relay)
+#elif _WIN32
+static DWORD WINAPI relay_edge_out_handler(LPVOID _relay)
+#endif
+{
+  struct s_relay *relay = (struct s_relay *) _relay;
+  struct s_relay_stream *stream;
+  struct s_conn *conn;
+  struct s_entry *entry;
+  long long done;
+  int sent;
+  int i;
+
+  while(relay->running) {
+    sent = 0;
+    for(i = 0; i < RELAY_STREAMS_MAX && relay->running; i++) {
+      stream = &relay->streams[i];
+      if((conn = (struct s_conn *) stream->owner) == NULL) {
+        continue;
+      }
+      // The in side adds to the backlog before it counts the delivery
+      done = stream->delivered;
+      done -= conn->serial_backlog;
+      if(relay_consumed(relay, i, done) < 0) {
+        relay_stop(relay);
+      }
+      while(relay->running && conn->running && stream->credit > 0 &&
+            (entry = queue_get_timeout(&conn->out_queue, 0)) != NULL) {
+        if(relay_send(relay, RELAY_DATA, i, entry->message, entry->length) < 0) {
+          relay_stop(relay);
+        }
+        __sync_sub_and_fetch(&conn->out_backlog, entry->length);
+        free(entry->message);
+        free(entry);
+        sent = 1;
+      }
+    }
+    if(!sent) {
+      semaphore_timedwait(&relay->sem, RELAY_POLL_MS);
+    }
+  }
+  relay_close_streams(relay);
+  relay_put(relay);
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
 /**
- * Print usage
+ * Connect to the hub
+ *
+ * @return the tunnel, NULL on failure
  */
-static void print_help()
+static struct s_relay *relay_connect(SSL_CTX *ctx)
 {
-  printf("Usage: dividi [OPTIONS]\n\n");
-  printf("   -c/--config [FILE]       Set a custom path to the configuration file\n");
-  printf("   -r/--rootca     [FILE]       Set the path to the root certification\n");
-  printf("   -k/--key        [FILE]       Set the path to the private key\n");
-  printf("   -s/--servercert [FILE]       Set the path to the server certification\n");
+  struct s_relay *relay;
+  BIO *sbio;
+  SSL *ssl;
+  int fd;
+
+  if((fd = socket_connect(relay_hub_host, relay_hub_port)) < 0) {
+    return NULL;
+  }
+  sbio = BIO_new_socket(fd, BIO_NOCLOSE);
+  ssl = SSL_new(ctx);
+  SSL_set_bio(ssl, sbio, sbio);
+  // Any certificate of the CA, another edge's too, would pass the chain
+  SSL_set1_host(ssl, relay_hub_name[0] != '\0' ? relay_hub_name : relay_hub_host);
+  if(SSL_connect(ssl) <= 0) {
+    ERR_print_errors_fp(stderr);
+    SSL_free(ssl);
+    close_socket(fd);
+    return NULL;
+  }
+  relay = relay_create(ssl, fd);
+  get_client_name(ssl, relay->peer);
+  return relay;
 }
 
 /**
- * This function will determine the port number
- * and the serial port by the applications
- * arguments
+ * Carry every link over a connected tunnel untill it breaks,
+ * hub -> tcp2serial_queue of the link's worker
  */
-static void handle_arguments(int argc, char **argv)
+static void relay_edge_run(struct s_relay *relay)
 {
-  int c;
-  int key = 0;
-  int cert = 0;
-  int long_index =0;
-  static struct option long_options[] = {
-    {"conf",       required_argument, 0,  'c' },
-    {"servercert", required_argument, 0,  's' },
-    {"rootca",     required_argument, 0,  'r' },
-    {"key",        required_argument, 0,  'k' },
-    {0,            0,                 0,   0  }
-  };
-  while ((c = getopt_long(argc, argv,"c:s:r:k:",
-                   long_options, &long_index)) != -1) {
-    if(optarg != NULL && strlen(optarg) > PATH_MAX) {
-      printf("File paths may be maximum %d characters long\n", PATH_MAX);
-      exit(-1);
+  struct s_conn *conn;
+  enum e_relay_frame type;
+  char port[8];
+  char *data;
+  int stream;
+  int length;
+  int total = 0;
+  int i;
+
+  // A stream is the link index, the hub knows the link by its port
+  for(i = 0; i < MAX_LINKS && i < RELAY_STREAMS_MAX; i++) {
+    if(links[i].tcp_port == 0 ||
+       (links[i].aggregate != NULL && links[i].aggregate != &links[i]) ||
+       (conn = open_relay_connection(&links[i], relay)) == NULL) {
+      continue;
     }
-    switch(c) {
-      case 'c':
-        memcpy(config_file, optarg, strlen(optarg));
-        break;
-      case 's':
-        cert = 1;
-        memcpy(cert_file, optarg, strlen(optarg));
-        break;
-      case 'k':
-        key = 1;
-        memcpy(key_file, optarg, strlen(optarg));
-        break;
-      case 'r':
-        memcpy(root_file, optarg, strlen(optarg));
-        break;
-      case 'h':
-      default:
-        print_help();
-        exit(-1);
+    relay->streams[i].owner = conn;
+    if(relay_send(relay, RELAY_OPEN, i, port, snprintf(port, sizeof(port), "%d",
+                                                     links[i].tcp_port)) < 0) {
+      relay_stop(relay);
     }
+    total++;
   }
-  if(!key && cert) {
-    memcpy(key_file, cert_file, strlen(optarg));
+  printf("relay to %s:%d (%s) up, %d links\n", relay_hub_host, relay_hub_port,
+         relay->peer, total);
+  relay_get(relay);
+  if(thread_start((THREAD_FUNC) relay_edge_out_handler, relay, NO_CPU_AFFINITY) < 0) {
+    relay_stop(relay);
+    relay_close_streams(relay);
+    relay_put(relay);
+  }
+  while((data = relay_receive(relay, &type, &stream, &length)) != NULL) {
+    conn = (struct s_conn *) relay->streams[stream].owner;
+    if(conn != NULL && conn->running && type == RELAY_DATA && length > 0) {
+      client_input(conn, data, length);
+      __sync_add_and_fetch(&relay->streams[stream].delivered, length);
+      continue;
+    }
+    if(conn != NULL && type == RELAY_CLOSE) {
+      fprintf(stderr, "relay %s: the hub has no link for port %d\n",
+              relay->peer, conn->link->tcp_port);
+      close_connection(conn);
+    }
+    free(data);
   }
+  printf("relay to %s:%d lost\n", relay_hub_host, relay_hub_port);
+  relay_stop(relay);
+  relay_close_streams(relay);
+  relay_put(relay);
 }
 
 /**
- * Open a serial port by a given name
- * and put it in the lookup table
- *
- * @link pointer to the first free entry of the table
- * @port_name the system name of the serial port
+ * The tunnel of an edge, keeps a single connection
+ * to the hub carrying all links
  */
-static void open_link(struct s_link *link, char *port_name)
+#ifdef __linux__
+static void *relay_edge_handler(void *ctx)
+#elif _WIN32
+static DWORD WINAPI relay_edge_handler(LPVOID ctx)
+#endif
 {
-  int fd;
-  dbg("opening %s\n", port_name);
-  fd = serial_open(&link->serial);
-  if(fd < 0) {
-    print_error("serial_open failed");
-    exit(-1);
+  struct s_relay *relay;
+
+  while(1) {
+    if((relay = relay_connect((SSL_CTX *) ctx)) != NULL) {
+      relay_edge_run(relay);
+    }
+#ifdef __linux__
+    usleep(RELAY_RETRY_MS * 1000);
+#elif _WIN32
+    Sleep(RELAY_RETRY_MS);
+#endif
   }
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
 }
 
-static int get_empty_link_slot()
+#ifdef __linux__
+/**
+ * Bind a stream of a tunnel to the relay link
+ * re-exporting it, the hub refuses unknown streams
+ */
+static void relay_hub_open(struct s_relay *relay, int stream, int tcp_port)
 {
+  struct s_link *link = NULL;
   int i;
-  for(i = 0; i < MAX_LINKS; i++) {
-    if(links[i].tcp_port == 0) {
-      memset(&links[i].serial, 0, sizeof(struct s_serial));
-      return i;
+
+  mutex_lock(&relay_lock);
+  for(i = 0; i < MAX_LINKS && relay->streams[stream].owner == NULL; i++) {
+    if(links[i].vserial.type == VSERIAL_RELAY && links[i].relay == NULL &&
+       links[i].relay_port == tcp_port && strcmp(links[i].relay_peer, relay->peer) == 0) {
+      link = &links[i];
+      link->relay = relay;
+      link->relay_stream = stream;
+      relay->streams[stream].owner = link;
+      relay_get(relay);
     }
   }
-  return -1;
+  mutex_unlock(&relay_lock);
+  if(link == NULL) {
+    dbg("relay %s: no link for port %d\n", relay->peer, tcp_port);
+    relay_send(relay, RELAY_CLOSE, stream, NULL, 0);
+    return;
+  }
+  printf("relay %s: port %d re-exported on port %d\n", relay->peer, tcp_port, link->tcp_port);
 }
 
-static int open_all_serial()
+/**
+ * Release the relay link of a stream
+ */
+static void relay_hub_close(struct s_relay *relay, int stream)
 {
-  int i;
-  for(i = 0; i < MAX_LINKS; i++) {
-    if(links[i].tcp_port != 0) {
-      open_link(&links[i], links[i].serial.str_serial_port);
-    }
+  struct s_link *link;
+
+  mutex_lock(&relay_lock);
+  if((link = (struct s_link *) relay->streams[stream].owner) != NULL) {
+    link->relay = NULL;
+    relay->streams[stream].owner = NULL;
+  }
+  mutex_unlock(&relay_lock);
+  if(link != NULL) {
+    relay_put(relay);
   }
-  return -1;
 }
 
-static void open_connection(SSL_CTX *ctx, int sock, struct s_link *link)
+/**
+ * Play the data of the edge as the device of a relay link
+ */
+static void relay_hub_write(struct s_link *link, char *data, int length)
 {
-  BIO     *sbio;
-  SSL     *ssl;
-  int nbr_of_references = 0;
-  struct s_conn *conn = (struct s_conn *) malloc(sizeof(struct s_conn));
+  int written;
 
-  if(conn == NULL) {
-    print_error("malloc");
-    exit(-1);
+  while(length > 0) {
+    if((written = write(link->vserial.master, data, length)) < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    link->vserial.bytes_out += written;
+    data += written;
+    length -= written;
   }
-  if ((conn->tcp_socket = accept(sock, NULL, NULL)) < 0) {
-    print_error("accept failed");
-    free(conn);
-    exit(-1);
+}
+
+/**
+ * The in side of a tunnel of a hub, edge -> the relay links,
+ * the handshake is done here so a stalled edge only holds
+ * up its own tunnel
+ */
+static void *relay_hub_handler(void *_ssl)
+{
+  SSL *ssl = (SSL *) _ssl;
+  struct s_relay *relay;
+  struct s_link *link;
+  enum e_relay_frame type;
+  char *data;
+  int stream;
+  int length;
+
+  if(SSL_accept(ssl) <= 0) {
+    ERR_print_errors_fp(stderr);
+    close(SSL_get_fd(ssl));
+    SSL_free(ssl);
+    return NULL;
   }
-  sbio = BIO_new_socket(conn->tcp_socket, BIO_NOCLOSE);
-  ssl = SSL_new(ctx);
-  SSL_set_bio(ssl, sbio, sbio);
-  if (SSL_accept(ssl) == -1) {
-    print_error("SSL_accept");
-    free(conn);
-    exit(-1);
+  relay = relay_create(ssl, SSL_get_fd(ssl));
+  get_client_name(ssl, relay->peer);
+  // The name picks the relay links the edge may feed
+  if(relay->peer[0] == '\0') {
+    fprintf(stderr, "relay refused, the edge has no common name\n");
+    relay_stop(relay);
+    relay_put(relay);
+    return NULL;
   }
-  conn->socket = ssl;
-  conn->link = link;
-  nbr_of_references = start_connection_handlers(conn);
-  // Wait until threads have copied conn
-  get_thread_started_sem(nbr_of_references);
-  free(conn);
+  printf("relay %s connected\n", relay->peer);
+  while((data = relay_receive(relay, &type, &stream, &length)) != NULL) {
+    link = (struct s_link *) relay->streams[stream].owner;
+    if(type == RELAY_OPEN) {
+      relay_hub_open(relay, stream, atoi(data));
+    } else if(type == RELAY_DATA && link != NULL) {
+      relay_hub_write(link, data, length);
+      relay->streams[stream].delivered += length;
+      if(relay_consumed(relay, stream, relay->streams[stream].delivered) < 0) {
+        relay_stop(relay);
+      }
+    } else if(type == RELAY_CLOSE) {
+      relay_hub_close(relay, stream);
+    }
+    free(data);
+  }
+  printf("relay %s disconnected\n", relay->peer);
+  relay_stop(relay);
+  for(stream = 0; stream < RELAY_STREAMS_MAX; stream++) {
+    relay_hub_close(relay, stream);
+  }
+  relay_put(relay);
+  return NULL;
 }
 
-#ifdef __linux__
 /**
- * Will check the sockets for new connection
- * requests
+ * The out side of all tunnels of a hub, what the clients of
+ * the relay links write -> edge. A link without credit keeps
+ * its data in the pty, without tunnel the data is dropped.
  */
-static int poll_sockets(struct pollfd *s, int total_links, SSL_CTX *ctx)
+static void *relay_hub_out_handler(void *arg)
 {
-  int index;
-  int polled = 0;
+  struct pollfd fds[MAX_LINKS];
+  struct s_link *owners[MAX_LINKS];
+  struct s_relay *relay;
+  struct s_link *link;
+  char *data = (char *) malloc(RELAY_FRAME_MAX);
+  int total;
+  int stream;
+  int length;
+  int i;
 
-  dbg("Polling for incoming connections\n");
-  polled = poll(s, total_links, -1);
-  if(polled > 0) {
-    for(index=0; index<total_links; index++) {
-      if(s[index].revents & POLLIN) {
-        open_connection(ctx, s[index].fd, &links[index]);
+  while(1) {
+    total = 0;
+    mutex_lock(&relay_lock);
+    for(i = 0; i < MAX_LINKS; i++) {
+      link = &links[i];
+      if(link->vserial.type != VSERIAL_RELAY ||
+         (link->relay != NULL && link->relay->streams[link->relay_stream].credit <= 0)) {
+        continue;
+      }
+      fds[total].fd = link->vserial.master;
+      fds[total].events = POLLIN;
+      owners[total++] = link;
+    }
+    mutex_unlock(&relay_lock);
+    if(poll(fds, total, RELAY_POLL_MS) <= 0) {
+      continue;
+    }
+    for(i = 0; i < total; i++) {
+      if(!(fds[i].revents & POLLIN)) {
+        continue;
+      }
+      link = owners[i];
+      mutex_lock(&relay_lock);
+      if((relay = link->relay) != NULL) {
+        relay_get(relay);
+      }
+      stream = link->relay_stream;
+      mutex_unlock(&relay_lock);
+      length = RELAY_FRAME_MAX;
+      if(relay != NULL && relay->streams[stream].credit < length) {
+        length = relay->streams[stream].credit;
+      }
+      if(length > 0 && (length = read(link->vserial.master, data, length)) > 0) {
+        link->vserial.bytes_in += length;
+        if(relay != NULL && relay_send(relay, RELAY_DATA, stream, data, length) < 0) {
+          relay_stop(relay);
+        }
+      }
+      if(relay != NULL) {
+        relay_put(relay);
       }
     }
-  } else if(polled < 0) {
-    perror("poll failed");
-    exit(-1);
-  } else {
-    dbg("Poll timed out, no incoming connections\n");
   }
-  return 0;
+  return NULL;
 }
-#elif _WIN32
+
 /**
- * Will check the sockets for new connection
- * requests
+ * Accept the tunnels of the edges
  */
-static int select_sockets(struct pollfd *s, int total_links, SSL_CTX *ctx)
+static void *relay_listen_handler(void *ctx)
 {
-  int index;
-  int maxfd;
-  int ret;
-  struct fd_set set;
+  BIO *sbio;
+  SSL *ssl;
+  struct pollfd s[MAX_LISTEN_ADDRESSES];
+  int total = total_relay_listen ? total_relay_listen : 1;
+  int tcp_socket;
+  int i;
 
-  for (index = 0; index < MAX_LINKS; index++) {
-    FD_SET(s[index].fd, &set);
-    if (s[index].fd > maxfd)
-        maxfd = s[index].fd;
+  for(i = 0; i < total; i++) {
+    s[i].fd = open_listener(relay_port, "", total_relay_listen ? relay_listen[i] :
+                            DEFAULT_LISTEN_ADDRESS, 0);
+    s[i].events = POLLIN;
   }
-
-  dbg("Polling for incoming connections\n");
-  ret = select(maxfd + 1, &set, NULL, NULL, NULL);
-
-  if (ret) {
-    for (index = 0; index < MAX_LINKS; index++) {
-      if (FD_ISSET(s[index].fd, &set)) {
-        open_connection(ctx, s[index].fd, &links[index]);
+  while(1) {
+    if(poll(s, total, -1) < 0) {
+      if(errno != EINTR) {
+        perror("poll failed");
+        exit(-1);
+      }
+      continue;
+    }
+    for(i = 0; i < total; i++) {
+      if(!(s[i].revents & POLLIN)) {
+        continue;
+      }
+      if((tcp_socket = accept(s[i].fd, NULL, NULL)) < 0) {
+        print_error("accept failed");
+        continue;
+      }
+      sbio = BIO_new_socket(tcp_socket, BIO_NOCLOSE);
+      ssl = SSL_new((SSL_CTX *) ctx);
+      SSL_set_bio(ssl, sbio, sbio);
+      if(thread_start((THREAD_FUNC) relay_hub_handler, ssl, NO_CPU_AFFINITY) < 0) {
+        SSL_free(ssl);
+        close(tcp_socket);
       }
     }
   }
-  return 0;
+  return NULL;
 }
-
 #endif
 
 /**
- * Initialises the queue
+ * Divides the links over the workers and
+ * starts them
  */
 static void init()
 {
-  allocate_queues();
-  create_queues_lock();
-  create_serial_lock();
-  init_sem();
-  start_queues_handlers();
+  int i;
+
+  for(i = 0; i < MAX_LINKS; i++) {
+    cache_create(&links[i].cache);
+    history_create(&links[i].history);
+    spill_create(&links[i].spill, links[i].tcp_port);
+    if(links[i].capture_path[0] != '\0') {
+      links[i].capture = capture_open(links[i].capture_path);
+    }
+  }
+  assign_workers();
+  capture_start();
+  if(crypto_workers > 0) {
+    pool_start(&crypto_pool, crypto_workers, conn_output, conn_output_ready);
+  }
+  start_workers();
+  for(i = 0; i < MAX_LINKS; i++) {
+    if(links[i].shm.path[0] == '\0') {
+      continue;
+    }
+    shm_create(&links[i].shm);
+#ifdef __linux__
+    if(thread_start((THREAD_FUNC) shm_handler, &links[i], links[i].worker->cpu) < 0) {
+      exit(-1);
+    }
+#endif
+  }
+  if(metrics_interval > 0 &&
+     thread_start((THREAD_FUNC) metrics_handler, NULL, NO_CPU_AFFINITY) < 0) {
+    exit(-1);
+  }
 }
 
 /**
@@ -1010,6 +3500,48 @@ static int ssl_load_certificates(SSL_CTX *ctx, char *root, char *cert, char *key
     ssl_fatal("cert/key");
   return 0;
 }
+/**
+ * Start the tunnel to the hub and the hub
+ * side of the relay links
+ *
+ * @ctx the context of the listeners, a hub accepts the edges with it
+ * @secure the certificates are loaded, a tunnel is mutually authenticated
+ */
+static void relay_start(SSL_CTX *ctx, int secure)
+{
+  SSL_CTX *client_ctx;
+  int i;
+
+  mutex_create(&relay_lock);
+  if((relay_port > 0 || relay_hub_host[0] != '\0') && !secure) {
+    fprintf(stderr, "A relay needs the certificates, see -r, -s and -k\n");
+    exit(-1);
+  }
+#ifdef __linux__
+  for(i = 0; i < MAX_LINKS && links[i].vserial.type != VSERIAL_RELAY; i++);
+  if(i < MAX_LINKS &&
+     thread_start((THREAD_FUNC) relay_hub_out_handler, NULL, NO_CPU_AFFINITY) < 0) {
+    exit(-1);
+  }
+  if(relay_port > 0 &&
+     thread_start((THREAD_FUNC) relay_listen_handler, ctx, NO_CPU_AFFINITY) < 0) {
+    exit(-1);
+  }
+#endif
+  if(relay_hub_host[0] == '\0') {
+    return;
+  }
+  // The edge shows the hub the certificate it shows its clients
+  if((client_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+    fprintf(stderr, "Can't create ssl context\n");
+    exit(-1);
+  }
+  ssl_load_certificates(client_ctx, root_file, cert_file, key_file);
+  SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+  if(thread_start((THREAD_FUNC) relay_edge_handler, client_ctx, NO_CPU_AFFINITY) < 0) {
+    exit(-1);
+  }
+}
 ////////////////////////////////////PUBLIC////////////////////////////////////////////////
 
 /**
@@ -1025,6 +3557,14 @@ struct s_link * add_link(char *serial_port, char *tcp_port)
   }
   dbg("Adding link (serial: %s, tcp: %s)\n", serial_port, tcp_port);
   links[index].tcp_port = atoi(tcp_port);
+  links[index].serial.write_latency = SERIAL_DEFAULT_WRITE_LATENCY;
+  links[index].reply_timeout = DEFAULT_REPLY_TIMEOUT;
+  links[index].broadcast_delay = DEFAULT_BROADCAST_DELAY;
+  links[index].reply_gap = DEFAULT_REPLY_GAP;
+  links[index].resume_timeout = DEFAULT_RESUME_TIMEOUT;
+  links[index].compression_level = DEFAULT_COMPRESSION_LEVEL;
+  mutex_create(&links[index].conns_lock);
+  mutex_create(&links[index].transaction_lock);
   memcpy(links[index].serial.str_serial_port, serial_port, strlen(serial_port)+1);
   return &links[index];
 }
@@ -1051,10 +3591,7 @@ int main(int argc, char **argv)
 #endif
 {
   SSL_CTX *ctx;
-  struct pollfd s[MAX_LINKS];
   int index;
-  struct sockaddr_in sain;
-  int optval = 1;
   int secure;
 
 #ifdef _WIN32
@@ -1082,56 +3619,40 @@ int main(int argc, char **argv)
   }
 
   atexit(destroy_everything);
+#ifdef __linux__
+  // A client dropped while it is being written to may not take dividi with it
+  signal(SIGPIPE, SIG_IGN);
+#endif
   memset(links, 0, MAX_LINKS*sizeof(struct s_link));
 
   conf_parse(config_file);
+  if(shared_port > 0) {
+    SSL_CTX_set_tlsext_servername_callback(ctx, route_servername);
+    SSL_CTX_set_alpn_select_cb(ctx, route_alpn, NULL);
+  }
   open_all_serial();
   init();
+  relay_start(ctx, secure);
 
   for(index=0; index<MAX_LINKS; index++) {
     if(links[index].tcp_port == 0) {
       break;
     }
-    if ((s[index].fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-      print_error("socket failed");
-      exit(-1);
-    }
-
-    memset( (char *) (&sain),0, sizeof(sain));
-    sain.sin_family = AF_INET;
-    sain.sin_port = htons(links[index].tcp_port);
-    sain.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(s[index].fd, (struct sockaddr *)&sain, sizeof(sain)) < 0) {
-      print_error("bind failed");
-      exit(-1);
-    }
-    if (listen(s[index].fd, MAX_ACTIVE_CONNECTIONS) < 0) {
-      print_error("listen failed");
-      exit(-1);
-    }
-#ifdef __linux__
-    s[index].events = POLLIN;
-#endif
-    if(setsockopt(s[index].fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&optval, sizeof(optval)) < 0) {
-      perror("setsockopt failed");
-      exit(-1);
-    }
   }
-  dividi_running = 1;
   total_links = index;
-  while(dividi_running) {
-#ifdef __linux__
-    if(poll_sockets(s, index, ctx) < 0) {
-#elif _WIN32
-    if(select_sockets(s, index, ctx) < 0) {
+  dividi_running = 1;
+#ifndef SO_REUSEPORT
+  if(total_acceptors > 1) {
+    fprintf(stderr, "SO_REUSEPORT unsupported, using a single acceptor\n");
+    total_acceptors = 1;
+  }
 #endif
-      break;
+  for(index = 1; index < total_acceptors; index++) {
+    if(thread_start((THREAD_FUNC) acceptor_handler, ctx, NO_CPU_AFFINITY) < 0) {
+      exit(-1);
     }
   }
-  for(; index>=0; index--) {
-    close_socket(s[index].fd);
-  }
+  accept_connections(ctx, total_acceptors > 1);
   dividi_running = -1;
 
   exit(0);
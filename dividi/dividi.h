@@ -14,7 +14,23 @@
 #if defined _WIN32
   #include <windows.h>
 #endif
+#include <openssl/ssl.h>
 #include "serial.h"
+#include "thread.h"
+#include "queue.h"
+#include "net.h"
+#include "fair.h"
+#include "modbus.h"
+#include "cache.h"
+#include "shm.h"
+#include "history.h"
+#include "spill.h"
+#include "capture.h"
+#include "vserial.h"
+#include "compress.h"
+#include "pool.h"
+#include "relay.h"
+#include "aggregate.h"
 
 #ifdef DEBUG
 #define dbg(fmt, ...) \
@@ -25,11 +41,233 @@
 #endif
 
 #define MAX_LINE                         100
+#define SERIAL_BACKLOG_MAX               65536
+#define DEFAULT_REPLY_TIMEOUT            1000
+#define DEFAULT_BROADCAST_DELAY          100
+#define DEFAULT_REPLY_GAP                20
+#define REPLY_END_MAX                    8
+// replies up to this size can be cached
+#define TRANSACTION_REPLY_MAX            1024
+// ms a client of a link with history has to send the resume handshake
+#define DEFAULT_RESUME_TIMEOUT           200
+#define SESSION_REPLY_MAX                32
+// the tag of the entry of the out queue that starts the compression
+#define OUT_TAG_COMPRESS                 1
+// the payload limit of a TLS record
+#define TLS_RECORD_MAX                   16384
+// bytes a connection sends per turn on the crypto pool
+#define CRYPTO_BUDGET                    (4*TLS_RECORD_MAX)
+// ms between the checks of a client that has no room
+#define CRYPTO_WRITABLE_POLL_MS          1
+#define MAX_ACTIVE_CONNECTIONS           50
+#define MAX_WORKERS                      64
+#define MAX_LISTEN_ADDRESSES             4
+#define LISTEN_ADDRESS_MAX               64
+#define INTERFACE_NAME_MAX               16
+#define SERVER_NAME_MAX                  64
+
+struct s_link;
+
+/**
+ * The engines doing the serial I/O of the workers
+ */
+enum e_io_engine {
+  IO_ENGINE_POLL,
+  IO_ENGINE_URING
+};
+
+/**
+ * What the clients of a link speak
+ */
+enum e_protocol {
+  PROTOCOL_RAW,
+  // request - reply, framed by the RTU rules
+  PROTOCOL_MODBUS_RTU,
+  // Modbus TCP clients on an RTU bus
+  PROTOCOL_MODBUS_TCP,
+  // every write is a request, the reply ends with reply_end
+  // or after reply_gap ms of silence
+  PROTOCOL_REQUEST_REPLY
+};
+
+/**
+ * The request a serial port waits on the reply for,
+ * the requester is the only client getting the reply
+ */
+struct s_transaction {
+  // NULL when no reply is expected
+  struct s_conn *conn;
+  unsigned int tag;
+  unsigned char unit;
+  unsigned char function;
+  // in us, 0 while the request is being written
+  long long deadline;
+  // in us, when the bus went silent, 0 while it's in use
+  long long idle;
+  unsigned char reply[TRANSACTION_REPLY_MAX];
+  // can exceed TRANSACTION_REPLY_MAX for streamed replies
+  int reply_length;
+  // in us, when the last byte of the reply arrived
+  long long input;
+  // bytes of reply_end seen
+  int matched;
+  unsigned long long total;
+  unsigned long long timeouts;
+};
+
+/**
+ * Serial output of a client collected into one TLS record,
+ * a record per serial chunk costs a MAC and a syscall each
+ */
+struct s_batch {
+  // grows past a record while the socket of a
+  // client on the crypto pool has no room
+  char *data;
+  int size;
+  // the unsent output is data[start..length)
+  int start;
+  int length;
+  // the record the socket had no room for, it is written
+  // again as is before anything else, 0 when none
+  int blocked;
+  // bytes added since the last flush, compressed
+  // output can still be held by the stream
+  int pending;
+  // ms, when the oldest unflushed byte was added
+  long long since;
+  unsigned long long records;
+  // writes on the socket, counted by the BIO
+  unsigned long long syscalls;
+  unsigned long long reported_records;
+  unsigned long long reported_syscalls;
+};
+
+/**
+ * A client connected to a link
+ */
+struct s_conn {
+  int id;
+  int tcp_socket;
+  SSL *socket;
+  // common name of the client certificate
+  char client_name[CLIENT_NAME_MAX];
+  struct s_link *link;
+  // the segment of a shared memory client, NULL for TCP
+  struct s_shm *shm;
+  // the tunnel of a relay stream, NULL for TCP
+  struct s_relay *relay;
+  // serial -> this client
+  struct s_queue out_queue;
+  volatile int running;
+  // serial output is only queued once live, on a link with history
+  // or compression a client goes live after the session handshake
+  int live;
+  // sequence number of the serial output when the client attached
+  unsigned long long history_seq;
+  // bytes queued for this client in memory
+  volatile int out_backlog;
+  // the client fell behind, its serial output is read from the spill log
+  int spilling;
+  // position of the client in the spill log
+  unsigned long long spill_cursor;
+  // Amount of threads and queue entries still using this conn
+  int references;
+  // bytes of this client waiting for the serial port,
+  // the client isn't read while it exceeds SERIAL_BACKLOG_MAX
+  volatile int serial_backlog;
+  SEMAPHORE backlog_sem;
+  // incomplete request of a framed protocol
+  unsigned char request[MODBUS_TCP_MAX_ADU];
+  int request_length;
+  // incomplete frame of a client of an aggregate
+  struct s_aggregate_parser aggregate;
+  struct s_conn_sched sched;
+  // the serial output is compressed once active
+  struct s_compress compress;
+  struct s_batch batch;
+  // the output on the crypto pool
+  struct s_pool_task output;
+};
+
+/**
+ * A worker owns the serial ports, the queues and the
+ * connections of a subset of the links
+ */
+struct s_worker {
+  int id;
+  int cpu;
+  int total_links;
+  // tcp -> serial ports of this worker
+  struct s_queue tcp2serial_queue;
+  struct s_worker_sched sched;
+  volatile int running;
+};
 
 // Look up table for all links
 struct s_link {
   int tcp_port;
+  // addresses to listen on, all IPv4 addresses when none are given
+  char listen[MAX_LISTEN_ADDRESSES][LISTEN_ADDRESS_MAX];
+  int total_listen;
+  char interface[INTERFACE_NAME_MAX];
+  // the name clients of the shared port send as SNI or ALPN protocol
+  char server_name[SERVER_NAME_MAX];
+  enum e_socket_profile socket_profile;
+  enum e_protocol protocol;
+  // ms to wait for the reply on a request
+  int reply_timeout;
+  // ms to leave the bus silent after a Modbus broadcast
+  int broadcast_delay;
+  char reply_end[REPLY_END_MAX];
+  int reply_end_length;
+  int reply_gap;
+  struct s_cache cache;
+  struct s_shm shm;
+  struct s_history history;
+  struct s_spill spill;
+  // trace file, the first link of a device captures its traffic
+  char capture_path[CAPTURE_PATH_MAX];
+  // 0 when not capturing
+  int capture;
+  int resume_timeout;
+  // ms serial output may wait to fill a TLS record, 0 sends
+  // it once the out queue is empty
+  int batch_delay;
+  // offered to the clients in the session handshake
+  enum e_compression compression;
+  int compression_level;
   struct s_serial serial;
+  // the device is emulated when the type isn't VSERIAL_NONE
+  struct s_vserial vserial;
+  // the edge link a relay link re-exports
+  char relay_peer[CLIENT_NAME_MAX];
+  int relay_port;
+  // the tunnel carrying a relay link, NULL while the edge is away
+  struct s_relay *relay;
+  int relay_stream;
+  // the first port of the aggregate the link is part of, NULL when it isn't
+  struct s_link *aggregate;
+  // the tag of the port in the frames of the aggregate
+  int aggregate_tag;
+  // the ports of an aggregate by tag, only used on the first port
+  struct s_link *members[AGGREGATE_PORTS_MAX];
+  int total_members;
+  // the link owning the serial port, links on the same device share it
+  struct s_link *port;
+  // the entry being written to the port, only used on the owner
+  struct s_entry *pending;
+  int pending_offset;
+  int pending_length;
+  // when the RS-485 transmit window closes, 0 while transmitting
+  long long window_end;
+  struct s_transaction transaction;
+  MUTEX transaction_lock;
+  struct s_worker *worker;
+  MUTEX conns_lock;
+  struct s_conn *conns[MAX_ACTIVE_CONNECTIONS];
+  // share of the serial port for every client
+  struct s_client_policy sched_policy;
+  struct s_client_policy client_policies[MAX_CLIENT_POLICIES];
 };
 
 /**
@@ -44,6 +282,31 @@ void set_root_file(char *value);
 void set_key_file(char *value);
 void set_cert_file(char *value);
 
+/**
+ * Set the worker pool settings
+ */
+void set_workers(char *value);
+void set_worker_cpus(char *value);
+void set_io_engine(char *value);
+void set_acceptors(char *value);
+void set_metrics_interval(char *value);
+void set_crypto_workers(char *value);
+
+/**
+ * Set the relay settings
+ */
+void set_relay_hub(char *value);
+void set_relay_hub_name(char *value);
+void set_relay_port(char *value);
+void set_relay_listen(char *value);
+
+/**
+ * Set the port the links with a server name share
+ * and the addresses it listens on
+ */
+void set_shared_port(char *value);
+void set_shared_listen(char *value);
+
 /**
  * Outputs error message
  */
@@ -0,0 +1,434 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+/**
+ * Shared memory transport for clients on the same host
+ *
+ * The segment holds a single producer, single consumer ring
+ * per direction. Every write is a record of a 4 byte length
+ * followed by the data. Both sides only make a futex call
+ * when the other side sleeps, so a busy client reads and
+ * writes without any system call.
+ *
+ * Access is controlled by the permissions of the file, one
+ * client can be attached at a time. This header is all a
+ * client needs:
+ *
+ *   struct dividi_shm shm;
+ *   char buf[256];
+ *   int length;
+ *
+ *   if(dividi_shm_attach(&shm, "/dev/shm/dividi-ttyS0") < 0) {
+ *     perror("attach");
+ *   }
+ *   dividi_shm_write(&shm, "AT\r", 3, 1000);
+ *   length = dividi_shm_read(&shm, buf, sizeof(buf), 1000);
+ *   dividi_shm_detach(&shm);
+ */
+#ifndef __DIVIDI_SHM_H__
+#define __DIVIDI_SHM_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define DIVIDI_SHM_MAGIC                 0x44495631
+#define DIVIDI_SHM_VERSION               1
+// length in front of every record
+#define DIVIDI_SHM_RECORD_HEADER         4
+
+enum dividi_shm_state {
+  // waiting for a client
+  DIVIDI_SHM_FREE,
+  DIVIDI_SHM_ATTACHED,
+  // the client left, dividi frees the segment
+  DIVIDI_SHM_DETACHED
+};
+
+/**
+ * The positions are the amount of bytes ever written and
+ * read, the producer and consumer are on their own cache line
+ */
+struct dividi_shm_ring {
+  volatile uint32_t head;
+  volatile uint32_t consumer_waiting;
+  char pad0[56];
+  volatile uint32_t tail;
+  volatile uint32_t producer_waiting;
+  char pad1[56];
+};
+
+/**
+ * Start of the segment, the data of to_client and
+ * to_serial follow it
+ */
+struct dividi_shm_header {
+  uint32_t magic;
+  uint32_t version;
+  // bytes of data of every ring, a power of two
+  uint32_t ring_size;
+  volatile uint32_t state;
+  volatile int32_t client_pid;
+  char pad[44];
+  struct dividi_shm_ring to_client;
+  struct dividi_shm_ring to_serial;
+};
+
+struct dividi_shm {
+  int fd;
+  size_t size;
+  struct dividi_shm_header *header;
+};
+
+/**
+ * Wait on or wake a futex shared between processes
+ *
+ * @timeout_ms < 0 waits forever
+ */
+static inline long dividi_shm_futex(volatile uint32_t *addr, int op, uint32_t value,
+                                    int timeout_ms)
+{
+  struct timespec timeout;
+
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  return syscall(SYS_futex, addr, op, value, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+}
+
+/**
+ * The data of a ring
+ */
+static inline char *dividi_shm_data(struct dividi_shm_header *header,
+                                    struct dividi_shm_ring *ring)
+{
+  char *data = (char *) header + sizeof(struct dividi_shm_header);
+
+  return (ring == &header->to_client) ? data : data + header->ring_size;
+}
+
+/**
+ * Copy into a ring at a position, wrapping at the end
+ */
+static inline void dividi_shm_copy_in(struct dividi_shm_header *header,
+                                      struct dividi_shm_ring *ring, uint32_t position,
+                                      const void *src, uint32_t length)
+{
+  char *data = dividi_shm_data(header, ring);
+  uint32_t offset = position & (header->ring_size - 1);
+  uint32_t first = header->ring_size - offset;
+
+  if(first > length) {
+    first = length;
+  }
+  memcpy(data + offset, src, first);
+  memcpy(data, (const char *) src + first, length - first);
+}
+
+/**
+ * Copy out of a ring at a position, wrapping at the end
+ */
+static inline void dividi_shm_copy_out(struct dividi_shm_header *header,
+                                       struct dividi_shm_ring *ring, uint32_t position,
+                                       void *dst, uint32_t length)
+{
+  char *data = dividi_shm_data(header, ring);
+  uint32_t offset = position & (header->ring_size - 1);
+  uint32_t first = header->ring_size - offset;
+
+  if(first > length) {
+    first = length;
+  }
+  memcpy(dst, data + offset, first);
+  memcpy((char *) dst + first, data, length - first);
+}
+
+/**
+ * The largest record a ring takes
+ */
+static inline uint32_t dividi_shm_record_max(struct dividi_shm_header *header)
+{
+  return header->ring_size / 2 - DIVIDI_SHM_RECORD_HEADER;
+}
+
+/**
+ * Append a record to a ring, never blocks
+ *
+ * @return 0 on succes
+ *       < 0 when there is no room
+ */
+static inline int dividi_shm_put(struct dividi_shm_header *header, struct dividi_shm_ring *ring,
+                                 const void *data, uint32_t length)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  if(header->ring_size - (head - tail) < length + DIVIDI_SHM_RECORD_HEADER) {
+    return -1;
+  }
+  dividi_shm_copy_in(header, ring, head, &length, DIVIDI_SHM_RECORD_HEADER);
+  dividi_shm_copy_in(header, ring, head + DIVIDI_SHM_RECORD_HEADER, data, length);
+  __atomic_store_n(&ring->head, head + DIVIDI_SHM_RECORD_HEADER + length, __ATOMIC_RELEASE);
+  // Pairs with the fence in dividi_shm_wait_data
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(ring->consumer_waiting) {
+    ring->consumer_waiting = 0;
+    dividi_shm_futex(&ring->head, FUTEX_WAKE, 1, -1);
+  }
+  return 0;
+}
+
+/**
+ * The length of the next record of a ring
+ *
+ * @return < 0 when the ring is empty
+ */
+static inline int dividi_shm_peek(struct dividi_shm_header *header, struct dividi_shm_ring *ring)
+{
+  uint32_t length;
+  uint32_t tail = ring->tail;
+
+  if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+    return -1;
+  }
+  dividi_shm_copy_out(header, ring, tail, &length, DIVIDI_SHM_RECORD_HEADER);
+  return length;
+}
+
+/**
+ * Take the next record of a ring, never blocks
+ *
+ * @max a longer record is truncated
+ * @return the length of the record
+ *       < 0 when the ring is empty
+ */
+static inline int dividi_shm_get(struct dividi_shm_header *header, struct dividi_shm_ring *ring,
+                                 void *data, uint32_t max)
+{
+  uint32_t tail = ring->tail;
+  int length;
+
+  if((length = dividi_shm_peek(header, ring)) < 0) {
+    return -1;
+  }
+  dividi_shm_copy_out(header, ring, tail + DIVIDI_SHM_RECORD_HEADER, data,
+                      ((uint32_t) length < max) ? (uint32_t) length : max);
+  __atomic_store_n(&ring->tail, tail + DIVIDI_SHM_RECORD_HEADER + length, __ATOMIC_RELEASE);
+  // Pairs with the fence in dividi_shm_wait_space
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(ring->producer_waiting) {
+    ring->producer_waiting = 0;
+    dividi_shm_futex(&ring->tail, FUTEX_WAKE, 1, -1);
+  }
+  return length;
+}
+
+/**
+ * Sleep untill a ring has data or the timeout expires,
+ * returns at once when there is data
+ *
+ * @return < 0 on a timeout
+ */
+static inline int dividi_shm_wait_data(struct dividi_shm_ring *ring, int timeout_ms)
+{
+  uint32_t head = ring->head;
+
+  if(head != ring->tail) {
+    return 0;
+  }
+  ring->consumer_waiting = 1;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(ring->head != head) {
+    return 0;
+  }
+  if(dividi_shm_futex(&ring->head, FUTEX_WAIT, head, timeout_ms) < 0 && errno == ETIMEDOUT) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Sleep untill a ring has room for a record of a given
+ * length or the timeout expires
+ *
+ * @return < 0 on a timeout
+ */
+static inline int dividi_shm_wait_space(struct dividi_shm_header *header,
+                                        struct dividi_shm_ring *ring, uint32_t length,
+                                        int timeout_ms)
+{
+  uint32_t tail = ring->tail;
+
+  if(header->ring_size - (ring->head - tail) >= length + DIVIDI_SHM_RECORD_HEADER) {
+    return 0;
+  }
+  ring->producer_waiting = 1;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(ring->tail != tail) {
+    return 0;
+  }
+  if(dividi_shm_futex(&ring->tail, FUTEX_WAIT, tail, timeout_ms) < 0 && errno == ETIMEDOUT) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Milliseconds left untill a deadline of CLOCK_MONOTONIC
+ */
+static inline int dividi_shm_remaining(struct timespec *deadline)
+{
+  struct timespec now;
+  long long ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (deadline->tv_sec - now.tv_sec) * 1000LL + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+  return (ms < 0) ? 0 : (int) ms;
+}
+
+/**
+ * Attach to the segment of a link
+ *
+ * @return 0 on succes
+ *       < 0 on failure, errno is EBUSY when another
+ *         client is attached
+ */
+static inline int dividi_shm_attach(struct dividi_shm *shm, const char *path)
+{
+  struct stat st;
+  struct dividi_shm_header *header;
+
+  if((shm->fd = open(path, O_RDWR)) < 0) {
+    return -1;
+  }
+  if(fstat(shm->fd, &st) < 0 || (size_t) st.st_size < sizeof(struct dividi_shm_header)) {
+    close(shm->fd);
+    errno = EINVAL;
+    return -1;
+  }
+  shm->size = st.st_size;
+  header = (struct dividi_shm_header *) mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, shm->fd, 0);
+  if(header == MAP_FAILED) {
+    close(shm->fd);
+    return -1;
+  }
+  shm->header = header;
+  if(header->magic != DIVIDI_SHM_MAGIC || header->version != DIVIDI_SHM_VERSION ||
+     sizeof(struct dividi_shm_header) + 2ULL * header->ring_size > shm->size) {
+    errno = EINVAL;
+  } else if(!__sync_bool_compare_and_swap(&header->state, DIVIDI_SHM_FREE,
+                                          DIVIDI_SHM_ATTACHED)) {
+    errno = EBUSY;
+  } else {
+    header->client_pid = getpid();
+    // dividi sleeps on the requests
+    dividi_shm_futex(&header->to_serial.head, FUTEX_WAKE, 1, -1);
+    return 0;
+  }
+  munmap(header, shm->size);
+  close(shm->fd);
+  return -1;
+}
+
+/**
+ * Read the next record of serial data
+ *
+ * @max a longer record is truncated
+ * @return the length of the record, 0 on a timeout
+ *       < 0 when dividi detached the client
+ */
+static inline int dividi_shm_read(struct dividi_shm *shm, void *data, int max, int timeout_ms)
+{
+  struct dividi_shm_header *header = shm->header;
+  struct timespec deadline;
+  int length;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if(deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while((length = dividi_shm_get(header, &header->to_client, data, max)) < 0) {
+    if(header->state != DIVIDI_SHM_ATTACHED) {
+      return -1;
+    }
+    if(timeout_ms == 0 ||
+       dividi_shm_wait_data(&header->to_client, dividi_shm_remaining(&deadline)) < 0) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+/**
+ * Write data to the serial port, data longer than
+ * a record is split over several records
+ *
+ * @return the amount of bytes written, less on a timeout
+ *       < 0 when dividi detached the client
+ */
+static inline int dividi_shm_write(struct dividi_shm *shm, const void *data, int length,
+                                   int timeout_ms)
+{
+  struct dividi_shm_header *header = shm->header;
+  struct timespec deadline;
+  uint32_t record;
+  int written = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if(deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while(written < length) {
+    if(header->state != DIVIDI_SHM_ATTACHED) {
+      return -1;
+    }
+    record = length - written;
+    if(record > dividi_shm_record_max(header)) {
+      record = dividi_shm_record_max(header);
+    }
+    if(dividi_shm_put(header, &header->to_serial, (const char *) data + written, record) == 0) {
+      written += record;
+    } else if(timeout_ms == 0 ||
+              dividi_shm_wait_space(header, &header->to_serial, record,
+                                    dividi_shm_remaining(&deadline)) < 0) {
+      break;
+    }
+  }
+  return written;
+}
+
+/**
+ * Detach from the segment, dividi frees it
+ * for the next client
+ */
+static inline void dividi_shm_detach(struct dividi_shm *shm)
+{
+  struct dividi_shm_header *header = shm->header;
+
+  header->state = DIVIDI_SHM_DETACHED;
+  dividi_shm_futex(&header->to_serial.head, FUTEX_WAKE, 1, -1);
+  munmap(header, shm->size);
+  close(shm->fd);
+}
+
+#endif
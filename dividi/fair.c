@@ -0,0 +1,273 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fair.h"
+#include "dividi.h"
+#include "util.h"
+
+/**
+ * Look up the policy for a client on a link, the
+ * link's defaults are used for unknown clients
+ */
+void sched_init_conn(struct s_conn *conn)
+{
+  struct s_link *link = conn->link;
+  int i;
+
+  memset(&conn->sched, 0, sizeof(struct s_conn_sched));
+  conn->sched.policy = link->sched_policy;
+  for(i = 0; i < MAX_CLIENT_POLICIES; i++) {
+    if(link->client_policies[i].name[0] != '\0' &&
+       strcmp(link->client_policies[i].name, conn->client_name) == 0) {
+      if(link->client_policies[i].weight) {
+        conn->sched.policy.weight = link->client_policies[i].weight;
+      }
+      if(link->client_policies[i].rate_limit) {
+        conn->sched.policy.rate_limit = link->client_policies[i].rate_limit;
+      }
+      if(link->client_policies[i].rate_burst) {
+        conn->sched.policy.rate_burst = link->client_policies[i].rate_burst;
+      }
+    }
+  }
+  if(conn->sched.policy.weight <= 0) {
+    conn->sched.policy.weight = 1;
+  }
+  if(conn->sched.policy.rate_burst <= 0) {
+    conn->sched.policy.rate_burst = DEFAULT_RATE_BURST;
+  }
+  conn->sched.tokens = conn->sched.policy.rate_burst;
+  conn->sched.tokens_time = time_ms();
+}
+
+/**
+ * Find the policy with a given name on a link, it is
+ * added when it does not exist yet
+ *
+ * @return the policy, NULL when MAX_CLIENT_POLICIES is reached
+ */
+struct s_client_policy *sched_get_policy(struct s_client_policy *policies, char *name)
+{
+  int i;
+  if(strlen(name) >= CLIENT_NAME_MAX) {
+    return NULL;
+  }
+  for(i = 0; i < MAX_CLIENT_POLICIES; i++) {
+    if(strcmp(policies[i].name, name) == 0) {
+      return &policies[i];
+    }
+  }
+  for(i = 0; i < MAX_CLIENT_POLICIES; i++) {
+    if(policies[i].name[0] == '\0') {
+      strcpy(policies[i].name, name);
+      return &policies[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Put an entry in the pending list of its connection
+ */
+static void sched_enqueue(struct s_worker_sched *sched, struct s_entry *entry)
+{
+  struct s_conn_sched *conn = &entry->conn->sched;
+
+  entry->next = NULL;
+  if(conn->tail) {
+    conn->tail->next = entry;
+  } else {
+    conn->head = entry;
+  }
+  conn->tail = entry;
+  if(!conn->active) {
+    // Append to the round
+    conn->active = 1;
+    sched->total_active++;
+    if(sched->active == NULL) {
+      conn->next_active = entry->conn;
+      conn->prev_active = entry->conn;
+      sched->active = entry->conn;
+      sched->current = entry->conn;
+    } else {
+      conn->next_active = sched->current;
+      conn->prev_active = sched->current->sched.prev_active;
+      conn->prev_active->sched.next_active = entry->conn;
+      sched->current->sched.prev_active = entry->conn;
+    }
+  }
+}
+
+/**
+ * Remove a connection without pending entries from the round
+ */
+static void sched_deactivate(struct s_worker_sched *sched, struct s_conn *conn)
+{
+  struct s_conn *next = conn->sched.next_active;
+
+  conn->sched.active = 0;
+  conn->sched.deficit = 0;
+  sched->total_active--;
+  conn->sched.visited = 0;
+  if(next == conn) {
+    sched->active = NULL;
+    sched->current = NULL;
+    return;
+  }
+  conn->sched.prev_active->sched.next_active = next;
+  next->sched.prev_active = conn->sched.prev_active;
+  if(sched->active == conn) {
+    sched->active = next;
+  }
+  if(sched->current == conn) {
+    sched->current = next;
+  }
+}
+
+/**
+ * Refill the token bucket of a connection and check
+ * if length bytes may be sent
+ *
+ * @return 0 when allowed, the amount of ms to wait otherwise
+ */
+static int sched_tokens(struct s_conn_sched *conn, int length)
+{
+  long long now;
+  double needed;
+
+  if(conn->policy.rate_limit <= 0) {
+    return 0;
+  }
+  now = time_ms();
+  conn->tokens += (now - conn->tokens_time) * conn->policy.rate_limit / 1000.0;
+  conn->tokens_time = now;
+  if(conn->tokens > conn->policy.rate_burst) {
+    conn->tokens = conn->policy.rate_burst;
+  }
+  // Messages bigger than the burst only need a full bucket
+  needed = (length < conn->policy.rate_burst) ? length : conn->policy.rate_burst;
+  if(conn->tokens >= needed) {
+    return 0;
+  }
+  return (int) ((needed - conn->tokens) * 1000 / conn->policy.rate_limit) + 1;
+}
+
+/**
+ * One deficit round robin step
+ *
+ * @wait_ms will hold the time untill a throttled connection
+ *          may send again
+ * @return the entry to write, NULL when every connection is throttled
+ */
+static struct s_entry *sched_pick(struct s_worker_sched *sched, int *wait_ms)
+{
+  struct s_conn *conn;
+  struct s_entry *entry;
+  int length;
+  int wait;
+  int throttled = 0;
+
+  *wait_ms = -1;
+  while((conn = sched->current) != NULL) {
+    entry = conn->sched.head;
+    length = entry->length;
+    // Closed connections are flushed without accounting,
+    // busy ports are skipped untill they took their pending entry
+    if(conn->running && (entry->port->pending != NULL ||
+                         (wait = sched_tokens(&conn->sched, length)) > 0)) {
+      if(entry->port->pending == NULL && (*wait_ms < 0 || wait < *wait_ms)) {
+        *wait_ms = wait;
+      }
+      conn->sched.visited = 0;
+      sched->current = conn->sched.next_active;
+      // A whole round without an unthrottled connection
+      if(++throttled == sched->total_active) {
+        return NULL;
+      }
+      continue;
+    }
+    throttled = 0;
+    if(!conn->sched.visited) {
+      conn->sched.deficit += SCHED_QUANTUM * conn->sched.policy.weight;
+      conn->sched.visited = 1;
+    }
+    if(conn->sched.deficit < length && conn->running) {
+      // Turn is over, keep the deficit for the next round
+      conn->sched.visited = 0;
+      sched->current = conn->sched.next_active;
+      continue;
+    }
+    conn->sched.deficit -= length;
+    conn->sched.head = entry->next;
+    if(conn->sched.head == NULL) {
+      conn->sched.tail = NULL;
+      sched_deactivate(sched, conn);
+    }
+    if(conn->sched.policy.rate_limit > 0) {
+      conn->sched.tokens -= length;
+    }
+    conn->sched.serial_bytes += length;
+    return entry;
+  }
+  return NULL;
+}
+
+/**
+ * Get the next entry that may be written to an idle serial
+ * port of the worker, clients are served by deficit
+ * round robin within their token bucket
+ *
+ * @timeout_ms how long to wait for an entry, 0 returns
+ *             immediately, -1 blocks
+ * @return the entry, NULL when none is available (yet)
+ */
+struct s_entry *sched_next(struct s_worker *worker, int timeout_ms)
+{
+  struct s_worker_sched *sched = &worker->sched;
+  struct s_entry *entry;
+  int wait_ms;
+
+  while(worker->running) {
+    // Move everything that arrived into the client lists
+    while((entry = queue_get_timeout(&worker->tcp2serial_queue, 0)) != NULL) {
+      sched_enqueue(sched, entry);
+    }
+    wait_ms = -1;
+    if(sched->active != NULL && (entry = sched_pick(sched, &wait_ms)) != NULL) {
+      return entry;
+    }
+    if(timeout_ms == 0) {
+      return NULL;
+    }
+    if(timeout_ms > 0 && (wait_ms < 0 || timeout_ms < wait_ms)) {
+      wait_ms = timeout_ms;
+    }
+    // Wait for tokens or new entries
+    if(wait_ms < 0) {
+      entry = queue_get(&worker->tcp2serial_queue);
+    } else {
+      entry = queue_get_timeout(&worker->tcp2serial_queue, wait_ms);
+    }
+    if(entry != NULL) {
+      sched_enqueue(sched, entry);
+    } else if(wait_ms < 0) {
+      // Woken up
+      return NULL;
+    }
+    if(timeout_ms > 0) {
+      // Waited long enough, one more try
+      timeout_ms = 0;
+    }
+  }
+  return NULL;
+}
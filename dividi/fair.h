@@ -0,0 +1,92 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __FAIR_H__
+#define __FAIR_H__
+
+#include "queue.h"
+
+#define CLIENT_NAME_MAX                  64
+#define MAX_CLIENT_POLICIES              16
+#define SCHED_QUANTUM                    64
+#define DEFAULT_RATE_BURST               1024
+
+struct s_conn;
+struct s_worker;
+
+/**
+ * The share of the serial port a client gets,
+ * clients are matched on their certificate's common name
+ */
+struct s_client_policy {
+  char name[CLIENT_NAME_MAX];
+  int weight;
+  // bytes per second, 0 for unlimited
+  int rate_limit;
+  int rate_burst;
+};
+
+/**
+ * Scheduler state of a connection, only touched by
+ * the serial out handler of its worker
+ */
+struct s_conn_sched {
+  struct s_client_policy policy;
+  // token bucket
+  double tokens;
+  long long tokens_time;
+  // deficit round robin
+  int deficit;
+  int visited;
+  struct s_entry *head;
+  struct s_entry *tail;
+  struct s_conn *prev_active;
+  struct s_conn *next_active;
+  int active;
+  // metrics
+  volatile unsigned long long serial_bytes;
+  unsigned long long reported_bytes;
+};
+
+/**
+ * Scheduler state of a worker
+ */
+struct s_worker_sched {
+  struct s_conn *active;
+  struct s_conn *current;
+  int total_active;
+};
+
+/**
+ * Look up the policy for a client on a link, the
+ * link's defaults are used for unknown clients
+ */
+void sched_init_conn(struct s_conn *conn);
+
+/**
+ * Find the policy with a given name on a link, it is
+ * added when it does not exist yet
+ *
+ * @return the policy, NULL when MAX_CLIENT_POLICIES is reached
+ */
+struct s_client_policy *sched_get_policy(struct s_client_policy *policies, char *name);
+
+/**
+ * Get the next entry that may be written to an idle serial
+ * port of the worker, clients are served by deficit
+ * round robin within their token bucket
+ *
+ * @timeout_ms how long to wait for an entry, 0 returns
+ *             immediately, -1 blocks
+ * @return the entry, NULL when none is available (yet)
+ */
+struct s_entry *sched_next(struct s_worker *worker, int timeout_ms);
+
+#endif
@@ -0,0 +1,88 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+/**
+ * Allocate the history, does nothing when
+ * it is disabled
+ */
+void history_create(struct s_history *history)
+{
+  if(history->size <= 0) {
+    return;
+  }
+  if((history->data = (char *) malloc(history->size)) == NULL) {
+    perror("malloc failed");
+    exit(-1);
+  }
+}
+
+/**
+ * Append serial output, the oldest bytes are overwritten
+ */
+void history_add(struct s_history *history, char *data, int length)
+{
+  int offset;
+  int first;
+
+  // Only the last size bytes survive
+  if(length > history->size) {
+    history->head += length - history->size;
+    data += length - history->size;
+    length = history->size;
+  }
+  offset = history->head % history->size;
+  first = history->size - offset;
+  if(first > length) {
+    first = length;
+  }
+  memcpy(history->data + offset, data, first);
+  memcpy(history->data, data + first, length - first);
+  history->head += length;
+}
+
+/**
+ * Copy the bytes from a sequence number up to the head
+ *
+ * @seq the first byte, moved to the oldest byte kept when
+ *      it is gone or to the head when it is in the future
+ * @return the copy, NULL when there is nothing to copy
+ */
+char *history_read(struct s_history *history, unsigned long long *seq, int *length)
+{
+  unsigned long long oldest = (history->head > (unsigned long long) history->size) ?
+                              history->head - history->size : 0;
+  char *copy;
+  int offset;
+  int first;
+
+  if(*seq < oldest) {
+    *seq = oldest;
+  }
+  if(*seq > history->head) {
+    *seq = history->head;
+  }
+  if((*length = history->head - *seq) == 0) {
+    return NULL;
+  }
+  copy = (char *) malloc(*length);
+  offset = *seq % history->size;
+  first = history->size - offset;
+  if(first > *length) {
+    first = *length;
+  }
+  memcpy(copy, history->data + offset, first);
+  memcpy(copy + first, history->data, *length - first);
+  return copy;
+}
@@ -0,0 +1,46 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+/**
+ * The last serial output of a link, every byte is
+ * numbered by the amount of bytes before it
+ */
+struct s_history {
+  // bytes kept, 0 disables the history
+  int size;
+  char *data;
+  // sequence number of the next byte
+  unsigned long long head;
+};
+
+/**
+ * Allocate the history, does nothing when
+ * it is disabled
+ */
+void history_create(struct s_history *history);
+
+/**
+ * Append serial output, the oldest bytes are overwritten
+ */
+void history_add(struct s_history *history, char *data, int length);
+
+/**
+ * Copy the bytes from a sequence number up to the head
+ *
+ * @seq the first byte, moved to the oldest byte kept when
+ *      it is gone or to the head when it is in the future
+ * @return the copy, NULL when there is nothing to copy
+ */
+char *history_read(struct s_history *history, unsigned long long *seq, int *length);
+
+#endif
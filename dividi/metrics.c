@@ -0,0 +1,100 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include "metrics.h"
+#include "dividi.h"
+
+/**
+ * Print the metrics of a link and its clients
+ * gathered since the previous report
+ *
+ * @interval seconds since the previous report
+ */
+void metrics_report_link(struct s_link *link, int interval)
+{
+  struct s_conn *conn;
+  unsigned long long bytes[MAX_ACTIVE_CONNECTIONS];
+  unsigned long long total = 0;
+  unsigned long long records;
+  unsigned long long syscalls;
+  int i;
+
+  mutex_lock(&link->conns_lock);
+  for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+    if((conn = link->conns[i]) == NULL) {
+      continue;
+    }
+    bytes[i] = conn->sched.serial_bytes - conn->sched.reported_bytes;
+    conn->sched.reported_bytes += bytes[i];
+    total += bytes[i];
+  }
+  printf("port %d (%s): %llu bytes/s to serial\n", link->tcp_port,
+         link->serial.str_serial_port, total / interval);
+  if(link->aggregate == link) {
+    printf("  aggregate of %d ports, to serial counts all of them\n", link->total_members);
+  } else if(link->aggregate != NULL) {
+    printf("  tag %d of the aggregate\n", link->aggregate_tag);
+  }
+  if(link->port == link) {
+    printf("  line %d bytes/s, driver queue %d bytes, write_latency %d ms\n",
+           serial_line_rate(&link->serial), serial_output_pending(link->serial.serial_port),
+           link->serial.write_latency);
+    if(link->vserial.type != VSERIAL_NONE) {
+      printf("  virtual %s, %llu bytes received, %llu bytes sent\n",
+             vserial_name(link->vserial.type), link->vserial.bytes_in, link->vserial.bytes_out);
+    }
+    if(link->vserial.type == VSERIAL_RELAY) {
+      printf("  relay of %s port %d, %s\n", link->relay_peer, link->relay_port,
+             link->relay != NULL ? "tunnel up" : "waiting for the edge");
+    }
+    if(link->transaction.total) {
+      printf("  %llu transactions, %llu without reply\n",
+             link->transaction.total, link->transaction.timeouts);
+    }
+  }
+  if(link->cache.ttl > 0) {
+    printf("  cache %llu hits, %llu misses, %llu collapsed, hit rate %.1f%%\n",
+           link->cache.hits, link->cache.misses, link->cache.collapsed,
+           (link->cache.hits + link->cache.misses) ?
+           100.0 * link->cache.hits / (link->cache.hits + link->cache.misses) : 0.0);
+  }
+  if(link->capture) {
+    printf("  capturing to %s, %llu chunks dropped\n", link->capture_path, capture_dropped());
+  }
+  if(link->spill.dir[0] != '\0') {
+    printf("  spill log at %llu bytes, %d clients behind\n", link->spill.head, link->spill.readers);
+  }
+  for(i = 0; i < MAX_ACTIVE_CONNECTIONS; i++) {
+    if((conn = link->conns[i]) == NULL) {
+      continue;
+    }
+    printf("  client %d (%s): %llu bytes/s to serial, share %.1f%%, weight %d, rate_limit %d\n",
+           conn->id, conn->client_name, bytes[i] / interval,
+           total ? bytes[i] * 100.0 / total : 0.0,
+           conn->sched.policy.weight, conn->sched.policy.rate_limit);
+    if(conn->shm == NULL && conn->relay == NULL) {
+      records = conn->batch.records - conn->batch.reported_records;
+      syscalls = conn->batch.syscalls - conn->batch.reported_syscalls;
+      conn->batch.reported_records += records;
+      conn->batch.reported_syscalls += syscalls;
+      printf("    %llu TLS records/s, %llu syscalls/s\n", records / interval, syscalls / interval);
+    }
+    if(conn->compress.active) {
+      printf("    compressed %llu -> %llu bytes, ratio %.1f, %.1f ms cpu\n",
+             conn->compress.bytes_in, conn->compress.bytes_out,
+             conn->compress.bytes_out ?
+             (double) conn->compress.bytes_in / conn->compress.bytes_out : 0.0,
+             conn->compress.cpu_ns / 1e6);
+    }
+  }
+  mutex_unlock(&link->conns_lock);
+  fflush(stdout);
+}
@@ -0,0 +1,24 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+struct s_link;
+
+/**
+ * Print the metrics of a link and its clients
+ * gathered since the previous report
+ *
+ * @interval seconds since the previous report
+ */
+void metrics_report_link(struct s_link *link, int interval);
+
+#endif
@@ -0,0 +1,250 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <string.h>
+#include "modbus.h"
+
+// address + function + CRC
+#define MODBUS_RTU_MIN_ADU               4
+
+/**
+ * Calculate the CRC16 of a Modbus RTU frame
+ */
+unsigned short modbus_crc16(const unsigned char *data, int length)
+{
+  unsigned short crc = 0xFFFF;
+  int i, j;
+
+  for(i = 0; i < length; i++) {
+    crc ^= data[i];
+    for(j = 0; j < 8; j++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+}
+
+/**
+ * Check the CRC16 at the end of a Modbus RTU frame
+ *
+ * @return 1 when the CRC matches
+ */
+int modbus_crc_valid(const unsigned char *frame, int length)
+{
+  unsigned short crc;
+
+  if(length < MODBUS_RTU_MIN_ADU) {
+    return 0;
+  }
+  crc = modbus_crc16(frame, length - 2);
+  // The CRC is sent low byte first
+  return frame[length - 2] == (crc & 0xFF) && frame[length - 1] == (crc >> 8);
+}
+
+/**
+ * Find a frame of unknown length by its CRC
+ *
+ * @return the length of the frame, 0 when more data is needed
+ *         < 0 when no frame fits in an ADU
+ */
+static int frame_length_by_crc(const unsigned char *data, int length)
+{
+  int i;
+
+  for(i = MODBUS_RTU_MIN_ADU; i <= length && i <= MODBUS_RTU_MAX_ADU; i++) {
+    if(modbus_crc_valid(data, i)) {
+      return i;
+    }
+  }
+  return (length >= MODBUS_RTU_MAX_ADU) ? -1 : 0;
+}
+
+/**
+ * Check a frame of which the length is known
+ *
+ * @return the length of the frame, 0 when more data is needed
+ *         < 0 when the CRC doesn't match
+ */
+static int frame_length(const unsigned char *data, int length, int frame_length)
+{
+  if(frame_length > MODBUS_RTU_MAX_ADU) {
+    return -1;
+  }
+  if(length < frame_length) {
+    return 0;
+  }
+  return modbus_crc_valid(data, frame_length) ? frame_length : -1;
+}
+
+/**
+ * Find the first complete RTU request in a buffer
+ *
+ * @return the length of the request, 0 when more data is needed
+ *         < 0 when the buffer doesn't start with a valid request
+ */
+int modbus_rtu_request_length(const unsigned char *data, int length)
+{
+  if(length < 2) {
+    return 0;
+  }
+  switch(data[1]) {
+  case 1: case 2: case 3: case 4: case 5: case 6: case 8:
+    return frame_length(data, length, 8);
+  case 7: case 11: case 12: case 17:
+    return frame_length(data, length, 4);
+  case 15: case 16:
+    return (length < 7) ? 0 : frame_length(data, length, 9 + data[6]);
+  case 20: case 21:
+    return (length < 3) ? 0 : frame_length(data, length, 5 + data[2]);
+  case 22:
+    return frame_length(data, length, 10);
+  case 23:
+    return (length < 11) ? 0 : frame_length(data, length, 13 + data[10]);
+  case 24:
+    return frame_length(data, length, 6);
+  default:
+    return frame_length_by_crc(data, length);
+  }
+}
+
+/**
+ * Check if a buffer holds the complete RTU reply on a request
+ * with the given function code
+ *
+ * @return the length of the reply, 0 when more data is needed
+ *         < 0 when the data isn't a valid reply
+ */
+int modbus_rtu_reply_length(const unsigned char *data, int length, unsigned char function)
+{
+  if(length < 2) {
+    return 0;
+  }
+  if(data[1] == (function | MODBUS_EXCEPTION)) {
+    return frame_length(data, length, 5);
+  }
+  if(data[1] != function) {
+    return -1;
+  }
+  switch(function) {
+  case 1: case 2: case 3: case 4: case 12: case 17:
+  case 20: case 21: case 23:
+    return (length < 3) ? 0 : frame_length(data, length, 5 + data[2]);
+  case 5: case 6: case 8: case 11: case 15: case 16:
+    return frame_length(data, length, 8);
+  case 7:
+    return frame_length(data, length, 5);
+  case 22:
+    return frame_length(data, length, 10);
+  case 24:
+    return (length < 4) ? 0 : frame_length(data, length, 6 + (data[2] << 8 | data[3]));
+  default:
+    return frame_length_by_crc(data, length);
+  }
+}
+
+/**
+ * Find the first complete Modbus TCP request in a buffer
+ *
+ * @return the length of the request, 0 when more data is needed
+ *         < 0 when the buffer doesn't start with a valid request
+ */
+int modbus_tcp_request_length(const unsigned char *data, int length)
+{
+  int pdu_length;
+
+  if(length < MODBUS_MBAP_SIZE) {
+    return 0;
+  }
+  // protocol identifier 0 is Modbus
+  pdu_length = (data[4] << 8 | data[5]);
+  if(data[2] != 0 || data[3] != 0 || pdu_length < 2 ||
+     pdu_length > MODBUS_RTU_MAX_ADU - 2) {
+    return -1;
+  }
+  return (length < 6 + pdu_length) ? 0 : 6 + pdu_length;
+}
+
+/**
+ * Convert a Modbus TCP request to an RTU frame
+ *
+ * @rtu will hold the frame, MODBUS_RTU_MAX_ADU bytes
+ * @tid will hold the transaction identifier
+ * @return the length of the RTU frame
+ */
+int modbus_tcp_to_rtu(const unsigned char *tcp, int length, unsigned char *rtu,
+                      unsigned int *tid)
+{
+  unsigned short crc;
+  int rtu_length = length - 6;
+
+  *tid = (tcp[0] << 8 | tcp[1]);
+  // The unit identifier becomes the address
+  memcpy(rtu, tcp + 6, rtu_length);
+  crc = modbus_crc16(rtu, rtu_length);
+  rtu[rtu_length++] = crc & 0xFF;
+  rtu[rtu_length++] = crc >> 8;
+  return rtu_length;
+}
+
+/**
+ * Convert an RTU reply to Modbus TCP
+ *
+ * @tcp will hold the reply, MODBUS_TCP_MAX_ADU bytes
+ * @return the length of the Modbus TCP reply
+ */
+int modbus_rtu_to_tcp(const unsigned char *rtu, int length, unsigned char *tcp,
+                      unsigned int tid)
+{
+  // Without CRC
+  length -= 2;
+  tcp[0] = tid >> 8;
+  tcp[1] = tid & 0xFF;
+  tcp[2] = 0;
+  tcp[3] = 0;
+  tcp[4] = length >> 8;
+  tcp[5] = length & 0xFF;
+  memcpy(tcp + 6, rtu, length);
+  return 6 + length;
+}
+
+/**
+ * Build the exception reply of a gateway on a request
+ *
+ * @frame will hold the RTU frame, with CRC
+ * @return the length of the frame
+ */
+int modbus_exception(unsigned char unit, unsigned char function,
+                     unsigned char code, unsigned char *frame)
+{
+  unsigned short crc;
+
+  frame[0] = unit;
+  frame[1] = function | MODBUS_EXCEPTION;
+  frame[2] = code;
+  crc = modbus_crc16(frame, 3);
+  frame[3] = crc & 0xFF;
+  frame[4] = crc >> 8;
+  return 5;
+}
+
+/**
+ * The silent interval of 3.5 characters that separates
+ * RTU frames, fixed at 1750 us above 19200 baud
+ *
+ * @return the interval in us
+ */
+int modbus_silent_interval(int baudrate)
+{
+  if(baudrate <= 0 || baudrate > 19200) {
+    return 1750;
+  }
+  // 3.5 characters of 11 bits
+  return 38500000 / baudrate;
+}
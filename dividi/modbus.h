@@ -0,0 +1,96 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __MODBUS_H__
+#define __MODBUS_H__
+
+// address + PDU + CRC
+#define MODBUS_RTU_MAX_ADU               256
+// MBAP header + PDU
+#define MODBUS_TCP_MAX_ADU               260
+#define MODBUS_MBAP_SIZE                 7
+#define MODBUS_BROADCAST                 0
+#define MODBUS_EXCEPTION                 0x80
+#define MODBUS_GATEWAY_TARGET_FAILED     0x0B
+
+/**
+ * Calculate the CRC16 of a Modbus RTU frame
+ */
+unsigned short modbus_crc16(const unsigned char *data, int length);
+
+/**
+ * Check the CRC16 at the end of a Modbus RTU frame
+ *
+ * @return 1 when the CRC matches
+ */
+int modbus_crc_valid(const unsigned char *frame, int length);
+
+/**
+ * Find the first complete RTU request in a buffer
+ *
+ * @return the length of the request, 0 when more data is needed
+ *         < 0 when the buffer doesn't start with a valid request
+ */
+int modbus_rtu_request_length(const unsigned char *data, int length);
+
+/**
+ * Check if a buffer holds the complete RTU reply on a request
+ * with the given function code
+ *
+ * @return the length of the reply, 0 when more data is needed
+ *         < 0 when the data isn't a valid reply
+ */
+int modbus_rtu_reply_length(const unsigned char *data, int length, unsigned char function);
+
+/**
+ * Find the first complete Modbus TCP request in a buffer
+ *
+ * @return the length of the request, 0 when more data is needed
+ *         < 0 when the buffer doesn't start with a valid request
+ */
+int modbus_tcp_request_length(const unsigned char *data, int length);
+
+/**
+ * Convert a Modbus TCP request to an RTU frame
+ *
+ * @rtu will hold the frame, MODBUS_RTU_MAX_ADU bytes
+ * @tid will hold the transaction identifier
+ * @return the length of the RTU frame
+ */
+int modbus_tcp_to_rtu(const unsigned char *tcp, int length, unsigned char *rtu,
+                      unsigned int *tid);
+
+/**
+ * Convert an RTU reply to Modbus TCP
+ *
+ * @tcp will hold the reply, MODBUS_TCP_MAX_ADU bytes
+ * @return the length of the Modbus TCP reply
+ */
+int modbus_rtu_to_tcp(const unsigned char *rtu, int length, unsigned char *tcp,
+                      unsigned int tid);
+
+/**
+ * Build the exception reply of a gateway on a request
+ *
+ * @frame will hold the RTU frame, with CRC
+ * @return the length of the frame
+ */
+int modbus_exception(unsigned char unit, unsigned char function,
+                     unsigned char code, unsigned char *frame);
+
+/**
+ * The silent interval of 3.5 characters that separates
+ * RTU frames, fixed at 1750 us above 19200 baud
+ *
+ * @return the interval in us
+ */
+int modbus_silent_interval(int baudrate);
+
+#endif
@@ -0,0 +1,241 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#if defined _WIN32
+  #include <winsock2.h>
+  #include <ws2tcpip.h>
+#elif __linux__
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <netdb.h>
+  #include <unistd.h>
+  #include <fcntl.h>
+#endif
+#include "net.h"
+#include "dividi.h"
+
+/**
+ * Set an integer socket option, complain when
+ * the kernel refuses it
+ */
+static int set_option(int fd, int level, int option, char *name, int value)
+{
+  if(setsockopt(fd, level, option, (const char *) &value, sizeof(value)) < 0) {
+    fprintf(stderr, "socket %d: %s=%d refused: ", fd, name, value);
+    print_error("setsockopt");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Get an integer socket option
+ *
+ * @return the value, -1 when unavailable
+ */
+static int get_option(int fd, int level, int option)
+{
+  int value = -1;
+  socklen_t len = sizeof(value);
+  if(getsockopt(fd, level, option, (char *) &value, &len) < 0) {
+    return -1;
+  }
+  return value;
+}
+
+/**
+ * Convert a profile name to the profile
+ *
+ * @return the profile, < 0 for an unknown name
+ */
+int socket_profile_from_string(char *name)
+{
+  if(strcmp(name, "default") == 0) {
+    return SOCKET_PROFILE_DEFAULT;
+  } else if(strcmp(name, "low_latency") == 0) {
+    return SOCKET_PROFILE_LOW_LATENCY;
+  } else if(strcmp(name, "throughput") == 0) {
+    return SOCKET_PROFILE_THROUGHPUT;
+  }
+  return -1;
+}
+
+/**
+ * Apply a profile to a socket
+ *
+ * @return 0 when every option was accepted
+ *       < 0 when the kernel refused one or more
+ */
+int socket_apply_profile(int fd, enum e_socket_profile profile)
+{
+  int err = 0;
+
+  switch(profile) {
+    case SOCKET_PROFILE_LOW_LATENCY:
+      err |= set_option(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+#ifdef TCP_QUICKACK
+      err |= set_option(fd, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", 1);
+#endif
+#ifdef SO_BUSY_POLL
+      err |= set_option(fd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", SOCKET_BUSY_POLL_US);
+#endif
+      break;
+    case SOCKET_PROFILE_THROUGHPUT:
+      err |= set_option(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", SOCKET_BUFFER_SIZE);
+      err |= set_option(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", SOCKET_BUFFER_SIZE);
+#ifdef TCP_CORK
+      err |= set_option(fd, IPPROTO_TCP, TCP_CORK, "TCP_CORK", 1);
+#endif
+      break;
+    case SOCKET_PROFILE_DEFAULT:
+    default:
+      break;
+  }
+  return err;
+}
+
+/**
+ * Print the effective options of a socket
+ */
+void socket_report(int fd, int tcp_port)
+{
+  printf("port %d socket %d: nodelay=%d", tcp_port, fd,
+         get_option(fd, IPPROTO_TCP, TCP_NODELAY));
+#ifdef TCP_QUICKACK
+  printf(" quickack=%d", get_option(fd, IPPROTO_TCP, TCP_QUICKACK));
+#endif
+#ifdef SO_BUSY_POLL
+  printf(" busy_poll=%d", get_option(fd, SOL_SOCKET, SO_BUSY_POLL));
+#endif
+#ifdef TCP_CORK
+  printf(" cork=%d", get_option(fd, IPPROTO_TCP, TCP_CORK));
+#endif
+  printf(" sndbuf=%d rcvbuf=%d\n", get_option(fd, SOL_SOCKET, SO_SNDBUF),
+         get_option(fd, SOL_SOCKET, SO_RCVBUF));
+}
+
+/**
+ * Re-enable quick acks, the kernel clears them
+ * after every receive
+ */
+void socket_quickack(int fd)
+{
+#ifdef TCP_QUICKACK
+  int value = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, (const char *) &value, sizeof(value));
+#endif
+}
+
+/**
+ * Push out the data held back by TCP_CORK
+ */
+void socket_flush_cork(int fd)
+{
+#ifdef TCP_CORK
+  int value = 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, (const char *) &value, sizeof(value));
+  value = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, (const char *) &value, sizeof(value));
+#endif
+}
+
+/**
+ * Let the reads and writes of a socket return
+ * instead of waiting for data or room
+ *
+ * @return 0 on succes
+ */
+int socket_set_nonblocking(int fd)
+{
+#ifdef __linux__
+  return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#elif _WIN32
+  u_long mode = 1;
+  return ioctlsocket(fd, FIONBIO, &mode);
+#endif
+}
+
+/**
+ * Wait untill a socket has data to read
+ *
+ * @return 1 when readable, 0 on a timeout
+ */
+int socket_wait_readable(int fd, int timeout_ms)
+{
+  fd_set set;
+  struct timeval timeout;
+
+  FD_ZERO(&set);
+  FD_SET(fd, &set);
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  return select(fd + 1, &set, NULL, NULL, &timeout) > 0;
+}
+
+/**
+ * Wait untill a socket has room to write
+ *
+ * @return 1 when writable, 0 on a timeout
+ */
+int socket_wait_writable(int fd, int timeout_ms)
+{
+  fd_set set;
+  struct timeval timeout;
+
+  FD_ZERO(&set);
+  FD_SET(fd, &set);
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  return select(fd + 1, NULL, &set, NULL, &timeout) > 0;
+}
+
+/**
+ * Connect to a host
+ *
+ * @return the socket, < 0 on error
+ */
+int socket_connect(char *host, int tcp_port)
+{
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+  char port[8];
+  int fd = -1;
+  int err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  snprintf(port, sizeof(port), "%d", tcp_port);
+  if((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "Can't resolve %s: %s\n", host, gai_strerror(err));
+    return -1;
+  }
+  for(ai = res; ai != NULL; ai = ai->ai_next) {
+    if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+      continue;
+    }
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+#ifdef __linux__
+    close(fd);
+#elif _WIN32
+    closesocket(fd);
+#endif
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
@@ -0,0 +1,88 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __NET_H__
+#define __NET_H__
+
+#define SOCKET_BUFFER_SIZE           (1024*1024)
+#define SOCKET_BUSY_POLL_US          50
+#define SOCKET_CORK_FLUSH_MS         20
+
+/**
+ * The sets of socket options applied to
+ * the accepted connections of a link
+ */
+enum e_socket_profile {
+  SOCKET_PROFILE_DEFAULT,
+  SOCKET_PROFILE_LOW_LATENCY,
+  SOCKET_PROFILE_THROUGHPUT
+};
+
+/**
+ * Convert a profile name to the profile
+ *
+ * @return the profile, < 0 for an unknown name
+ */
+int socket_profile_from_string(char *name);
+
+/**
+ * Apply a profile to a socket
+ *
+ * @return 0 when every option was accepted
+ *       < 0 when the kernel refused one or more
+ */
+int socket_apply_profile(int fd, enum e_socket_profile profile);
+
+/**
+ * Print the effective options of a socket
+ */
+void socket_report(int fd, int tcp_port);
+
+/**
+ * Re-enable quick acks, the kernel clears them
+ * after every receive
+ */
+void socket_quickack(int fd);
+
+/**
+ * Push out the data held back by TCP_CORK
+ */
+void socket_flush_cork(int fd);
+
+/**
+ * Let the reads and writes of a socket return
+ * instead of waiting for data or room
+ *
+ * @return 0 on succes
+ */
+int socket_set_nonblocking(int fd);
+
+/**
+ * Wait untill a socket has data to read
+ *
+ * @return 1 when readable, 0 on a timeout
+ */
+int socket_wait_readable(int fd, int timeout_ms);
+
+/**
+ * Wait untill a socket has room to write
+ *
+ * @return 1 when writable, 0 on a timeout
+ */
+int socket_wait_writable(int fd, int timeout_ms);
+
+/**
+ * Connect to a host
+ *
+ * @return the socket, < 0 on error
+ */
+int socket_connect(char *host, int tcp_port);
+
+#endif
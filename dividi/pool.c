@@ -0,0 +1,201 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+#include "util.h"
+
+/**
+ * Add a task at the end of the run queue of a worker
+ */
+static void pool_push(struct s_pool_worker *worker, struct s_pool_task *task)
+{
+  task->next = NULL;
+  mutex_lock(&worker->lock);
+  if(worker->tail != NULL) {
+    worker->tail->next = task;
+  } else {
+    worker->head = task;
+  }
+  worker->tail = task;
+  mutex_unlock(&worker->lock);
+}
+
+/**
+ * Take the first task of the run queue of a worker
+ *
+ * @return the task, NULL when the queue is empty
+ */
+static struct s_pool_task *pool_pop(struct s_pool_worker *worker)
+{
+  struct s_pool_task *task;
+
+  // Peek without the lock, an empty queue is the common case
+  if(__atomic_load_n(&worker->head, __ATOMIC_RELAXED) == NULL) {
+    return NULL;
+  }
+  mutex_lock(&worker->lock);
+  if((task = worker->head) != NULL) {
+    worker->head = task->next;
+    if(worker->head == NULL) {
+      worker->tail = NULL;
+    }
+  }
+  mutex_unlock(&worker->lock);
+  return task;
+}
+
+/**
+ * Take a task of the other workers
+ *
+ * @return the task, NULL when there is no work
+ */
+static struct s_pool_task *pool_steal(struct s_pool_worker *worker)
+{
+  struct s_pool *pool = worker->pool;
+  struct s_pool_task *task;
+  int i;
+
+  for(i = 1; i < pool->total_workers; i++) {
+    if((task = pool_pop(&pool->workers[(worker->id + i) % pool->total_workers])) != NULL) {
+      __sync_add_and_fetch(&pool->steals, 1);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Move the waiting tasks that are due to the run queue
+ *
+ * @return ms untill the next waiting task is due
+ */
+static int pool_due(struct s_pool_worker *worker)
+{
+  struct s_pool_task **link = &worker->waiting;
+  struct s_pool_task *task;
+  long long now = time_ms();
+  int timeout = POOL_IDLE_MS;
+
+  while((task = *link) != NULL) {
+    if(task->due <= now) {
+      *link = task->next;
+      pool_push(worker, task);
+      timeout = 0;
+      continue;
+    }
+    if(task->due - now < timeout) {
+      timeout = task->due - now;
+    }
+    link = &task->next;
+  }
+  return timeout;
+}
+
+/**
+ * Run a task and put it back according to the result
+ */
+static void pool_run(struct s_pool_worker *worker, struct s_pool_task *task)
+{
+  struct s_pool *pool = worker->pool;
+  int wait_ms = 0;
+
+  __sync_add_and_fetch(&pool->runs, 1);
+  switch(pool->run(task->arg, &wait_ms)) {
+    case POOL_GONE:
+      break;
+    case POOL_AGAIN:
+      pool_push(worker, task);
+      break;
+    case POOL_WAIT:
+      task->due = time_ms() + wait_ms;
+      task->next = worker->waiting;
+      worker->waiting = task;
+      break;
+    default:
+      // Work added while the task ran didn't schedule it
+      __sync_lock_release(&task->scheduled);
+      __sync_synchronize();
+      if(pool->ready(task->arg)) {
+        pool_schedule(pool, task);
+      }
+      break;
+  }
+}
+
+/**
+ * A worker thread of the pool
+ */
+#ifdef __linux__
+static void *pool_handler(void *_worker)
+#elif _WIN32
+static DWORD WINAPI pool_handler(LPVOID _worker)
+#endif
+{
+  struct s_pool_worker *worker = (struct s_pool_worker *) _worker;
+  struct s_pool_task *task;
+  int timeout;
+
+  while(1) {
+    timeout = pool_due(worker);
+    if((task = pool_pop(worker)) == NULL && (task = pool_steal(worker)) == NULL) {
+      semaphore_timedwait(&worker->pool->sem, timeout);
+      continue;
+    }
+    pool_run(worker, task);
+  }
+#ifdef __linux__
+  return NULL;
+#elif _WIN32
+  return 0;
+#endif
+}
+
+/**
+ * Start the workers of a pool, exits on failure
+ */
+void pool_start(struct s_pool *pool, int total_workers, POOL_FUNC run, POOL_READY_FUNC ready)
+{
+  int i;
+
+  if(total_workers < 1 || total_workers > POOL_WORKERS_MAX) {
+    fprintf(stderr, "a pool has between 1 and %d workers\n", POOL_WORKERS_MAX);
+    exit(-1);
+  }
+  pool->total_workers = total_workers;
+  pool->run = run;
+  pool->ready = ready;
+  semaphore_create(&pool->sem);
+  for(i = 0; i < total_workers; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    mutex_create(&pool->workers[i].lock);
+  }
+  for(i = 0; i < total_workers; i++) {
+    if(thread_start((THREAD_FUNC) pool_handler, &pool->workers[i], NO_CPU_AFFINITY) < 0) {
+      exit(-1);
+    }
+  }
+}
+
+/**
+ * Queue a task, does nothing when it's already
+ * scheduled
+ */
+void pool_schedule(struct s_pool *pool, struct s_pool_task *task)
+{
+  if(!__sync_bool_compare_and_swap(&task->scheduled, 0, 1)) {
+    return;
+  }
+  pool_push(&pool->workers[__sync_fetch_and_add(&pool->next, 1) % pool->total_workers], task);
+  semaphore_post(&pool->sem, 1);
+}
@@ -0,0 +1,101 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "thread.h"
+
+#define POOL_WORKERS_MAX                 64
+// ms an idle worker sleeps before it looks for work again
+#define POOL_IDLE_MS                     10
+
+/**
+ * What a task wants after it ran
+ */
+enum e_pool_result {
+  // nothing left to do, the task runs again once scheduled
+  POOL_DONE,
+  // run again as soon as possible
+  POOL_AGAIN,
+  // run again after wait_ms
+  POOL_WAIT,
+  // the task freed itself, it may not be touched anymore
+  POOL_GONE
+};
+
+/**
+ * Work to do
+ *
+ * @wait_ms will hold the wait on POOL_WAIT
+ */
+typedef enum e_pool_result (*POOL_FUNC)(void *arg, int *wait_ms);
+
+/**
+ * Check if a task got work after it returned POOL_DONE,
+ * it isn't scheduled while it runs
+ */
+typedef int (*POOL_READY_FUNC)(void *arg);
+
+/**
+ * A task, at most once in the pool
+ */
+struct s_pool_task {
+  void *arg;
+  // set from scheduling untill the task is done
+  volatile int scheduled;
+  // ms, when a waiting task runs again
+  long long due;
+  struct s_pool_task *next;
+};
+
+struct s_pool;
+
+/**
+ * A thread of the pool with its own run queue, an
+ * idle worker steals from the queues of the others
+ */
+struct s_pool_worker {
+  struct s_pool *pool;
+  int id;
+  MUTEX lock;
+  struct s_pool_task *head;
+  struct s_pool_task *tail;
+  // tasks waiting for their due time, only used by the worker itself
+  struct s_pool_task *waiting;
+};
+
+/**
+ * Work-stealing thread pool
+ */
+struct s_pool {
+  int total_workers;
+  struct s_pool_worker workers[POOL_WORKERS_MAX];
+  POOL_FUNC run;
+  POOL_READY_FUNC ready;
+  // posted for every scheduled task, wakes an idle worker
+  SEMAPHORE sem;
+  volatile unsigned int next;
+  unsigned long long runs;
+  unsigned long long steals;
+};
+
+/**
+ * Start the workers of a pool, exits on failure
+ */
+void pool_start(struct s_pool *pool, int total_workers, POOL_FUNC run, POOL_READY_FUNC ready);
+
+/**
+ * Queue a task, does nothing when it's already
+ * scheduled
+ */
+void pool_schedule(struct s_pool *pool, struct s_pool_task *task);
+
+#endif
@@ -0,0 +1,127 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "queue.h"
+#include "dividi.h"
+
+/**
+ * Allocate and initialise a queue, exits on failure
+ */
+void queue_create(struct s_queue *queue)
+{
+  queue->entries = (struct s_entry **) calloc(QUEUE_SIZE, sizeof(struct s_entry *));
+  if(!queue->entries) {
+    print_error("malloc failed");
+    exit(-1);
+  }
+  queue->start = 0;
+  queue->index = 0;
+  queue->count = 0;
+  mutex_create(&queue->lock);
+  semaphore_create(&queue->sem);
+}
+
+/**
+ * Free a queue and all the entries that are still in it
+ */
+void queue_destroy(struct s_queue *queue)
+{
+  int i;
+  if(queue->entries == NULL) {
+    return;
+  }
+  for(i = 0; i < QUEUE_SIZE; i++) {
+    if(queue->entries[i] != NULL) {
+      free(queue->entries[i]->message);
+      free(queue->entries[i]);
+    }
+  }
+  free(queue->entries);
+  queue->entries = NULL;
+  mutex_destroy(&queue->lock);
+  semaphore_destroy(&queue->sem);
+}
+
+/**
+ * Add an entry at the end of the queue
+ *
+ * @return 0 on succes
+ *       < 0 when the queue is full
+ */
+int queue_add(struct s_queue *queue, struct s_entry *entry)
+{
+  mutex_lock(&queue->lock);
+  if(queue->count == QUEUE_SIZE) {
+    mutex_unlock(&queue->lock);
+    dbg("queue full, dropping %.*s\n", entry->length, entry->message);
+    return -1;
+  }
+  queue->entries[queue->index] = entry;
+  queue->index = (queue->index + 1) % QUEUE_SIZE;
+  queue->count++;
+  mutex_unlock(&queue->lock);
+  semaphore_post(&queue->sem, 1);
+  return 0;
+}
+
+/**
+ * Pop the first entry, if any
+ */
+static struct s_entry *queue_pop(struct s_queue *queue)
+{
+  struct s_entry *entry = NULL;
+
+  mutex_lock(&queue->lock);
+  if(queue->count) {
+    entry = queue->entries[queue->start];
+    queue->entries[queue->start] = NULL;
+    queue->start = (queue->start + 1) % QUEUE_SIZE;
+    queue->count--;
+  }
+  mutex_unlock(&queue->lock);
+  return entry;
+}
+
+/**
+ * Take the first entry of the queue, blocks untill
+ * an entry is available or the queue is woken up
+ *
+ * @return the entry, NULL when woken up without entries
+ */
+struct s_entry *queue_get(struct s_queue *queue)
+{
+  semaphore_wait(&queue->sem);
+  return queue_pop(queue);
+}
+
+/**
+ * Same as queue_get, but gives up after timeout_ms
+ *
+ * @return the entry, NULL on timeout
+ */
+struct s_entry *queue_get_timeout(struct s_queue *queue, int timeout_ms)
+{
+  if(semaphore_timedwait(&queue->sem, timeout_ms) < 0) {
+    return NULL;
+  }
+  return queue_pop(queue);
+}
+
+/**
+ * Wake up a thread blocked in queue_get, so it can
+ * check if it should still be running
+ */
+void queue_wakeup(struct s_queue *queue)
+{
+  semaphore_post(&queue->sem, 1);
+}
@@ -0,0 +1,86 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include "thread.h"
+
+#define QUEUE_SIZE                       1000
+#define MAX_SEM_COUNT                    QUEUE_SIZE
+
+struct s_conn;
+struct s_link;
+
+// queue entry
+struct s_entry {
+  struct s_conn *conn;
+  char *message;
+  int length;
+  // protocol specific, the Modbus TCP transaction identifier
+  // or the tag of the port of an aggregate
+  unsigned int tag;
+  // tcp2serial, the port the message is written to
+  struct s_link *port;
+  struct s_entry *next;
+};
+
+/**
+ * Bounded first in - first out message queue
+ */
+struct s_queue {
+  struct s_entry **entries;
+  volatile int start;
+  volatile int index;
+  volatile int count;
+  MUTEX lock;
+  SEMAPHORE sem;
+};
+
+/**
+ * Allocate and initialise a queue, exits on failure
+ */
+void queue_create(struct s_queue *queue);
+
+/**
+ * Free a queue and all the entries that are still in it
+ */
+void queue_destroy(struct s_queue *queue);
+
+/**
+ * Add an entry at the end of the queue
+ *
+ * @return 0 on succes
+ *       < 0 when the queue is full
+ */
+int queue_add(struct s_queue *queue, struct s_entry *entry);
+
+/**
+ * Take the first entry of the queue, blocks untill
+ * an entry is available or the queue is woken up
+ *
+ * @return the entry, NULL when woken up without entries
+ */
+struct s_entry *queue_get(struct s_queue *queue);
+
+/**
+ * Same as queue_get, but gives up after timeout_ms
+ *
+ * @return the entry, NULL on timeout
+ */
+struct s_entry *queue_get_timeout(struct s_queue *queue, int timeout_ms);
+
+/**
+ * Wake up a thread blocked in queue_get, so it can
+ * check if it should still be running
+ */
+void queue_wakeup(struct s_queue *queue);
+
+#endif
@@ -0,0 +1,256 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined _WIN32
+  #include <winsock2.h>
+#elif __linux__
+  #include <unistd.h>
+  #include <sys/socket.h>
+#endif
+#include "relay.h"
+
+/**
+ * Read exactly length bytes of the tunnel
+ *
+ * @return   0 on succes
+ *         < 0 when the tunnel broke
+ */
+static int relay_read(struct s_relay *relay, char *data, int length)
+{
+  int bytes_read;
+
+  while(length > 0) {
+    if((bytes_read = SSL_read(relay->socket, data, length)) <= 0) {
+      return -1;
+    }
+    data += bytes_read;
+    length -= bytes_read;
+  }
+  return 0;
+}
+
+/**
+ * Create a tunnel on an established TLS connection,
+ * the tunnel takes the socket
+ *
+ * @return the tunnel with one reference
+ */
+struct s_relay *relay_create(SSL *socket, int tcp_socket)
+{
+  struct s_relay *relay = (struct s_relay *) calloc(1, sizeof(struct s_relay));
+  int i;
+
+  if(relay == NULL) {
+    perror("malloc");
+    exit(-1);
+  }
+  relay->socket = socket;
+  relay->tcp_socket = tcp_socket;
+  relay->running = 1;
+  relay->references = 1;
+  mutex_create(&relay->write_lock);
+  mutex_create(&relay->lock);
+  semaphore_create(&relay->sem);
+  for(i = 0; i < RELAY_STREAMS_MAX; i++) {
+    relay->streams[i].credit = RELAY_WINDOW;
+  }
+  return relay;
+}
+
+/**
+ * Take a reference on a tunnel
+ */
+void relay_get(struct s_relay *relay)
+{
+  mutex_lock(&relay->lock);
+  relay->references++;
+  mutex_unlock(&relay->lock);
+}
+
+/**
+ * Drop a reference on a tunnel, the last
+ * reference frees it
+ */
+void relay_put(struct s_relay *relay)
+{
+  int references;
+
+  mutex_lock(&relay->lock);
+  references = --relay->references;
+  mutex_unlock(&relay->lock);
+  if(references == 0) {
+    SSL_free(relay->socket);
+#ifdef __linux__
+    close(relay->tcp_socket);
+#elif _WIN32
+    closesocket(relay->tcp_socket);
+#endif
+    mutex_destroy(&relay->write_lock);
+    mutex_destroy(&relay->lock);
+    semaphore_destroy(&relay->sem);
+    free(relay);
+  }
+}
+
+/**
+ * Stop a tunnel, a blocked receive returns
+ */
+void relay_stop(struct s_relay *relay)
+{
+  mutex_lock(&relay->lock);
+  if(relay->running) {
+    relay->running = 0;
+#ifdef __linux__
+    shutdown(relay->tcp_socket, SHUT_RDWR);
+#elif _WIN32
+    shutdown(relay->tcp_socket, SD_BOTH);
+#endif
+  }
+  mutex_unlock(&relay->lock);
+  semaphore_post(&relay->sem, 1);
+}
+
+/**
+ * Build a frame header
+ */
+void relay_pack_header(unsigned char *header, enum e_relay_frame type, int stream, int length)
+{
+  header[0] = type;
+  header[1] = 0;
+  header[2] = stream >> 8;
+  header[3] = stream;
+  header[4] = length >> 24;
+  header[5] = length >> 16;
+  header[6] = length >> 8;
+  header[7] = length;
+}
+
+/**
+ * Parse a frame header
+ *
+ * @return   0 on succes
+ *         < 0 when it isn't a valid header
+ */
+int relay_unpack_header(unsigned char *header, enum e_relay_frame *type, int *stream,
+                        int *length)
+{
+  *type = header[0];
+  *stream = (header[2] << 8) | header[3];
+  *length = (header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+  if(*type < RELAY_OPEN || *type > RELAY_CLOSE || header[1] != 0 ||
+     *stream >= RELAY_STREAMS_MAX || *length < 0 || *length > RELAY_FRAME_MAX) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Send a frame, data is split over as many
+ * frames as needed and takes credit
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int relay_send(struct s_relay *relay, enum e_relay_frame type, int stream,
+               char *data, int length)
+{
+  char frame[RELAY_HEADER_SIZE + RELAY_FRAME_MAX];
+  int size;
+  int ret = 0;
+
+  if(type == RELAY_DATA) {
+    __sync_sub_and_fetch(&relay->streams[stream].credit, length);
+  }
+  mutex_lock(&relay->write_lock);
+  do {
+    size = length > RELAY_FRAME_MAX ? RELAY_FRAME_MAX : length;
+    relay_pack_header((unsigned char *) frame, type, stream, size);
+    memcpy(frame + RELAY_HEADER_SIZE, data, size);
+    // A frame is a single record
+    if(SSL_write(relay->socket, frame, RELAY_HEADER_SIZE + size) <= 0) {
+      ret = -1;
+      break;
+    }
+    relay->frames_out++;
+    data += size;
+    length -= size;
+  } while(length > 0);
+  mutex_unlock(&relay->write_lock);
+  return ret;
+}
+
+/**
+ * Receive the next frame, credit is handled
+ * and never returned
+ *
+ * @return the payload, the caller frees it, NULL when the tunnel broke
+ */
+char *relay_receive(struct s_relay *relay, enum e_relay_frame *type, int *stream,
+                    int *length)
+{
+  unsigned char header[RELAY_HEADER_SIZE];
+  char *data;
+  int credit;
+
+  while(1) {
+    if(relay_read(relay, (char *) header, RELAY_HEADER_SIZE) < 0) {
+      return NULL;
+    }
+    if(relay_unpack_header(header, type, stream, length) < 0) {
+      fprintf(stderr, "relay %s: invalid frame\n", relay->peer);
+      return NULL;
+    }
+    data = (char *) malloc(*length + 1);
+    if(relay_read(relay, data, *length) < 0) {
+      free(data);
+      return NULL;
+    }
+    data[*length] = '\0';
+    relay->frames_in++;
+    if(*type != RELAY_CREDIT) {
+      return data;
+    }
+    if(*length == 4) {
+      credit = ((unsigned char) data[0] << 24) | ((unsigned char) data[1] << 16) |
+               ((unsigned char) data[2] << 8) | (unsigned char) data[3];
+      __sync_add_and_fetch(&relay->streams[*stream].credit, credit);
+      semaphore_post(&relay->sem, 1);
+    }
+    free(data);
+  }
+}
+
+/**
+ * Return the credit of the received bytes the
+ * stream handed on
+ *
+ * @done bytes of delivered that are handed on
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int relay_consumed(struct s_relay *relay, int stream, long long done)
+{
+  struct s_relay_stream *s = &relay->streams[stream];
+  unsigned char credit[4];
+  long long bytes = done - (long long) s->credited;
+
+  if(bytes < RELAY_CREDIT_STEP) {
+    return 0;
+  }
+  s->credited += bytes;
+  credit[0] = bytes >> 24;
+  credit[1] = bytes >> 16;
+  credit[2] = bytes >> 8;
+  credit[3] = bytes;
+  return relay_send(relay, RELAY_CREDIT, stream, (char *) credit, 4);
+}
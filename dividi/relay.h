@@ -0,0 +1,149 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <openssl/ssl.h>
+#include "thread.h"
+#include "fair.h"
+
+#define RELAY_STREAMS_MAX                256
+#define RELAY_HEADER_SIZE                8
+// payload limit of a frame, a frame fits one TLS record
+#define RELAY_FRAME_MAX                  (16384 - RELAY_HEADER_SIZE)
+// bytes a side may send on a stream before the other side returns credit
+#define RELAY_WINDOW                     65536
+// credit goes back in steps, not per frame
+#define RELAY_CREDIT_STEP                (RELAY_WINDOW/4)
+// ms between the checks of the streams waiting on credit
+#define RELAY_POLL_MS                    10
+// ms an edge waits before it connects to the hub again
+#define RELAY_RETRY_MS                   1000
+#define RELAY_HOST_MAX                   64
+
+/**
+ * The frames of a tunnel, a header holds the type, a reserved
+ * byte, the stream and the payload length in network order
+ */
+enum e_relay_frame {
+  // edge -> hub, the payload is the tcp port of the edge link
+  RELAY_OPEN = 1,
+  RELAY_DATA,
+  // the payload is the amount of bytes the receiver may send more
+  RELAY_CREDIT,
+  // the hub refused the stream
+  RELAY_CLOSE
+};
+
+/**
+ * A link carried by a tunnel, every side may send
+ * RELAY_WINDOW bytes before it gets credit
+ */
+struct s_relay_stream {
+  // the connection on the edge, the link on the hub, NULL when unused
+  void *owner;
+  // bytes this side may still send, a chunk can overdraw it
+  volatile int credit;
+  // bytes received on the stream
+  volatile unsigned long long delivered;
+  // bytes of delivered returned as credit
+  unsigned long long credited;
+};
+
+/**
+ * A mutually authenticated TLS connection
+ * between an edge and a hub
+ */
+struct s_relay {
+  SSL *socket;
+  int tcp_socket;
+  // common name of the other side
+  char peer[CLIENT_NAME_MAX];
+  volatile int running;
+  // one frame at a time, both sides of a tunnel write
+  MUTEX write_lock;
+  MUTEX lock;
+  int references;
+  // posted when a stream gets credit or output
+  SEMAPHORE sem;
+  struct s_relay_stream streams[RELAY_STREAMS_MAX];
+  unsigned long long frames_in;
+  unsigned long long frames_out;
+};
+
+/**
+ * Create a tunnel on an established TLS connection,
+ * the tunnel takes the socket
+ *
+ * @return the tunnel with one reference
+ */
+struct s_relay *relay_create(SSL *socket, int tcp_socket);
+
+/**
+ * Take a reference on a tunnel
+ */
+void relay_get(struct s_relay *relay);
+
+/**
+ * Drop a reference on a tunnel, the last
+ * reference frees it
+ */
+void relay_put(struct s_relay *relay);
+
+/**
+ * Stop a tunnel, a blocked receive returns
+ */
+void relay_stop(struct s_relay *relay);
+
+/**
+ * Send a frame, data is split over as many
+ * frames as needed and takes credit
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int relay_send(struct s_relay *relay, enum e_relay_frame type, int stream,
+               char *data, int length);
+
+/**
+ * Receive the next frame, credit is handled
+ * and never returned
+ *
+ * @return the payload, the caller frees it, NULL when the tunnel broke
+ */
+char *relay_receive(struct s_relay *relay, enum e_relay_frame *type, int *stream,
+                    int *length);
+
+/**
+ * Return the credit of the received bytes the
+ * stream handed on
+ *
+ * @done bytes of delivered that are handed on
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int relay_consumed(struct s_relay *relay, int stream, long long done);
+
+/**
+ * Build a frame header
+ */
+void relay_pack_header(unsigned char *header, enum e_relay_frame type, int stream, int length);
+
+/**
+ * Parse a frame header
+ *
+ * @return   0 on succes
+ *         < 0 when it isn't a valid header
+ */
+int relay_unpack_header(unsigned char *header, enum e_relay_frame *type, int *stream,
+                        int *length);
+
+#endif
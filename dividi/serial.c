@@ -11,6 +11,7 @@
 #include <malloc.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #ifdef _WIN32
   #include <winsock2.h>
   #include <ws2tcpip.h>
@@ -22,14 +23,25 @@
   #include <errno.h>
   #include <fcntl.h>
   #include <termios.h>
+  #include <sys/ioctl.h>
+  #include <linux/serial.h>
+  #include <libgen.h>
+  #include <limits.h>
   #include <arpa/inet.h>
   #include <sys/socket.h>
 #endif
 #include "serial.h"
 #include "dividi.h"
 
-#define SERIAL_DATA_CHUNK_SIZE 512
 #define SERIAL_DATA_MAX        50*SERIAL_DATA_CHUNK_SIZE
+#define SERIAL_XON             0x11
+#define SERIAL_XOFF            0x13
+// How often a port stalled by DSR is checked
+#define SERIAL_FLOW_POLL_MS    10
+// latency_timer in ms of the FTDI driver in low latency mode
+#define SERIAL_FTDI_LATENCY_TIMER 1
+// Deviation of the configured baudrate that is tolerated, in 0.1%
+#define SERIAL_MAX_RATE_DEVIATION 20
 
 #ifdef _WIN32
   #define SERIAL_PREFIX       "\\\\.\\"
@@ -38,6 +50,58 @@
 static int rate_to_constant(int baudrate);
 
 #ifdef __linux__
+/**
+ * The termios2 of the kernel, <asm/termbits.h> can't be
+ * included next to <termios.h>
+ */
+struct s_termios2 {
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
+
+#define SERIAL_TCGETS2         _IOR('T', 0x2A, struct s_termios2)
+#define SERIAL_TCSETS2         _IOW('T', 0x2B, struct s_termios2)
+#define SERIAL_CBAUD           0010017
+#define SERIAL_BOTHER          0010000
+
+/**
+ * Set the baudrate as an integer through termios2, this
+ * allows the rates without a Bxxx constant
+ * Afterwards actual_baudrate holds the rate the driver
+ * configured, 0 when the driver doesn't support termios2
+ * or no baudrate is configured
+ */
+static int set_custom_rate(struct s_serial *serial)
+{
+  struct s_termios2 tty;
+
+  serial->actual_baudrate = 0;
+  // BOTHER with speed 0 would hang up the line, the driver keeps its rate
+  if(serial->baudrate <= 0) {
+    return 0;
+  }
+  if(ioctl(serial->serial_port, SERIAL_TCGETS2, &tty) < 0) {
+    // Only fatal when there is no constant for the rate
+    return rate_to_constant(serial->baudrate) ? 0 : -1;
+  }
+  if(rate_to_constant(serial->baudrate) == 0) {
+    tty.c_cflag = (tty.c_cflag & ~SERIAL_CBAUD) | SERIAL_BOTHER;
+    tty.c_ospeed = tty.c_ispeed = serial->baudrate;
+    if(ioctl(serial->serial_port, SERIAL_TCSETS2, &tty) < 0 ||
+       ioctl(serial->serial_port, SERIAL_TCGETS2, &tty) < 0) {
+      return -1;
+    }
+  }
+  serial->actual_baudrate = tty.c_ospeed;
+  return 0;
+}
+
 /**
  * Convert data_bits in integer format
  * to the constant format
@@ -52,6 +116,28 @@ static int databits_to_constant(int data_bits)
 #undef CS
 }
 
+/**
+ * Let the driver drive RTS around every transmission
+ */
+static int set_rs485(struct s_serial *serial)
+{
+  struct serial_rs485 rs485;
+
+  memset(&rs485, 0, sizeof(rs485));
+  rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+  rs485.delay_rts_before_send = serial->rs485_delay_before;
+  rs485.delay_rts_after_send = serial->rs485_delay_after;
+  if(ioctl(serial->serial_port, TIOCSRS485, &rs485) < 0) {
+    fprintf(stderr, "serial %s: driver refused RS-485 mode: %s\n",
+            serial->str_serial_port, strerror(errno));
+    return -1;
+  }
+  ioctl(serial->serial_port, TIOCGRS485, &rs485);
+  printf("serial %s: RS-485, RTS delay %u ms before, %u ms after send\n",
+         serial->str_serial_port, rs485.delay_rts_before_send, rs485.delay_rts_after_send);
+  return 0;
+}
+
 /**
  * Sets the attributes of the serial port
  *
@@ -59,14 +145,17 @@ static int databits_to_constant(int data_bits)
 static int set_interface_attribs(struct s_serial *serial)
 {
   struct termios tty;
+  int dtr = TIOCM_DTR;
   int err = 0;
   memset (&tty, 0, sizeof tty);
   if (tcgetattr (serial->serial_port, &tty) != 0) {
     err = -1;
   } else {
-    /* set baudrate */
-    cfsetospeed (&tty, rate_to_constant(serial->baudrate));
-    cfsetispeed (&tty, rate_to_constant(serial->baudrate));
+    /* set baudrate, rates without a constant are set by set_custom_rate() */
+    if(rate_to_constant(serial->baudrate)) {
+      cfsetospeed (&tty, rate_to_constant(serial->baudrate));
+      cfsetispeed (&tty, rate_to_constant(serial->baudrate));
+    }
 
     tty.c_cflag = (tty.c_cflag & ~CSIZE) | databits_to_constant(serial->data_bits);
     // disable IGNBRK for mismatched speed tests; otherwise receive break
@@ -78,6 +167,16 @@ static int set_interface_attribs(struct s_serial *serial)
 
     tty.c_iflag &= ~(IXON | IXOFF | IXANY); // shut off xon/xoff ctrl
     tty.c_cflag |= (CLOCAL | CREAD);// ignore modem controls,
+    tty.c_cflag &= ~CRTSCTS;
+
+    /* flow control, DSR/DTR is handled by serial_write_budget() */
+    if(serial->flow == FLOW_XON_XOFF) {
+      tty.c_iflag |= (IXON | IXOFF);
+      tty.c_cc[VSTART] = SERIAL_XON;
+      tty.c_cc[VSTOP] = SERIAL_XOFF;
+    } else if(serial->flow == FLOW_RTS_CTS) {
+      tty.c_cflag |= CRTSCTS;
+    }
 
     /* parity */
     if(serial->parity == PARITY_NONE) {
@@ -97,10 +196,16 @@ static int set_interface_attribs(struct s_serial *serial)
       tty.c_cflag |= CSTOPB;
     }
 
-    tty.c_cflag &= ~CRTSCTS;
-
     if (tcsetattr(serial->serial_port, TCSANOW, &tty) != 0) {
       err = 1;
+    } else if(set_custom_rate(serial) < 0) {
+      err = -1;
+    }
+    if(serial->flow == FLOW_DSR_DTR && ioctl(serial->serial_port, TIOCMBIS, &dtr) < 0) {
+      err = 1;
+    }
+    if(serial->mode == SERIAL_MODE_RS485 && set_rs485(serial) < 0) {
+      err = -1;
     }
   }
 
@@ -139,6 +244,70 @@ int serial_set_timeout(HANDLE serial_port, int timeout_ms)
   return err;
 }
 
+/**
+ * Set the latency_timer of an FTDI adapter through sysfs,
+ * it defaults to 16ms
+ *
+ * @return the latency timer in ms
+ *         < 0 when the port has no latency_timer or it was refused
+ */
+static int set_latency_timer(struct s_serial *serial)
+{
+  char device[PATH_MAX];
+  char path[PATH_MAX];
+  FILE *file;
+  int timer = -1;
+
+  // The port can be a symlink like /dev/serial/by-id/...
+  if(realpath(serial->str_serial_port, device) == NULL) {
+    return -1;
+  }
+  snprintf(path, PATH_MAX, "/sys/class/tty/%s/device/latency_timer", basename(device));
+  if((file = fopen(path, "w")) == NULL) {
+    return -1;
+  }
+  fprintf(file, "%d", SERIAL_FTDI_LATENCY_TIMER);
+  if(fclose(file) == 0 && (file = fopen(path, "r")) != NULL) {
+    if(fscanf(file, "%d", &timer) != 1) {
+      timer = -1;
+    }
+    fclose(file);
+  }
+  return timer;
+}
+
+/**
+ * Make the driver hand over received data immediately
+ * instead of batching it, failures are reported but
+ * the port stays usable
+ */
+static void set_low_latency(struct s_serial *serial)
+{
+  struct serial_struct info;
+  int timer;
+
+  if(ioctl(serial->serial_port, TIOCGSERIAL, &info) < 0) {
+    fprintf(stderr, "serial %s: driver has no TIOCGSERIAL, ASYNC_LOW_LATENCY not set\n",
+            serial->str_serial_port);
+  } else {
+    info.flags |= ASYNC_LOW_LATENCY;
+    if(ioctl(serial->serial_port, TIOCSSERIAL, &info) < 0 ||
+       ioctl(serial->serial_port, TIOCGSERIAL, &info) < 0 ||
+       !(info.flags & ASYNC_LOW_LATENCY)) {
+      fprintf(stderr, "serial %s: driver refused ASYNC_LOW_LATENCY\n",
+              serial->str_serial_port);
+    } else {
+      printf("serial %s: ASYNC_LOW_LATENCY set\n", serial->str_serial_port);
+    }
+  }
+  if((timer = set_latency_timer(serial)) >= 0) {
+    printf("serial %s: latency_timer %d ms\n", serial->str_serial_port, timer);
+  } else if(errno != ENOENT) {
+    fprintf(stderr, "serial %s: latency_timer not set: %s\n",
+            serial->str_serial_port, strerror(errno));
+  }
+}
+
 /**
  * Open a serial port by given port name
  *
@@ -148,9 +317,10 @@ int serial_set_timeout(HANDLE serial_port, int timeout_ms)
 int serial_open(struct s_serial *serial)
 {
   int ret = 0;
+  const char *path = serial->device[0] != '\0' ? serial->device : serial->str_serial_port;
 
-  serial->serial_port = open(serial->str_serial_port, O_RDWR | O_NOCTTY | O_SYNC);
-  printf("serial: %d %s\n", serial->serial_port, serial->str_serial_port);
+  serial->serial_port = open(path, O_RDWR | O_NOCTTY | O_SYNC);
+  printf("serial: %d %s\n", serial->serial_port, path);
   if (serial->serial_port >= 0) {
     if(set_interface_attribs(serial) < 0) {
       close(serial->serial_port);
@@ -158,6 +328,8 @@ int serial_open(struct s_serial *serial)
     } else if(serial_set_timeout(serial->serial_port, serial->timeout) < 0) {
       close(serial->serial_port);
       ret = -1;
+    } else if(serial->low_latency) {
+      set_low_latency(serial);
     }
   } else {
     ret = -1;
@@ -219,10 +391,25 @@ static int set_interface_attribs (struct s_serial *serial)
     dcbSerialParams.ByteSize = serial->data_bits;
     dcbSerialParams.StopBits = serial->stop_bits;
     dcbSerialParams.Parity = serial->parity;
+    dcbSerialParams.fOutxCtsFlow = (serial->flow == FLOW_RTS_CTS);
+    dcbSerialParams.fRtsControl = (serial->flow == FLOW_RTS_CTS) ?
+                                  RTS_CONTROL_HANDSHAKE : RTS_CONTROL_ENABLE;
+    // No RTS delays on Windows, the driver raises RTS while sending
+    if(serial->mode == SERIAL_MODE_RS485) {
+      dcbSerialParams.fRtsControl = RTS_CONTROL_TOGGLE;
+    }
+    dcbSerialParams.fOutxDsrFlow = (serial->flow == FLOW_DSR_DTR);
+    dcbSerialParams.fDtrControl = (serial->flow == FLOW_DSR_DTR) ?
+                                  DTR_CONTROL_HANDSHAKE : DTR_CONTROL_ENABLE;
+    dcbSerialParams.fOutX = dcbSerialParams.fInX = (serial->flow == FLOW_XON_XOFF);
+    dcbSerialParams.XonChar = SERIAL_XON;
+    dcbSerialParams.XoffChar = SERIAL_XOFF;
     if(SetCommState(serial->serial_port, &dcbSerialParams) == 0) {
       CloseHandle(serial->serial_port);
       err = -1;
     } else {
+      serial->actual_baudrate = GetCommState(serial->serial_port, &dcbSerialParams) ?
+                                dcbSerialParams.BaudRate : 0;
       // Set COM port timeout settings
       err = serial_set_timeout(serial->serial_port, serial->timeout);
     }
@@ -251,6 +438,10 @@ int serial_open(struct s_serial *serial)
   } else {
     if(set_interface_attribs(serial) < 0) {
       ret = -1;
+    } else if(serial->low_latency) {
+      // The FTDI latency timer lives in the registry on Windows
+      fprintf(stderr, "serial %s: low_latency is not supported on Windows\n",
+              serial->str_serial_port);
     }
   }
   return ret;
@@ -269,7 +460,8 @@ static int rate_to_constant(int baudrate)
     CBR(9600);    CBR(14400);   CBR(19200);
     CBR(38400);   CBR(57600);   CBR(115200);
     CBR(128000);  CBR(256000);
-  default: return 0;
+  // The driver decides if it supports the rate
+  default: return baudrate;
   }
 #undef B
 }
@@ -277,6 +469,34 @@ static int rate_to_constant(int baudrate)
 
 #endif
 
+/**
+ * Print the rate the driver configured, the requested
+ * rate isn't always achievable
+ */
+void serial_report(struct s_serial *serial)
+{
+  int deviation;
+
+  if(serial->baudrate <= 0) {
+    printf("serial %s: no baudrate configured, the driver keeps its rate\n",
+           serial->str_serial_port);
+    return;
+  }
+  if(serial->actual_baudrate == 0) {
+    printf("serial %s: %d baud requested, actual rate unknown\n",
+           serial->str_serial_port, serial->baudrate);
+    return;
+  }
+  deviation = (serial->actual_baudrate - serial->baudrate) * 1000LL / serial->baudrate;
+  printf("serial %s: %d baud requested, %d baud configured (%+d.%d%%)\n",
+         serial->str_serial_port, serial->baudrate, serial->actual_baudrate,
+         deviation / 10, abs(deviation % 10));
+  if(deviation > SERIAL_MAX_RATE_DEVIATION || deviation < -SERIAL_MAX_RATE_DEVIATION) {
+    fprintf(stderr, "serial %s: baudrate deviates too much, expect framing errors\n",
+            serial->str_serial_port);
+  }
+}
+
 /**
  * This function will close a serial port
  *
@@ -297,13 +517,16 @@ void serial_close(HANDLE serial_port)
  * @serial_port the serial port identifier
  * @data pointer to a null terminated string
  */
-int serial_write(HANDLE serial_port, char *data)
+int serial_write(HANDLE serial_port, char *data, int length)
 {
   int bytes_written;
 #ifdef __linux__
-  if((bytes_written = write(serial_port, data, strlen(data))) != strlen(data)) {
+  if((bytes_written = write(serial_port, data, length)) < 0) {
+    if(errno == EAGAIN) {
+      return 0;
+    }
 #elif _WIN32
-  if(!WriteFile(serial_port,data, strlen(data), (LPDWORD) &bytes_written, NULL)) {
+  if(!WriteFile(serial_port,data, length, (LPDWORD) &bytes_written, NULL)) {
 #endif
     serial_close(serial_port);
     bytes_written = -1;
@@ -311,6 +534,134 @@ int serial_write(HANDLE serial_port, char *data)
   return bytes_written;
 }
 
+/**
+ * The amount of bytes the port can put on the wire
+ * per second, derived from the baudrate and framing
+ */
+int serial_line_rate(struct s_serial *serial)
+{
+  // start bit + data bits + parity bit + stop bits
+  int bits = 1 + (serial->data_bits ? serial->data_bits : 8) +
+             (serial->parity != PARITY_NONE) +
+             (serial->stop_bits == 2 ? 2 : 1);
+
+  return (serial->actual_baudrate ? serial->actual_baudrate : serial->baudrate) / bits;
+}
+
+/**
+ * The amount of bytes waiting in the output queue
+ * of the driver
+ *
+ * @return the amount of bytes
+ *         < 0 when unknown
+ */
+int serial_output_pending(HANDLE serial_port)
+{
+#ifdef __linux__
+  int pending;
+
+  if(ioctl(serial_port, TIOCOUTQ, &pending) < 0) {
+    return -1;
+  }
+  return pending;
+#elif _WIN32
+  COMSTAT status;
+  DWORD errors;
+
+  if(!ClearCommError(serial_port, &errors, &status)) {
+    return -1;
+  }
+  return status.cbOutQue;
+#endif
+}
+
+/**
+ * Check if the transmitter sent the last byte
+ * handed to the driver
+ */
+int serial_transmit_done(HANDLE serial_port)
+{
+#ifdef __linux__
+  int status;
+
+  // The line status register also covers the shift register
+  if(ioctl(serial_port, TIOCSERGETLSR, &status) == 0) {
+    return (status & TIOCSER_TEMT) != 0;
+  }
+#endif
+  return serial_output_pending(serial_port) <= 0;
+}
+
+/**
+ * Check if the other side accepts data, only DSR/DTR flow
+ * control is done in userspace, the others are handled
+ * by the driver
+ */
+static int serial_output_ready(struct s_serial *serial)
+{
+#ifdef __linux__
+  int status;
+
+  if(serial->flow == FLOW_DSR_DTR &&
+     ioctl(serial->serial_port, TIOCMGET, &status) == 0) {
+    return (status & TIOCM_DSR) != 0;
+  }
+#endif
+  return 1;
+}
+
+/**
+ * The budget math of serial_write_budget
+ *
+ * @rate the bytes per second of the line
+ * @write_latency the ms of output the driver may hold
+ * @pending the bytes the driver holds
+ * @wait_ms will hold the time untill the port can take
+ *          more data when 0 is returned
+ * @return the amount of bytes, 0 when the port has to drain first
+ */
+static int serial_budget(int rate, int write_latency, int pending, int *wait_ms)
+{
+  int target = (long long) rate * write_latency / 1000;
+
+  if(target < 1) {
+    target = 1;
+  }
+  // Only refill when a quarter of the window drained,
+  // avoids a syscall per byte on slow ports
+  if(target - pending < (target + 3) / 4) {
+    *wait_ms = 1 + (pending - target + (target + 3) / 4) * 1000 / rate;
+    return 0;
+  }
+  return target - pending;
+}
+
+/**
+ * The amount of bytes that can be written without exceeding
+ * the write_latency of the port
+ *
+ * @wait_ms will hold the time untill the port can take
+ *          more data when 0 is returned
+ * @return the amount of bytes, 0 when the port has to drain first
+ *         or flow control stopped it
+ *         < 0 when the port isn't paced
+ */
+int serial_write_budget(struct s_serial *serial, int *wait_ms)
+{
+  int rate = serial_line_rate(serial);
+  int pending;
+
+  if(!serial_output_ready(serial)) {
+    *wait_ms = SERIAL_FLOW_POLL_MS;
+    return 0;
+  }
+  if(serial->write_latency <= 0 || rate <= 0 ||
+     (pending = serial_output_pending(serial->serial_port)) < 0) {
+    return -1;
+  }
+  return serial_budget(rate, serial->write_latency, pending, wait_ms);
+}
+
 /**
  * Reads an unknown amount chunks of data from a given serial port
  *
@@ -332,7 +683,7 @@ char *serial_read(HANDLE serial_port, int *total_bytes_read)
 #elif _WIN32
     ReadFile(serial_port, pos, SERIAL_DATA_CHUNK_SIZE, (LPDWORD) &bytes_read, NULL);
 #endif
-    if(!bytes_read || ((total_read+=bytes_read) >= SERIAL_DATA_MAX)) {
+    if(bytes_read <= 0 || ((total_read+=bytes_read) >= SERIAL_DATA_MAX)) {
       break;
     }
     if(bytes_read != SERIAL_DATA_CHUNK_SIZE) {
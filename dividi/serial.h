@@ -20,6 +20,9 @@
 #endif
 
 #define SERIAL_NAME_MAX 20
+#define SERIAL_DATA_CHUNK_SIZE 512
+// How much data (in ms on the wire) may wait in the driver
+#define SERIAL_DEFAULT_WRITE_LATENCY 50
 
 /**
  * The different flow controls
@@ -40,18 +43,41 @@ enum e_parity {
   PARITY_EVEN
 };
 
+/**
+ * Electrical modes, on RS-485 the driver
+ * toggles RTS around every transmission
+ */
+enum e_serial_mode {
+  SERIAL_MODE_RS232,
+  SERIAL_MODE_RS485
+};
+
 /**
  * Serial interface
  */
 struct s_serial {
   char str_serial_port[SERIAL_NAME_MAX];
+  // opened instead of str_serial_port when set, the pty of a virtual device
+  char device[SERIAL_NAME_MAX];
   HANDLE serial_port;
   int timeout;
   int baudrate;
+  // the rate the driver configured, 0 when unknown
+  int actual_baudrate;
   int data_bits;
   int stop_bits;
   enum e_parity parity;
   enum e_flow flow;
+  // ms of data dividi keeps queued in the driver, 0 disables pacing
+  int write_latency;
+  // ask the driver not to batch received data (Linux only)
+  int low_latency;
+  enum e_serial_mode mode;
+  // ms RTS is raised before and kept after a transmission
+  int rs485_delay_before;
+  int rs485_delay_after;
+  // ms the bus is left to the device after a transmission
+  int rs485_turnaround;
 };
 
 /**
@@ -70,6 +96,12 @@ int serial_open(struct s_serial *serial);
  */
 int serial_set_timeout(HANDLE serial_port, int timeout_ms);
 
+/**
+ * Print the rate the driver configured, the requested
+ * rate isn't always achievable
+ */
+void serial_report(struct s_serial *serial);
+
 /**
  * Closes a serial port
  *
@@ -81,9 +113,46 @@ void serial_close(HANDLE serial_port);
  * Write data to a given serial port
  *
  * @serial_port the serial port identifier
- * @data pointer to a null terminated string
+ * @data pointer to the data
+ * @length the amount of bytes to write
+ * @return the amount of bytes written, can be less than
+ *         length when the driver is full
+ *         < 0 on error
+ */
+int serial_write(HANDLE serial_port, char *data, int length);
+
+/**
+ * The amount of bytes the port can put on the wire
+ * per second, derived from the baudrate and framing
+ */
+int serial_line_rate(struct s_serial *serial);
+
+/**
+ * The amount of bytes waiting in the output queue
+ * of the driver
+ *
+ * @return the amount of bytes
+ *         < 0 when unknown
+ */
+int serial_output_pending(HANDLE serial_port);
+
+/**
+ * Check if the transmitter sent the last byte
+ * handed to the driver
+ */
+int serial_transmit_done(HANDLE serial_port);
+
+/**
+ * The amount of bytes that can be written without exceeding
+ * the write_latency of the port
+ *
+ * @wait_ms will hold the time untill the port can take
+ *          more data when 0 is returned
+ * @return the amount of bytes, 0 when the port has to drain first
+ *         or flow control stopped it
+ *         < 0 when the port isn't paced
  */
-int serial_write(HANDLE serial_port, char *data);
+int serial_write_budget(struct s_serial *serial, int *wait_ms);
 
 /**
  * Reads an unknown amount chunks of data from a given serial port
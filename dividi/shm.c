@@ -0,0 +1,329 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shm.h"
+#include "dividi.h"
+#ifdef __linux__
+#include <signal.h>
+#include "dividi_shm.h"
+#endif
+
+#ifdef __linux__
+/**
+ * Create the file and map it, exits on failure
+ */
+void shm_create(struct s_shm *shm)
+{
+  size_t size;
+  int fd;
+
+  if(shm->mode == 0) {
+    shm->mode = DEFAULT_SHM_MODE;
+  }
+  if(shm->size <= 0) {
+    shm->size = DEFAULT_SHM_SIZE;
+  }
+  if(shm->size & (shm->size - 1)) {
+    fprintf(stderr, "shm_size of %s must be a power of two\n", shm->path);
+    exit(-1);
+  }
+  size = sizeof(struct dividi_shm_header) + 2 * (size_t) shm->size;
+  // A stale segment could still be mapped by an old client
+  unlink(shm->path);
+  if((fd = open(shm->path, O_RDWR | O_CREAT | O_EXCL, shm->mode)) < 0) {
+    perror("shm open failed");
+    exit(-1);
+  }
+  // Not restricted by the umask
+  if(fchmod(fd, shm->mode) < 0 || ftruncate(fd, size) < 0) {
+    perror("shm setup failed");
+    exit(-1);
+  }
+  shm->header = (struct dividi_shm_header *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED, fd, 0);
+  close(fd);
+  if(shm->header == MAP_FAILED) {
+    perror("shm mmap failed");
+    exit(-1);
+  }
+  shm->header->version = DIVIDI_SHM_VERSION;
+  shm_reset(shm);
+  mutex_create(&shm->lock);
+  // Clients check the magic last
+  __atomic_store_n(&shm->header->magic, DIVIDI_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove the file
+ */
+void shm_destroy(struct s_shm *shm)
+{
+  if(shm->header != NULL) {
+    unlink(shm->path);
+  }
+}
+
+/**
+ * Empty the rings and wait for the next client,
+ * nobody may use the rings anymore
+ */
+void shm_reset(struct s_shm *shm)
+{
+  struct dividi_shm_header *header = shm->header;
+
+  memset(&header->to_client, 0, sizeof(struct dividi_shm_ring));
+  memset(&header->to_serial, 0, sizeof(struct dividi_shm_ring));
+  header->ring_size = shm->size;
+  header->client_pid = 0;
+  shm->to_client_head = 0;
+  shm->to_serial_tail = 0;
+  __atomic_store_n(&header->state, DIVIDI_SHM_FREE, __ATOMIC_RELEASE);
+}
+
+/**
+ * Check if a client is attached, a client that
+ * died is detached
+ */
+int shm_attached(struct s_shm *shm)
+{
+  return shm->header->state == DIVIDI_SHM_ATTACHED;
+}
+
+/**
+ * Check if the client left, the segment has to be
+ * reset for the next one
+ */
+int shm_detached(struct s_shm *shm)
+{
+  return shm->header->state == DIVIDI_SHM_DETACHED;
+}
+
+/**
+ * The pid of the attached client
+ */
+int shm_client_pid(struct s_shm *shm)
+{
+  return shm->header->client_pid;
+}
+
+/**
+ * Sleep untill the client writes or attaches or
+ * detaches, or the timeout expires
+ */
+void shm_wait(struct s_shm *shm, int timeout_ms)
+{
+  struct dividi_shm_header *header = shm->header;
+  struct dividi_shm_ring *ring = &header->to_serial;
+  uint32_t head = ring->head;
+  pid_t pid;
+
+  // The tail in the segment isn't trusted, a client could keep it off the head
+  if(head != shm->to_serial_tail) {
+    return;
+  }
+  ring->consumer_waiting = 1;
+  // Pairs with the fence in dividi_shm_put
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(ring->head != head ||
+     dividi_shm_futex(&ring->head, FUTEX_WAIT, head, timeout_ms) == 0 || errno != ETIMEDOUT) {
+    return;
+  }
+  // Only checked while idle, a busy client is alive
+  pid = header->client_pid;
+  if(header->state == DIVIDI_SHM_ATTACHED && pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+    dbg("shm client %d of %s died\n", pid, shm->path);
+    header->state = DIVIDI_SHM_DETACHED;
+  }
+}
+
+/**
+ * The data of a ring, located by the ring size of
+ * dividi and not the one in the segment
+ */
+static char *shm_data(struct s_shm *shm, struct dividi_shm_ring *ring)
+{
+  char *data = (char *) shm->header + sizeof(struct dividi_shm_header);
+
+  return (ring == &shm->header->to_client) ? data : data + shm->size;
+}
+
+/**
+ * Copy into a ring at a position, wrapping at the end
+ */
+static void shm_copy_in(struct s_shm *shm, struct dividi_shm_ring *ring, uint32_t position,
+                        const char *src, uint32_t length)
+{
+  char *data = shm_data(shm, ring);
+  uint32_t offset = position & (shm->size - 1);
+  uint32_t first = shm->size - offset;
+
+  if(first > length) {
+    first = length;
+  }
+  memcpy(data + offset, src, first);
+  memcpy(data, src + first, length - first);
+}
+
+/**
+ * Copy out of a ring at a position, wrapping at the end
+ */
+static void shm_copy_out(struct s_shm *shm, struct dividi_shm_ring *ring, uint32_t position,
+                         char *dst, uint32_t length)
+{
+  char *data = shm_data(shm, ring);
+  uint32_t offset = position & (shm->size - 1);
+  uint32_t first = shm->size - offset;
+
+  if(first > length) {
+    first = length;
+  }
+  memcpy(dst, data + offset, first);
+  memcpy(dst + first, data, length - first);
+}
+
+/**
+ * Detach a client that wrote positions or lengths
+ * outside of the ring
+ */
+static void shm_corrupted(struct s_shm *shm)
+{
+  fprintf(stderr, "shm client %d corrupted the ring of %s\n", shm->header->client_pid,
+          shm->path);
+  shm->header->state = DIVIDI_SHM_DETACHED;
+}
+
+/**
+ * Take the next record of the client, a client that
+ * corrupted the ring is detached
+ *
+ * @return the record, NULL when there is none
+ */
+char *shm_receive(struct s_shm *shm, int *length)
+{
+  struct dividi_shm_ring *ring = &shm->header->to_serial;
+  uint32_t tail = shm->to_serial_tail;
+  uint32_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+  uint32_t record;
+  char *data;
+
+  if(used == 0) {
+    return NULL;
+  }
+  if(used > (uint32_t) shm->size || used < DIVIDI_SHM_RECORD_HEADER) {
+    shm_corrupted(shm);
+    return NULL;
+  }
+  shm_copy_out(shm, ring, tail, (char *) &record, DIVIDI_SHM_RECORD_HEADER);
+  if(record > (uint32_t) shm->size / 2 - DIVIDI_SHM_RECORD_HEADER ||
+     record > used - DIVIDI_SHM_RECORD_HEADER) {
+    shm_corrupted(shm);
+    return NULL;
+  }
+  data = (char *) malloc(record);
+  shm_copy_out(shm, ring, tail + DIVIDI_SHM_RECORD_HEADER, data, record);
+  shm->to_serial_tail = tail + DIVIDI_SHM_RECORD_HEADER + record;
+  __atomic_store_n(&ring->tail, shm->to_serial_tail, __ATOMIC_RELEASE);
+  // Pairs with the fence in dividi_shm_wait_space
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(ring->producer_waiting) {
+    ring->producer_waiting = 0;
+    dividi_shm_futex(&ring->tail, FUTEX_WAKE, 1, -1);
+  }
+  *length = record;
+  return data;
+}
+
+/**
+ * Hand data to the client, never blocks, must hold
+ * the lock
+ *
+ * @return < 0 when the ring is full, the data is dropped
+ */
+int shm_send(struct s_shm *shm, char *data, int length)
+{
+  struct dividi_shm_ring *ring = &shm->header->to_client;
+  uint32_t head = shm->to_client_head;
+  uint32_t used;
+  uint32_t record;
+
+  while(length > 0) {
+    record = length;
+    if(record > (uint32_t) shm->size / 2 - DIVIDI_SHM_RECORD_HEADER) {
+      record = shm->size / 2 - DIVIDI_SHM_RECORD_HEADER;
+    }
+    // A tail ahead of the head is as full as it gets
+    used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(used > (uint32_t) shm->size || shm->size - used < record + DIVIDI_SHM_RECORD_HEADER) {
+      return -1;
+    }
+    shm_copy_in(shm, ring, head, (char *) &record, DIVIDI_SHM_RECORD_HEADER);
+    shm_copy_in(shm, ring, head + DIVIDI_SHM_RECORD_HEADER, data, record);
+    head += DIVIDI_SHM_RECORD_HEADER + record;
+    shm->to_client_head = head;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    // Pairs with the fence in dividi_shm_wait_data
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(ring->consumer_waiting) {
+      ring->consumer_waiting = 0;
+      dividi_shm_futex(&ring->head, FUTEX_WAKE, 1, -1);
+    }
+    data += record;
+    length -= record;
+  }
+  return 0;
+}
+#elif _WIN32
+void shm_create(struct s_shm *shm)
+{
+  fprintf(stderr, "shm is not supported on this platform\n");
+  exit(-1);
+}
+
+void shm_destroy(struct s_shm *shm)
+{
+}
+
+void shm_reset(struct s_shm *shm)
+{
+}
+
+int shm_attached(struct s_shm *shm)
+{
+  return 0;
+}
+
+int shm_detached(struct s_shm *shm)
+{
+  return 0;
+}
+
+int shm_client_pid(struct s_shm *shm)
+{
+  return 0;
+}
+
+void shm_wait(struct s_shm *shm, int timeout_ms)
+{
+  Sleep(timeout_ms);
+}
+
+char *shm_receive(struct s_shm *shm, int *length)
+{
+  return NULL;
+}
+
+int shm_send(struct s_shm *shm, char *data, int length)
+{
+  return -1;
+}
+#endif
@@ -0,0 +1,100 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+#include "thread.h"
+
+#define SHM_PATH_MAX                     108
+#define DEFAULT_SHM_MODE                 0600
+#define DEFAULT_SHM_SIZE                 65536
+
+struct s_conn;
+struct dividi_shm_header;
+
+/**
+ * The shared memory segment of a link, see dividi_shm.h
+ */
+struct s_shm {
+  // empty when the link has no segment
+  char path[SHM_PATH_MAX];
+  // permissions of the file, the clients allowed to attach
+  int mode;
+  // bytes of every ring
+  int size;
+  struct dividi_shm_header *header;
+  // the positions dividi moves, a client can overwrite the ones
+  // in the segment so they are never read back from it
+  uint32_t to_client_head;
+  uint32_t to_serial_tail;
+  // serializes the writers of the ring to the client
+  MUTEX lock;
+  // the attached client
+  struct s_conn *conn;
+};
+
+/**
+ * Create the file and map it, exits on failure
+ */
+void shm_create(struct s_shm *shm);
+
+/**
+ * Remove the file
+ */
+void shm_destroy(struct s_shm *shm);
+
+/**
+ * Empty the rings and wait for the next client,
+ * nobody may use the rings anymore
+ */
+void shm_reset(struct s_shm *shm);
+
+/**
+ * Check if a client is attached, a client that
+ * died is detached
+ */
+int shm_attached(struct s_shm *shm);
+
+/**
+ * Check if the client left, the segment has to be
+ * reset for the next one
+ */
+int shm_detached(struct s_shm *shm);
+
+/**
+ * The pid of the attached client
+ */
+int shm_client_pid(struct s_shm *shm);
+
+/**
+ * Sleep untill the client writes or attaches or
+ * detaches, or the timeout expires
+ */
+void shm_wait(struct s_shm *shm, int timeout_ms);
+
+/**
+ * Take the next record of the client, a client that
+ * corrupted the ring is detached
+ *
+ * @return the record, NULL when there is none
+ */
+char *shm_receive(struct s_shm *shm, int *length);
+
+/**
+ * Hand data to the client, never blocks, must hold
+ * the lock
+ *
+ * @return < 0 when the ring is full, the data is dropped
+ */
+int shm_send(struct s_shm *shm, char *data, int length);
+
+#endif
@@ -0,0 +1,262 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "spill.h"
+#include "dividi.h"
+
+#ifdef __linux__
+/**
+ * Check the settings and create the directory,
+ * exits on failure
+ */
+void spill_create(struct s_spill *spill, int id)
+{
+  if(spill->dir[0] == '\0') {
+    return;
+  }
+  spill->id = id;
+  if(spill->threshold <= 0) {
+    spill->threshold = DEFAULT_SPILL_THRESHOLD;
+  }
+  if(spill->segment_size <= 0) {
+    spill->segment_size = DEFAULT_SPILL_SEGMENT_SIZE;
+  }
+  if(spill->segments <= 0) {
+    spill->segments = DEFAULT_SPILL_SEGMENTS;
+  }
+  if(spill->segments > SPILL_SEGMENTS_MAX) {
+    fprintf(stderr, "spill_segments of %s exceeds %d\n", spill->dir, SPILL_SEGMENTS_MAX);
+    exit(-1);
+  }
+  if(mkdir(spill->dir, 0700) < 0 && errno != EEXIST) {
+    perror("spill mkdir failed");
+    exit(-1);
+  }
+}
+
+/**
+ * Map the segment file of a slot, the disk space is
+ * reserved up front so a full disk can't fault the mapping
+ */
+static char *spill_map(struct s_spill *spill, int slot)
+{
+  char path[SPILL_DIR_MAX + 32];
+  char *map;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/dividi-%d-%d.spill", spill->dir, spill->id, slot);
+  if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+    perror("spill open failed");
+    return NULL;
+  }
+  if((errno = posix_fallocate(fd, 0, spill->segment_size)) != 0) {
+    perror("spill fallocate failed");
+    close(fd);
+    unlink(path);
+    return NULL;
+  }
+  map = (char *) mmap(NULL, spill->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    perror("spill mmap failed");
+    unlink(path);
+    return NULL;
+  }
+  // Only needed for the clients that are behind
+  unlink(path);
+  madvise(map, spill->segment_size, MADV_SEQUENTIAL);
+  return map;
+}
+
+/**
+ * Find the slot holding a segment
+ *
+ * @return the slot, < 0 when the segment isn't in the log
+ */
+static int spill_slot(struct s_spill *spill, unsigned long long segment)
+{
+  int slot;
+
+  for(slot = 0; slot < spill->segments; slot++) {
+    if(spill->maps[slot] != NULL && spill->held[slot] == segment &&
+       segment * spill->segment_size < spill->head) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Check if a slot can take the next segment, its
+ * segment is before the one holding keep
+ */
+static int spill_free(struct s_spill *spill, int slot, unsigned long long keep)
+{
+  return spill->maps[slot] == NULL || spill->held[slot] < keep / spill->segment_size;
+}
+
+/**
+ * The oldest position still in the log
+ */
+unsigned long long spill_oldest(struct s_spill *spill)
+{
+  unsigned long long oldest = spill->head / spill->segment_size;
+  int slot;
+
+  for(slot = 0; slot < spill->segments; slot++) {
+    if(spill->maps[slot] != NULL && spill->held[slot] < oldest) {
+      oldest = spill->held[slot];
+    }
+  }
+  oldest *= spill->segment_size;
+  return (oldest < spill->head) ? oldest : spill->head;
+}
+
+/**
+ * The bytes that can be appended without recycling
+ * a segment a reader still needs
+ *
+ * @keep the lowest position the readers still need
+ */
+unsigned long long spill_room(struct s_spill *spill, unsigned long long keep)
+{
+  unsigned long long room = 0;
+  int slot;
+
+  // The rest of the segment of the head
+  if(spill->head % spill->segment_size != 0) {
+    room = spill->segment_size - spill->head % spill->segment_size;
+  }
+  for(slot = 0; slot < spill->segments; slot++) {
+    if(spill_free(spill, slot, keep)) {
+      room += spill->segment_size;
+    }
+  }
+  return room;
+}
+
+/**
+ * Take a slot for the segment of the head, a mapped
+ * slot is recycled before a new segment is created
+ *
+ * @return the slot, < 0 when there is none
+ */
+static int spill_take(struct s_spill *spill, unsigned long long keep)
+{
+  int slot;
+
+  for(slot = 0; slot < spill->segments; slot++) {
+    if(spill->maps[slot] != NULL && spill_free(spill, slot, keep)) {
+      return slot;
+    }
+  }
+  for(slot = 0; slot < spill->segments; slot++) {
+    if(spill->maps[slot] == NULL) {
+      return ((spill->maps[slot] = spill_map(spill, slot)) != NULL) ? slot : -1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Append data, only the segments before keep are recycled
+ *
+ * @keep the lowest position the readers still need
+ * @return < 0 when the log is full or a segment can't
+ *         be created, the data is lost
+ */
+int spill_append(struct s_spill *spill, char *data, int length, unsigned long long keep)
+{
+  int offset;
+  int part;
+
+  if(spill_room(spill, keep) < (unsigned long long) length) {
+    return -1;
+  }
+  while(length > 0) {
+    offset = spill->head % spill->segment_size;
+    if(offset == 0) {
+      if((spill->current = spill_take(spill, keep)) < 0) {
+        return -1;
+      }
+      spill->held[spill->current] = spill->head / spill->segment_size;
+    }
+    part = spill->segment_size - offset;
+    if(part > length) {
+      part = length;
+    }
+    memcpy(spill->maps[spill->current] + offset, data, part);
+    spill->head += part;
+    data += part;
+    length -= part;
+  }
+  return 0;
+}
+
+/**
+ * The data from a position, up to the end of the
+ * segment or the head
+ *
+ * @return the data in the log, NULL when the position
+ *         is the head or no longer in the log
+ */
+char *spill_read(struct s_spill *spill, unsigned long long position, int *length)
+{
+  int slot = spill_slot(spill, position / spill->segment_size);
+  int offset = position % spill->segment_size;
+
+  if(position >= spill->head || slot < 0) {
+    return NULL;
+  }
+  *length = spill->segment_size - offset;
+  if(position + *length > spill->head) {
+    *length = spill->head - position;
+  }
+  return spill->maps[slot] + offset;
+}
+#elif _WIN32
+void spill_create(struct s_spill *spill, int id)
+{
+  if(spill->dir[0] != '\0') {
+    fprintf(stderr, "spill is not supported on this platform\n");
+    exit(-1);
+  }
+}
+
+unsigned long long spill_oldest(struct s_spill *spill)
+{
+  return 0;
+}
+
+unsigned long long spill_room(struct s_spill *spill, unsigned long long keep)
+{
+  return 0;
+}
+
+int spill_append(struct s_spill *spill, char *data, int length, unsigned long long keep)
+{
+  return -1;
+}
+
+char *spill_read(struct s_spill *spill, unsigned long long position, int *length)
+{
+  return NULL;
+}
+#endif
@@ -0,0 +1,84 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#define SPILL_DIR_MAX                    256
+#define SPILL_SEGMENTS_MAX               256
+#define DEFAULT_SPILL_THRESHOLD          (256*1024)
+#define DEFAULT_SPILL_SEGMENT_SIZE       (4*1024*1024)
+#define DEFAULT_SPILL_SEGMENTS           16
+
+/**
+ * Append-only log of the serial output of a link on
+ * disk, for the clients that fell behind. The log is
+ * a set of mmap'd segment files, a segment is only
+ * recycled once every client read past it. Every byte
+ * is numbered by the amount of bytes before it.
+ */
+struct s_spill {
+  // empty when the link doesn't spill
+  char dir[SPILL_DIR_MAX];
+  // bytes queued in memory for a client before it spills
+  int threshold;
+  int segment_size;
+  int segments;
+  char *maps[SPILL_SEGMENTS_MAX];
+  // the segment number of the data in every mapped slot
+  unsigned long long held[SPILL_SEGMENTS_MAX];
+  // the slot of the head
+  int current;
+  // position of the next byte
+  unsigned long long head;
+  // clients reading from the log
+  int readers;
+  // names the files
+  int id;
+};
+
+/**
+ * Check the settings and create the directory,
+ * exits on failure
+ */
+void spill_create(struct s_spill *spill, int id);
+
+/**
+ * The oldest position still in the log
+ */
+unsigned long long spill_oldest(struct s_spill *spill);
+
+/**
+ * The bytes that can be appended without recycling
+ * a segment a reader still needs
+ *
+ * @keep the lowest position the readers still need
+ */
+unsigned long long spill_room(struct s_spill *spill, unsigned long long keep);
+
+/**
+ * Append data, only the segments before keep are recycled
+ *
+ * @keep the lowest position the readers still need
+ * @return < 0 when the log is full or a segment can't
+ *         be created, the data is lost
+ */
+int spill_append(struct s_spill *spill, char *data, int length, unsigned long long keep);
+
+/**
+ * The data from a position, up to the end of the
+ * segment or the head
+ *
+ * @return the data in the log, NULL when the position
+ *         is the head or no longer in the log
+ */
+char *spill_read(struct s_spill *spill, unsigned long long position, int *length);
+
+#endif
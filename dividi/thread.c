@@ -0,0 +1,245 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifdef __linux__
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+  #endif
+  #include <sched.h>
+  #include <errno.h>
+  #include <time.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include "thread.h"
+#include "queue.h"
+
+/**
+ * Initialise a mutex, exits on failure
+ */
+void mutex_create(MUTEX *mutex)
+{
+#ifdef __linux__
+  if(pthread_mutex_init(mutex, NULL) != 0) {
+    perror("pthread_mutex_init failed");
+    exit(-1);
+  }
+#elif _WIN32
+  *mutex = CreateMutex(NULL, FALSE, NULL);
+  if(*mutex == NULL) {
+    fprintf(stderr, "%d", WSAGetLastError());
+    exit(-1);
+  }
+#endif
+}
+
+/**
+ * Lock a mutex, exits on failure
+ */
+void mutex_lock(MUTEX *mutex)
+{
+#ifdef __linux__
+  if(pthread_mutex_lock(mutex) != 0) {
+    perror("pthread_mutex_lock failed");
+    exit(-1);
+  }
+#elif _WIN32
+  if(WaitForSingleObject(*mutex, INFINITE) == WAIT_FAILED) {
+    fprintf(stderr, "%d", WSAGetLastError());
+    exit(-1);
+  }
+#endif
+}
+
+/**
+ * Unlock a mutex, exits on failure
+ */
+void mutex_unlock(MUTEX *mutex)
+{
+#ifdef __linux__
+  if(pthread_mutex_unlock(mutex) != 0) {
+    perror("pthread_mutex_unlock failed");
+    exit(-1);
+  }
+#elif _WIN32
+  if(!ReleaseMutex(*mutex)) {
+    fprintf(stderr, "%d", WSAGetLastError());
+    exit(-1);
+  }
+#endif
+}
+
+/**
+ * Release the resources of a mutex
+ */
+void mutex_destroy(MUTEX *mutex)
+{
+#ifdef __linux__
+  pthread_mutex_destroy(mutex);
+#elif _WIN32
+  CloseHandle(*mutex);
+#endif
+}
+
+/**
+ * Initialise a semaphore with count 0, exits on failure
+ */
+void semaphore_create(SEMAPHORE *sem)
+{
+#ifdef __linux__
+  if(sem_init(sem, 0, 0) < 0) {
+    perror("sem_init failed");
+    exit(-1);
+  }
+#elif _WIN32
+  *sem = CreateSemaphore(NULL, 0, MAX_SEM_COUNT, NULL);
+  if(*sem == NULL) {
+    fprintf(stderr, "%d", WSAGetLastError());
+    exit(-1);
+  }
+#endif
+}
+
+/**
+ * Block untill the semaphore is incremented by one
+ */
+void semaphore_wait(SEMAPHORE *sem)
+{
+#ifdef __linux__
+  while(sem_wait(sem) < 0 && errno == EINTR);
+#elif _WIN32
+  WaitForSingleObject(*sem, INFINITE);
+#endif
+}
+
+/**
+ * Block untill the semaphore is incremented by one
+ * or timeout_ms has passed
+ *
+ * @return 0 when the semaphore was taken
+ *         < 0 on timeout
+ */
+int semaphore_timedwait(SEMAPHORE *sem, int timeout_ms)
+{
+#ifdef __linux__
+  struct timespec ts;
+  int ret;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout_ms / 1000;
+  ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if(ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  while((ret = sem_timedwait(sem, &ts)) < 0 && errno == EINTR);
+  return ret;
+#elif _WIN32
+  return (WaitForSingleObject(*sem, timeout_ms) == WAIT_OBJECT_0) ? 0 : -1;
+#endif
+}
+
+/**
+ * Increment the semaphore
+ *
+ * @inc the amount of the times the sem needs
+ *      to be incremented
+ */
+void semaphore_post(SEMAPHORE *sem, int inc)
+{
+#ifdef __linux__
+  int i;
+  for(i = 0; i < inc; i++) {
+    if(sem_post(sem) < 0) {
+      perror("sem_post failed");
+      exit(-1);
+    }
+  }
+#elif _WIN32
+  if(inc && !ReleaseSemaphore(*sem, inc, NULL)) {
+    fprintf(stderr, "%d", WSAGetLastError());
+    exit(-1);
+  }
+#endif
+}
+
+/**
+ * Release the resources of a semaphore
+ */
+void semaphore_destroy(SEMAPHORE *sem)
+{
+#ifdef __linux__
+  sem_destroy(sem);
+#elif _WIN32
+  CloseHandle(*sem);
+#endif
+}
+
+/**
+ * Check if a thread can be pinned to a cpu
+ *
+ * @return 1 when the cpu number fits the affinity mask
+ */
+int thread_cpu_valid(int cpu)
+{
+#ifdef __linux__
+  return cpu >= 0 && cpu < CPU_SETSIZE;
+#elif _WIN32
+  return cpu >= 0 && cpu < (int) (sizeof(DWORD_PTR) * 8);
+#endif
+}
+
+/**
+ * Start a detached thread
+ *
+ * @func the thread function
+ * @arg the argument passed to the thread function
+ * @cpu the cpu the thread is pinned to, NO_CPU_AFFINITY to let
+ *      the scheduler decide
+ * @return 0 on succes
+ *       < 0 on error
+ */
+int thread_start(THREAD_FUNC func, void *arg, int cpu)
+{
+#ifdef __linux__
+  pthread_t thread;
+  pthread_attr_t attr;
+  cpu_set_t cpus;
+  int ret = 0;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  // Pinned from the start, the thread never runs on another cpu
+  if(cpu != NO_CPU_AFFINITY) {
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if(pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus) != 0) {
+      fprintf(stderr, "Can't pin thread to cpu %d\n", cpu);
+    }
+  }
+  if(pthread_create(&thread, &attr, func, arg) != 0) {
+    perror("pthread_create failed");
+    ret = -1;
+  }
+  pthread_attr_destroy(&attr);
+  return ret;
+#elif _WIN32
+  HANDLE thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+  if(thread == NULL) {
+    fprintf(stderr, "%d", WSAGetLastError());
+    return -1;
+  }
+  if(cpu != NO_CPU_AFFINITY && !SetThreadAffinityMask(thread, ((DWORD_PTR) 1) << cpu)) {
+    fprintf(stderr, "Can't pin thread to cpu %d\n", cpu);
+  }
+  CloseHandle(thread);
+  return 0;
+#endif
+}
@@ -0,0 +1,100 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#ifdef __linux__
+  #include <pthread.h>
+  #include <semaphore.h>
+  typedef pthread_mutex_t MUTEX;
+  typedef sem_t SEMAPHORE;
+  typedef void *(*THREAD_FUNC)(void *);
+#elif defined _WIN32
+  #include <windows.h>
+  typedef HANDLE MUTEX;
+  typedef HANDLE SEMAPHORE;
+  typedef LPTHREAD_START_ROUTINE THREAD_FUNC;
+#endif
+
+#define NO_CPU_AFFINITY -1
+
+/**
+ * Initialise a mutex, exits on failure
+ */
+void mutex_create(MUTEX *mutex);
+
+/**
+ * Lock a mutex, exits on failure
+ */
+void mutex_lock(MUTEX *mutex);
+
+/**
+ * Unlock a mutex, exits on failure
+ */
+void mutex_unlock(MUTEX *mutex);
+
+/**
+ * Release the resources of a mutex
+ */
+void mutex_destroy(MUTEX *mutex);
+
+/**
+ * Initialise a semaphore with count 0, exits on failure
+ */
+void semaphore_create(SEMAPHORE *sem);
+
+/**
+ * Block untill the semaphore is incremented by one
+ */
+void semaphore_wait(SEMAPHORE *sem);
+
+/**
+ * Block untill the semaphore is incremented by one
+ * or timeout_ms has passed
+ *
+ * @return 0 when the semaphore was taken
+ *         < 0 on timeout
+ */
+int semaphore_timedwait(SEMAPHORE *sem, int timeout_ms);
+
+/**
+ * Increment the semaphore
+ *
+ * @inc the amount of the times the sem needs
+ *      to be incremented
+ */
+void semaphore_post(SEMAPHORE *sem, int inc);
+
+/**
+ * Release the resources of a semaphore
+ */
+void semaphore_destroy(SEMAPHORE *sem);
+
+/**
+ * Check if a thread can be pinned to a cpu
+ *
+ * @return 1 when the cpu number fits the affinity mask
+ */
+int thread_cpu_valid(int cpu);
+
+/**
+ * Start a detached thread
+ *
+ * @func the thread function
+ * @arg the argument passed to the thread function
+ * @cpu the cpu the thread is pinned to, NO_CPU_AFFINITY to let
+ *      the scheduler decide
+ * @return 0 on succes
+ *       < 0 on error
+ */
+int thread_start(THREAD_FUNC func, void *arg, int cpu);
+
+#endif
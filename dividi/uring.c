@@ -0,0 +1,199 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "uring.h"
+#ifdef HAVE_URING
+  #include <unistd.h>
+  #include <errno.h>
+  #include <sys/mman.h>
+#endif
+#include "dividi.h"
+
+#ifdef HAVE_URING
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Create an io_uring with room for entries submissions
+ *
+ * @return 0 on succes
+ *       < 0 on error
+ */
+int uring_create(struct s_uring *ring, unsigned entries)
+{
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(struct s_uring));
+  memset(&p, 0, sizeof(p));
+  ring->fd = io_uring_setup(entries, &p);
+  if(ring->fd < 0) {
+    return -1;
+  }
+  ring->entries = p.sq_entries;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  ring->sq_head = (unsigned *) ((char *) ring->sq_ring + p.sq_off.head);
+  ring->sq_tail = (unsigned *) ((char *) ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) ((char *) ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) ((char *) ring->sq_ring + p.sq_off.array);
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if(ring->cq_ring == MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+  }
+  ring->cq_head = (unsigned *) ((char *) ring->cq_ring + p.cq_off.head);
+  ring->cq_tail = (unsigned *) ((char *) ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) ((char *) ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p.cq_off.cqes);
+  return 0;
+}
+
+/**
+ * Tear down an io_uring
+ */
+void uring_destroy(struct s_uring *ring)
+{
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+/**
+ * Register fixed buffers, used by IORING_OP_READ_FIXED
+ *
+ * @return 0 on succes
+ *       < 0 on error
+ */
+int uring_register_buffers(struct s_uring *ring, struct iovec *iovecs, unsigned nr)
+{
+  return io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, nr);
+}
+
+/**
+ * Get a zeroed submission entry
+ *
+ * @return the entry, NULL when the submission ring is full
+ */
+struct io_uring_sqe *uring_get_sqe(struct s_uring *ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_queued;
+  unsigned index;
+
+  if(tail - head >= ring->entries) {
+    return NULL;
+  }
+  index = tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->sq_queued++;
+  memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+  return &ring->sqes[index];
+}
+
+/**
+ * Submit the queued entries and wait for wait_nr completions
+ * in a single system call
+ *
+ * @return the amount of submitted entries
+ *       < 0 on error
+ */
+int uring_submit_and_wait(struct s_uring *ring, unsigned wait_nr)
+{
+  unsigned submit = ring->sq_queued;
+  int ret;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+  ring->sq_queued = 0;
+  do {
+    ret = io_uring_enter(ring->fd, submit, wait_nr,
+                         wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  } while(ret < 0 && errno == EINTR);
+  return ret;
+}
+
+/**
+ * Get the next completion, if any
+ *
+ * @return the completion, NULL when there are none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct s_uring *ring)
+{
+  unsigned head = *ring->cq_head;
+
+  if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Mark the completion returned by uring_peek_cqe as consumed
+ */
+void uring_cqe_seen(struct s_uring *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+/**
+ * Check if the kernel supports io_uring
+ *
+ * @return 1 when io_uring can be used
+ */
+int uring_available()
+{
+#ifdef HAVE_URING
+  struct s_uring ring;
+
+  if(uring_create(&ring, 2) < 0) {
+    dbg("io_uring unavailable: %s\n", strerror(errno));
+    return 0;
+  }
+  uring_destroy(&ring);
+  return 1;
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,107 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __URING_H__
+#define __URING_H__
+
+#if defined __linux__
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+  #if defined __NR_io_uring_setup
+    #define HAVE_URING
+    #include <linux/io_uring.h>
+  #endif
+#endif
+
+#ifdef HAVE_URING
+/**
+ * A minimal io_uring instance, only to be used
+ * by a single thread
+ */
+struct s_uring {
+  int fd;
+  unsigned entries;
+  // submission ring
+  void *sq_ring;
+  size_t sq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned sq_queued;
+  // completion ring
+  void *cq_ring;
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+/**
+ * Create an io_uring with room for entries submissions
+ *
+ * @return 0 on succes
+ *       < 0 on error
+ */
+int uring_create(struct s_uring *ring, unsigned entries);
+
+/**
+ * Tear down an io_uring
+ */
+void uring_destroy(struct s_uring *ring);
+
+/**
+ * Register fixed buffers, used by IORING_OP_READ_FIXED
+ *
+ * @return 0 on succes
+ *       < 0 on error
+ */
+int uring_register_buffers(struct s_uring *ring, struct iovec *iovecs, unsigned nr);
+
+/**
+ * Get a zeroed submission entry
+ *
+ * @return the entry, NULL when the submission ring is full
+ */
+struct io_uring_sqe *uring_get_sqe(struct s_uring *ring);
+
+/**
+ * Submit the queued entries and wait for wait_nr completions
+ * in a single system call
+ *
+ * @return the amount of submitted entries
+ *       < 0 on error
+ */
+int uring_submit_and_wait(struct s_uring *ring, unsigned wait_nr);
+
+/**
+ * Get the next completion, if any
+ *
+ * @return the completion, NULL when there are none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct s_uring *ring);
+
+/**
+ * Mark the completion returned by uring_peek_cqe as consumed
+ */
+void uring_cqe_seen(struct s_uring *ring);
+#endif
+
+/**
+ * Check if the kernel supports io_uring
+ *
+ * @return 1 when io_uring can be used
+ */
+int uring_available();
+
+#endif
@@ -12,9 +12,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 #include "util.h"
 #ifdef __linux__
   #include <linux/limits.h>
+#elif defined _WIN32
+  #include <windows.h>
 #endif
 
 /**
@@ -82,3 +85,73 @@ void copy_file_path(char *dst, char *src)
   memcpy(dst, src, strlen(src)+1);
 }
 
+/*
+ * Copy a string resolving the \r, \n, \t, \\ and \xHH escapes
+ *
+ * @return the length of the result
+ *         < 0 when it doesn't fit in max bytes or an escape is invalid
+ */
+int strunescape(char *dst, const char *src, int max)
+{
+  int length = 0;
+  unsigned int value;
+
+  while(*src != '\0') {
+    if(length >= max) {
+      return -1;
+    }
+    if(*src != '\\') {
+      dst[length++] = *src++;
+      continue;
+    }
+    src++;
+    switch(*src) {
+    case 'r': dst[length++] = '\r'; break;
+    case 'n': dst[length++] = '\n'; break;
+    case 't': dst[length++] = '\t'; break;
+    case '\\': dst[length++] = '\\'; break;
+    case 'x':
+      if(sscanf(src + 1, "%2x", &value) != 1) {
+        return -1;
+      }
+      dst[length++] = value;
+      src += (isxdigit((unsigned char) src[2])) ? 2 : 1;
+      break;
+    default:
+      return -1;
+    }
+    src++;
+  }
+  return length;
+}
+
+/*
+ * Monotonic time in milliseconds
+ */
+long long time_ms()
+{
+#ifdef __linux__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+#elif _WIN32
+  return GetTickCount64();
+#endif
+}
+
+/*
+ * Monotonic time in microseconds
+ */
+long long time_us()
+{
+#ifdef __linux__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#elif _WIN32
+  LARGE_INTEGER count, frequency;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&frequency);
+  return count.QuadPart * 1000000LL / frequency.QuadPart;
+#endif
+}
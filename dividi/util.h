@@ -25,4 +25,22 @@ size_t strtrim(char *str);
  */
 void copy_file_path(char *dst, char *src);
 
+/*
+ * Copy a string resolving the \r, \n, \t, \\ and \xHH escapes
+ *
+ * @return the length of the result
+ *         < 0 when it doesn't fit in max bytes or an escape is invalid
+ */
+int strunescape(char *dst, const char *src, int max);
+
+/*
+ * Monotonic time in milliseconds
+ */
+long long time_ms();
+
+/*
+ * Monotonic time in microseconds
+ */
+long long time_us();
+
 #endif
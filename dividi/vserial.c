@@ -0,0 +1,271 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifdef __linux__
+  #ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+  #endif
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "vserial.h"
+#include "thread.h"
+#ifdef __linux__
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#endif
+
+#define VSERIAL_BUFFER_SIZE              16384
+// ms of line time the generator sends at once
+#define VSERIAL_SLICE_MS                 10
+// ms to wait for dividi to reopen the slave
+#define VSERIAL_IDLE_MS                  10
+// us the generator may fall behind before it skips ahead
+#define VSERIAL_MAX_LAG                  100000
+
+/**
+ * The name of a device type, for reports
+ */
+const char *vserial_name(enum e_vserial_type type)
+{
+  switch(type) {
+    case VSERIAL_LOOPBACK:  return "loopback";
+    case VSERIAL_GENERATOR: return "generator";
+    case VSERIAL_SINK:      return "sink";
+    case VSERIAL_RELAY:     return "relay";
+    default:                return "none";
+  }
+}
+
+#ifdef __linux__
+/**
+ * Fill a generator frame, an 8 digit hexadecimal
+ * sequence number, a pattern shifting with the
+ * sequence number and a newline
+ */
+static void vserial_frame(char *frame, int size, unsigned int sequence)
+{
+  char number[VSERIAL_FRAME_MIN];
+  int i;
+
+  snprintf(number, sizeof(number), "%08x ", sequence);
+  memcpy(frame, number, VSERIAL_FRAME_MIN - 1);
+  for(i = VSERIAL_FRAME_MIN - 1; i < size - 1; i++) {
+    frame[i] = 'a' + (sequence + i) % 26;
+  }
+  frame[size - 1] = '\n';
+}
+
+/**
+ * The current time in us
+ */
+static long long vserial_now()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Wait untill the emulated wire carried the bytes
+ */
+static void vserial_pace(struct s_vserial *vserial, int length)
+{
+  long long now = vserial_now();
+
+  if(vserial->rate <= 0) {
+    return;
+  }
+  if(vserial->wire_free < now) {
+    vserial->wire_free = now;
+  }
+  vserial->wire_free += (long long) length * 1000000 / vserial->rate;
+  if(vserial->wire_free > now) {
+    usleep(vserial->wire_free - now);
+  }
+}
+
+/**
+ * Send data to dividi
+ */
+static void vserial_send(struct s_vserial *vserial, char *data, int length)
+{
+  int written;
+
+  while(length > 0) {
+    if((written = write(vserial->master, data, length)) < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      // EIO while dividi has the slave closed
+      return;
+    }
+    vserial->bytes_out += written;
+    data += written;
+    length -= written;
+  }
+}
+
+/**
+ * Handle the data dividi wrote to the device
+ */
+static void vserial_received(struct s_vserial *vserial, char *data, int length)
+{
+  vserial->bytes_in += length;
+  if(vserial->type == VSERIAL_GENERATOR) {
+    return;
+  }
+  vserial_pace(vserial, length);
+  if(vserial->type == VSERIAL_LOOPBACK) {
+    vserial_send(vserial, data, length);
+  }
+}
+
+/**
+ * Send the frames that are due, a slice of line time at once
+ * so slow rates don't cost a wakeup per frame
+ */
+static void vserial_generate(struct s_vserial *vserial, char *buffer)
+{
+  long long now = vserial_now();
+  int frames;
+  int i;
+
+  if(vserial->rate > 0) {
+    if(vserial->next_frame > now) {
+      return;
+    }
+    frames = 1 + (long long) vserial->rate * VSERIAL_SLICE_MS / 1000 / vserial->frame_size;
+  } else {
+    frames = VSERIAL_BUFFER_SIZE / vserial->frame_size;
+  }
+  if(frames > VSERIAL_BUFFER_SIZE / vserial->frame_size) {
+    frames = VSERIAL_BUFFER_SIZE / vserial->frame_size;
+  }
+  for(i = 0; i < frames; i++) {
+    vserial_frame(buffer + i * vserial->frame_size, vserial->frame_size, vserial->sequence++);
+  }
+  vserial_send(vserial, buffer, frames * vserial->frame_size);
+  if(vserial->rate > 0) {
+    // Don't burst to catch up after dividi stalled the device
+    if(vserial->next_frame < now - VSERIAL_MAX_LAG) {
+      vserial->next_frame = now;
+    }
+    vserial->next_frame += (long long) frames * vserial->frame_size * 1000000 / vserial->rate;
+  }
+}
+
+/**
+ * Plays the device on the master side of the pty
+ */
+static void *vserial_handler(struct s_vserial *vserial)
+{
+  char *input = (char *) malloc(VSERIAL_BUFFER_SIZE);
+  char *output = (char *) malloc(VSERIAL_BUFFER_SIZE);
+  struct pollfd pfd;
+  long long now;
+  int timeout;
+  int length;
+
+  pfd.fd = vserial->master;
+  pfd.events = POLLIN;
+  while(1) {
+    timeout = -1;
+    if(vserial->type == VSERIAL_GENERATOR) {
+      now = vserial_now();
+      timeout = vserial->next_frame > now ? (vserial->next_frame - now + 999) / 1000 : 0;
+    }
+    if(poll(&pfd, 1, timeout) < 0) {
+      continue;
+    }
+    if(pfd.revents) {
+      if((length = read(vserial->master, input, VSERIAL_BUFFER_SIZE)) > 0) {
+        vserial_received(vserial, input, length);
+      } else if(length < 0 && errno != EINTR && errno != EAGAIN) {
+        usleep(VSERIAL_IDLE_MS * 1000);
+      }
+    }
+    if(vserial->type == VSERIAL_GENERATOR) {
+      vserial_generate(vserial, output);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Create the pty pair of a device, the slave is
+ * stored as the device of the serial port
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int vserial_open(struct s_vserial *vserial, struct s_serial *serial)
+{
+  char *slave;
+
+  if(vserial->frame_size <= 0) {
+    vserial->frame_size = DEFAULT_VSERIAL_FRAME_SIZE;
+  }
+  if(vserial->frame_size < VSERIAL_FRAME_MIN || vserial->frame_size > VSERIAL_FRAME_MAX) {
+    fprintf(stderr, "serial %s: frame_size must be between %d and %d\n",
+            serial->str_serial_port, VSERIAL_FRAME_MIN, VSERIAL_FRAME_MAX);
+    return -1;
+  }
+  if((vserial->master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) {
+    perror("posix_openpt failed");
+    return -1;
+  }
+  if(grantpt(vserial->master) < 0 || unlockpt(vserial->master) < 0 ||
+     (slave = ptsname(vserial->master)) == NULL || strlen(slave) >= SERIAL_NAME_MAX) {
+    perror("pty setup failed");
+    close(vserial->master);
+    return -1;
+  }
+  strcpy(serial->device, slave);
+  printf("serial %s: virtual %s device on %s\n",
+         serial->str_serial_port, vserial_name(vserial->type), slave);
+  return 0;
+}
+
+/**
+ * Start playing the device, the serial port has
+ * to be opened first
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int vserial_start(struct s_vserial *vserial, struct s_serial *serial)
+{
+  // The tunnel plays a relayed device
+  if(vserial->type == VSERIAL_RELAY) {
+    return 0;
+  }
+  // Without a baudrate the device runs as fast as dividi can keep up
+  vserial->rate = serial_line_rate(serial);
+  vserial->next_frame = vserial_now();
+  return thread_start((THREAD_FUNC) vserial_handler, vserial, NO_CPU_AFFINITY);
+}
+#elif _WIN32
+int vserial_open(struct s_vserial *vserial, struct s_serial *serial)
+{
+  fprintf(stderr, "virtual devices are not supported on this platform\n");
+  return -1;
+}
+
+int vserial_start(struct s_vserial *vserial, struct s_serial *serial)
+{
+  return -1;
+}
+#endif
@@ -0,0 +1,84 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+#ifndef __VSERIAL_H__
+#define __VSERIAL_H__
+
+#include "serial.h"
+
+#define DEFAULT_VSERIAL_FRAME_SIZE       64
+// room for the sequence number and the newline
+#define VSERIAL_FRAME_MIN                10
+#define VSERIAL_FRAME_MAX                4096
+
+/**
+ * The devices dividi can emulate
+ */
+enum e_vserial_type {
+  // a real serial port
+  VSERIAL_NONE,
+  // sends back everything it receives
+  VSERIAL_LOOPBACK,
+  // sends numbered frames and discards what it receives
+  VSERIAL_GENERATOR,
+  // counts and discards what it receives
+  VSERIAL_SINK,
+  // a link of an edge dividi, played by the relay tunnel
+  VSERIAL_RELAY
+};
+
+/**
+ * A device behind a pty pair, dividi opens the slave
+ * side like any serial port and a thread plays the
+ * device on the master side at the line rate of the
+ * port
+ */
+struct s_vserial {
+  enum e_vserial_type type;
+  // bytes per frame of the generator
+  int frame_size;
+  int master;
+  // bytes per second, 0 runs unpaced
+  int rate;
+  // us, when the emulated wire is idle again
+  long long wire_free;
+  // us, when the generator sends the next frame
+  long long next_frame;
+  unsigned int sequence;
+  // bytes the device received
+  unsigned long long bytes_in;
+  // bytes the device sent
+  unsigned long long bytes_out;
+};
+
+/**
+ * The name of a device type, for reports
+ */
+const char *vserial_name(enum e_vserial_type type);
+
+/**
+ * Create the pty pair of a device, the slave is
+ * stored as the device of the serial port
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int vserial_open(struct s_vserial *vserial, struct s_serial *serial);
+
+/**
+ * Start playing the device, the serial port has
+ * to be opened first
+ *
+ * @return   0 on succes
+ *         < 0 on error
+ */
+int vserial_start(struct s_vserial *vserial, struct s_serial *serial);
+
+#endif
@@ -1,5 +1,22 @@
+#include "thread.c"
 #include "util.c"
 #include "conf.c"
+#include "queue.c"
+#include "uring.c"
+#include "net.c"
+#include "fair.c"
+#include "modbus.c"
+#include "cache.c"
+#include "shm.c"
+#include "history.c"
+#include "spill.c"
+#include "capture.c"
+#include "vserial.c"
+#include "compress.c"
+#include "pool.c"
+#include "relay.c"
+#include "aggregate.c"
+#include "metrics.c"
 #include "dividi.c"
 
 #include <assert.h>
@@ -15,14 +32,14 @@ ssize_t send(int sockfd, const void *buf, size_t len, int flags)
   return 0;
 }
 
-int serial_write(HANDLE serial_port, char *data)
+int serial_write(HANDLE serial_port, char *data, int length)
 {
   int i;
-  for(i=0; i<strlen(data)-2; i++) {
+  for(i=0; i<length-2; i++) {
     assert(data[i]=='a');
   }
   serial_write_calls++;
-  return 0;
+  return length;
 }
 char *serial_read(HANDLE serial_port, int *total_bytes_read)
 {
@@ -31,7 +48,7 @@ char *serial_read(HANDLE serial_port, int *total_bytes_read)
   else
     *total_bytes_read = 10;
   serial_read_calls++;
-  return NULL;
+  return (char *) calloc(SERIAL_DATA_CHUNK_SIZE, 1);
 }
 void serial_close(HANDLE serial_port)
 {
@@ -42,21 +59,1160 @@ HANDLE serial_open(struct s_serial *serial)
 {
   return 0;
 }
+void serial_report(struct s_serial *serial)
+{
+
+}
+int serial_line_rate(struct s_serial *serial)
+{
+  return 0;
+}
+int serial_output_pending(HANDLE serial_port)
+{
+  return -1;
+}
+int serial_write_budget(struct s_serial *serial, int *wait_ms)
+{
+  return -1;
+}
+int serial_transmit_done(HANDLE serial_port)
+{
+  return 1;
+}
+
+/**
+ * A client flooding the port may not starve
+ * the others
+ */
+static void fair_test(struct s_link *link)
+{
+  struct s_worker worker;
+  struct s_conn flood, interactive;
+  struct s_entry *entry;
+  int i;
+
+  memset(&worker, 0, sizeof(struct s_worker));
+  memset(&flood, 0, sizeof(struct s_conn));
+  memset(&interactive, 0, sizeof(struct s_conn));
+  queue_create(&worker.tcp2serial_queue);
+  worker.running = 1;
+  flood.link = interactive.link = link;
+  flood.running = interactive.running = 1;
+  sched_init_conn(&flood);
+  sched_init_conn(&interactive);
+  for(i = 0; i < NBR_OF_MESSAGES; i++) {
+    entry = (struct s_entry *) malloc(sizeof(struct s_entry));
+    entry->conn = &flood;
+    entry->port = link;
+    entry->message = strdup("flood");
+    entry->length = strlen(entry->message);
+    queue_add(&worker.tcp2serial_queue, entry);
+  }
+  entry = (struct s_entry *) malloc(sizeof(struct s_entry));
+  entry->conn = &interactive;
+  entry->port = link;
+  entry->message = strdup("key");
+  entry->length = strlen(entry->message);
+  queue_add(&worker.tcp2serial_queue, entry);
+  // The interactive client is served within the first round
+  for(i = 0; i < NBR_OF_MESSAGES + 1; i++) {
+    entry = sched_next(&worker, 0);
+    assert(entry != NULL);
+    if(entry->conn == &interactive) {
+      break;
+    }
+    free(entry->message);
+    free(entry);
+  }
+  assert(i < SCHED_QUANTUM / strlen("flood") + 1);
+  assert(interactive.sched.serial_bytes == strlen("key"));
+}
+
+/**
+ * On RS-485 a written entry keeps the port
+ * busy untill the turnaround passed
+ */
+static void rs485_test(struct s_link *link)
+{
+  struct s_conn conn;
+  struct s_entry *entry;
+  int wait_ms = -1;
+
+  memset(&conn, 0, sizeof(struct s_conn));
+  conn.link = link;
+  conn.references = 2;
+  link->serial.mode = SERIAL_MODE_RS485;
+  link->serial.rs485_turnaround = 50;
+  entry = (struct s_entry *) malloc(sizeof(struct s_entry));
+  entry->conn = &conn;
+  entry->message = strdup("request");
+  entry->length = strlen(entry->message);
+  conn.serial_backlog = entry->length;
+  link->pending = entry;
+  link->pending_offset = 0;
+  link->pending_length = strlen(entry->message);
+  port_written(link, link->pending_length);
+  assert(link->pending == entry);
+  assert(port_slice(link, &wait_ms) == 0);
+  assert(link->pending == entry && wait_ms > 0);
+  usleep((wait_ms + 5) * 1000);
+  wait_ms = -1;
+  port_slice(link, &wait_ms);
+  assert(link->pending == NULL);
+  assert(conn.references == 1);
+}
+
+static volatile int affinity_cpus = 0;
+
+static void *affinity_test_thread(void *arg)
+{
+  cpu_set_t cpus;
+
+  assert(sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == 0);
+  affinity_cpus = CPU_ISSET(0, &cpus) ? CPU_COUNT(&cpus) : -1;
+  return NULL;
+}
+
+/**
+ * A pinned thread starts on its cpu
+ */
+static void affinity_test()
+{
+  int i;
+
+  assert(thread_start((THREAD_FUNC) affinity_test_thread, NULL, 0) == 0);
+  for(i = 0; i < 1000 && affinity_cpus == 0; i++) {
+    usleep(1000);
+  }
+  assert(affinity_cpus == 1);
+}
+
+static volatile int backpressure_released = 0;
+
+static void *backpressure_test_reader(void *_conn)
+{
+  serial_backlog_wait((struct s_conn *) _conn);
+  backpressure_released = 1;
+  return NULL;
+}
+
+/**
+ * A client isn't read while its serial backlog is full
+ * and the serial settings are parsed by name
+ */
+static void backpressure_test()
+{
+  struct s_link link;
+  struct s_worker worker;
+  struct s_conn conn;
+  struct s_entry *entry;
+  int length = SERIAL_BACKLOG_MAX / 2 + 1;
+  int i;
+
+  memset(&link, 0, sizeof(struct s_link));
+  memset(&worker, 0, sizeof(struct s_worker));
+  memset(&conn, 0, sizeof(struct s_conn));
+  mutex_create(&link.conns_lock);
+  queue_create(&worker.tcp2serial_queue);
+  link.port = &link;
+  link.worker = &worker;
+  conn.link = &link;
+  conn.running = 1;
+  conn.references = 1;
+  semaphore_create(&conn.backlog_sem);
+  tcp2serial_queue_add(&conn, (char *) calloc(length, 1), length, 0);
+  tcp2serial_queue_add(&conn, (char *) calloc(length, 1), length, 0);
+  assert(conn.serial_backlog > SERIAL_BACKLOG_MAX && conn.references == 3);
+  assert(thread_start((THREAD_FUNC) backpressure_test_reader, &conn, NO_CPU_AFFINITY) == 0);
+  // Longer than a poll of the reader
+  usleep((WORKER_POLL_TIMEOUT + 50) * 1000);
+  assert(!backpressure_released);
+  // Dropping below the limit wakes the reader before its next poll
+  entry = queue_get_timeout(&worker.tcp2serial_queue, 0);
+  release_entry(entry);
+  for(i = 0; i < WORKER_POLL_TIMEOUT / 2 && !backpressure_released; i++) {
+    usleep(1000);
+  }
+  assert(backpressure_released);
+  release_entry(queue_get_timeout(&worker.tcp2serial_queue, 0));
+  assert(conn.serial_backlog == 0 && conn.references == 1);
+  semaphore_destroy(&conn.backlog_sem);
+  queue_destroy(&worker.tcp2serial_queue);
+
+  active_link = &link;
+  assert(conf_parse_link_settings("parity", "even") == 0);
+  assert(link.serial.parity == PARITY_EVEN);
+  assert(conf_parse_link_settings("parity", "odd") == 0);
+  assert(link.serial.parity == PARITY_ODD);
+  assert(conf_parse_link_settings("parity", "mark") < 0);
+  assert(link.serial.parity == PARITY_ODD);
+  assert(conf_parse_link_settings("flow", "rts_cts") == 0);
+  assert(link.serial.flow == FLOW_RTS_CTS);
+  assert(conf_parse_link_settings("flow", "dsr_dtr") == 0);
+  assert(link.serial.flow == FLOW_DSR_DTR);
+  assert(conf_parse_link_settings("flow", "xon_xoff") == 0);
+  assert(link.serial.flow == FLOW_XON_XOFF);
+  assert(conf_parse_link_settings("flow", "hardware") < 0);
+  assert(link.serial.flow == FLOW_XON_XOFF);
+  active_link = NULL;
+}
+
+/**
+ * Modbus RTU framing and the Modbus TCP conversion
+ */
+static void modbus_test()
+{
+  unsigned char request[] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD};
+  unsigned char tcp[] = {0x12, 0x34, 0x00, 0x00, 0x00, 0x06,
+                         0x01, 0x03, 0x00, 0x00, 0x00, 0x0A};
+  unsigned char reply[] = {0x01, 0x83, 0x02, 0x00, 0x00};
+  unsigned char rtu[MODBUS_RTU_MAX_ADU];
+  unsigned char out[MODBUS_TCP_MAX_ADU];
+  unsigned short crc;
+  unsigned int tid;
+
+  assert(modbus_crc_valid(request, sizeof(request)));
+  assert(modbus_rtu_request_length(request, 5) == 0);
+  assert(modbus_rtu_request_length(request, sizeof(request)) == sizeof(request));
+  assert(modbus_tcp_request_length(tcp, sizeof(tcp)) == sizeof(tcp));
+  assert(modbus_tcp_to_rtu(tcp, sizeof(tcp), rtu, &tid) == sizeof(request));
+  assert(tid == 0x1234 && memcmp(rtu, request, sizeof(request)) == 0);
+  // exception reply
+  crc = modbus_crc16(reply, 3);
+  reply[3] = crc & 0xFF;
+  reply[4] = crc >> 8;
+  assert(modbus_rtu_reply_length(reply, sizeof(reply), 0x03) == sizeof(reply));
+  assert(modbus_rtu_reply_length(reply, sizeof(reply), 0x04) < 0);
+  assert(modbus_rtu_to_tcp(reply, sizeof(reply), out, tid) == 9);
+  assert(out[0] == 0x12 && out[5] == 3 && out[7] == 0x83);
+}
+
+/**
+ * Take the next output of a connection and compare it
+ */
+static void request_reply_test_output(struct s_conn *conn, char *expected)
+{
+  struct s_entry *entry;
+
+  entry = queue_get_timeout(&conn->out_queue, 0);
+  assert(entry != NULL && entry->length == (int) strlen(expected));
+  assert(memcmp(entry->message, expected, entry->length) == 0);
+  free(entry->message);
+  free(entry);
+}
+
+/**
+ * The reply_end escapes and the three ways a request_reply reply ends
+ */
+static void request_reply_test()
+{
+  struct s_link *port = &links[5];
+  struct s_worker worker;
+  struct s_conn requester, listener;
+  struct s_entry request;
+  char data[] = "ok\r\nextra";
+  char end[REPLY_END_MAX];
+  int wait_ms;
+
+  assert(strunescape(end, "\\r\\n", REPLY_END_MAX) == 2 && memcmp(end, "\r\n", 2) == 0);
+  assert(strunescape(end, "\\x41\\t\\x0", REPLY_END_MAX) == 3);
+  assert(memcmp(end, "A\t\0", 3) == 0);
+  assert(strunescape(end, "12345678", REPLY_END_MAX) == 8);
+  assert(strunescape(end, "12345678\\n", REPLY_END_MAX) < 0);
+  assert(strunescape(end, "\\q", REPLY_END_MAX) < 0);
+  assert(strunescape(end, "\\xg", REPLY_END_MAX) < 0);
+
+  memset(port, 0, sizeof(struct s_link));
+  memset(&worker, 0, sizeof(struct s_worker));
+  queue_create(&worker.tcp2serial_queue);
+  mutex_create(&port->conns_lock);
+  mutex_create(&port->transaction_lock);
+  port->port = port;
+  port->worker = &worker;
+  port->tcp_port = 1500;
+  active_link = port;
+  assert(conf_parse_link_settings("protocol", "request_reply") == 0);
+  assert(conf_parse_link_settings("reply_end", "\\x") < 0);
+  assert(conf_parse_link_settings("reply_end", "\\r\\n") == 0);
+  assert(port->reply_end_length == 2 && memcmp(port->reply_end, "\r\n", 2) == 0);
+  assert(conf_parse_link_settings("reply_timeout", "20") == 0);
+  active_link = NULL;
+  memset(&requester, 0, sizeof(struct s_conn));
+  memset(&listener, 0, sizeof(struct s_conn));
+  requester.link = listener.link = port;
+  requester.running = listener.running = 1;
+  requester.references = listener.references = 1;
+  queue_create(&requester.out_queue);
+  queue_create(&listener.out_queue);
+  assert(attach_connection(&requester) == 0 && attach_connection(&listener) == 0);
+  memset(&request, 0, sizeof(struct s_entry));
+  request.conn = &requester;
+  request.message = "ask\n";
+  request.length = 4;
+  port->pending = &request;
+
+  // The terminator may be split over reads, what follows it goes to everybody
+  transaction_begin(port, &request);
+  serial_input(port, data, 3);
+  assert(port->transaction.conn == &requester && port->transaction.matched == 1);
+  serial_input(port, data + 3, 6);
+  assert(port->transaction.conn == NULL && requester.references == 1);
+  request_reply_test_output(&requester, "ok\r");
+  request_reply_test_output(&requester, "\n");
+  request_reply_test_output(&requester, "extra");
+  request_reply_test_output(&listener, "extra");
+  assert(queue_get_timeout(&listener.out_queue, 0) == NULL);
+
+  // Without reply_end the silence of reply_gap ends the reply
+  port->reply_end_length = 0;
+  port->reply_gap = 20;
+  transaction_begin(port, &request);
+  transaction_written(port);
+  serial_input(port, data, 4);
+  wait_ms = -1;
+  assert(transaction_done(port, &wait_ms) == 0 && wait_ms > 0 && wait_ms <= 21);
+  assert(port->transaction.conn == &requester);
+  usleep(30 * 1000);
+  transaction_done(port, &wait_ms);
+  assert(port->transaction.conn == NULL && port->transaction.timeouts == 0);
+  request_reply_test_output(&requester, "ok\r\n");
+  assert(queue_get_timeout(&listener.out_queue, 0) == NULL);
+
+  // Without a reply reply_timeout ends the transaction
+  transaction_begin(port, &request);
+  transaction_written(port);
+  wait_ms = -1;
+  assert(transaction_done(port, &wait_ms) == 0 && wait_ms > 0);
+  usleep(30 * 1000);
+  transaction_done(port, &wait_ms);
+  assert(port->transaction.conn == NULL && port->transaction.timeouts == 1);
+  assert(queue_get_timeout(&requester.out_queue, 0) == NULL);
+  assert(requester.references == 1);
+
+  queue_destroy(&requester.out_queue);
+  queue_destroy(&listener.out_queue);
+  queue_destroy(&worker.tcp2serial_queue);
+  memset(port, 0, sizeof(struct s_link));
+}
+
+static void cache_test()
+{
+  struct s_cache cache;
+  struct s_conn a, b;
+  struct s_cache_waiter *waiter;
+  char *reply;
+  int length;
+
+  memset(&cache, 0, sizeof(cache));
+  cache.ttl = 50;
+  cache.size = 1;
+  cache_create(&cache);
+  assert(cache_lookup(&cache, "ping", 4, &a, 1, &reply, &length) == CACHE_MISS);
+  assert(cache_lookup(&cache, "ping", 4, &b, 2, &reply, &length) == CACHE_IN_FLIGHT);
+  // the only entry is in flight
+  assert(cache_lookup(&cache, "pong", 4, &a, 1, &reply, &length) == CACHE_MISS);
+  waiter = cache_complete(&cache, "ping", 4, "ok", 2);
+  assert(waiter != NULL && waiter->conn == &b && waiter->tag == 2 && waiter->next == NULL);
+  free(waiter);
+  assert(cache_lookup(&cache, "ping", 4, &a, 1, &reply, &length) == CACHE_HIT);
+  assert(length == 2 && memcmp(reply, "ok", 2) == 0);
+  free(reply);
+  assert(cache.hits == 1 && cache.misses == 2 && cache.collapsed == 1);
+  usleep(60 * 1000);
+  assert(cache_lookup(&cache, "ping", 4, &a, 1, &reply, &length) == CACHE_MISS);
+  assert(cache_complete(&cache, "ping", 4, NULL, 0) == NULL);
+  assert(cache_lookup(&cache, "ping", 4, &a, 1, &reply, &length) == CACHE_MISS);
+}
+
+static void history_test()
+{
+  struct s_history history;
+  unsigned long long seq = 0;
+  char *data;
+  int length;
+
+  memset(&history, 0, sizeof(history));
+  history.size = 8;
+  history_create(&history);
+  history_add(&history, "abcdef", 6);
+  history_add(&history, "ghij", 4);
+  // a and b are gone
+  data = history_read(&history, &seq, &length);
+  assert(seq == 2 && length == 8 && memcmp(data, "cdefghij", 8) == 0);
+  free(data);
+  seq = 7;
+  data = history_read(&history, &seq, &length);
+  assert(seq == 7 && length == 3 && memcmp(data, "hij", 3) == 0);
+  free(data);
+  seq = 20;
+  assert(history_read(&history, &seq, &length) == NULL && seq == 10);
+  history_add(&history, "0123456789", 10);
+  seq = 0;
+  data = history_read(&history, &seq, &length);
+  assert(seq == 12 && length == 8 && memcmp(data, "23456789", 8) == 0);
+  free(data);
+}
+
+/**
+ * A loopback device echoes what is written to its pty,
+ * generator frames are numbered
+ */
+static void vserial_test()
+{
+  struct s_vserial vserial;
+  struct s_serial serial;
+  char frame[16];
+  char echo[4];
+  struct termios tty;
+  int length = 0;
+  int bytes;
+  int fd;
+
+  memset(&vserial, 0, sizeof(vserial));
+  memset(&serial, 0, sizeof(serial));
+  strcpy(serial.str_serial_port, "loop0");
+  vserial.type = VSERIAL_LOOPBACK;
+  assert(vserial_open(&vserial, &serial) == 0);
+  assert((fd = open(serial.device, O_RDWR | O_NOCTTY)) >= 0);
+  // serial_open puts the port in raw mode, the pty would echo otherwise
+  assert(tcgetattr(fd, &tty) == 0);
+  cfmakeraw(&tty);
+  assert(tcsetattr(fd, TCSANOW, &tty) == 0);
+  assert(vserial_start(&vserial, &serial) == 0);
+  assert(write(fd, "ping", 4) == 4);
+  while(length < 4) {
+    assert((bytes = read(fd, echo + length, 4 - length)) > 0);
+    length += bytes;
+  }
+  assert(memcmp(echo, "ping", 4) == 0);
+
+  vserial_frame(frame, sizeof(frame), 27);
+  assert(memcmp(frame, "0000001b kl", 11) == 0 && frame[15] == '\n');
+  vserial.frame_size = VSERIAL_FRAME_MIN - 1;
+  assert(vserial_open(&vserial, &serial) < 0);
+}
+
+/**
+ * Every flush makes the output so far decompressable
+ */
+static void compress_test()
+{
+  struct s_compress compress;
+  z_stream stream;
+  char compressed[128];
+  char plain[64];
+  char *data;
+  int total = 0;
+  int length;
+
+  assert(compress_start(&compress, DEFAULT_COMPRESSION_LEVEL) == 0);
+  data = compress_data(&compress, "serial serial ", 14, 0, &length);
+  memcpy(compressed, data, length);
+  total += length;
+  free(data);
+  data = compress_data(&compress, "serial\n", 7, 1, &length);
+  memcpy(compressed + total, data, length);
+  total += length;
+  free(data);
+  assert(compress.bytes_in == 21 && compress.bytes_out == total);
+
+  memset(&stream, 0, sizeof(stream));
+  assert(inflateInit(&stream) == Z_OK);
+  stream.next_in = (Bytef *) compressed;
+  stream.avail_in = total;
+  stream.next_out = (Bytef *) plain;
+  stream.avail_out = sizeof(plain);
+  assert(inflate(&stream, Z_SYNC_FLUSH) == Z_OK);
+  assert(sizeof(plain) - stream.avail_out == 21 &&
+         memcmp(plain, "serial serial serial\n", 21) == 0);
+  inflateEnd(&stream);
+  compress_end(&compress);
+}
+
+static volatile int pool_test_runs;
+static volatile int pool_test_work;
+
+static enum e_pool_result pool_test_run(void *arg, int *wait_ms)
+{
+  __sync_add_and_fetch(&pool_test_runs, 1);
+  // The first run waits, the second asks for another run
+  if(pool_test_runs == 1) {
+    *wait_ms = 5;
+    return POOL_WAIT;
+  }
+  if(pool_test_runs == 2) {
+    return POOL_AGAIN;
+  }
+  pool_test_work = 0;
+  return POOL_DONE;
+}
+
+static int pool_test_ready(void *arg)
+{
+  return pool_test_work;
+}
+
+static void pool_test()
+{
+  static struct s_pool pool;
+  struct s_pool_task task;
+  int i;
+
+  memset(&task, 0, sizeof(task));
+  pool_start(&pool, 2, pool_test_run, pool_test_ready);
+  pool_test_work = 1;
+  pool_schedule(&pool, &task);
+  // Scheduling a scheduled task does nothing
+  pool_schedule(&pool, &task);
+  for(i = 0; i < 100 && (task.scheduled || pool_test_runs < 3); i++) {
+    usleep(10000);
+  }
+  assert(pool_test_runs == 3 && !task.scheduled);
+  pool_schedule(&pool, &task);
+  for(i = 0; i < 100 && pool_test_runs < 4; i++) {
+    usleep(10000);
+  }
+  assert(pool_test_runs == 4);
+}
+
+static void relay_test()
+{
+  unsigned char header[RELAY_HEADER_SIZE];
+  enum e_relay_frame type;
+  struct s_relay *relay;
+  int stream;
+  int length;
+
+  relay_pack_header(header, RELAY_DATA, 200, RELAY_FRAME_MAX);
+  assert(relay_unpack_header(header, &type, &stream, &length) == 0);
+  assert(type == RELAY_DATA && stream == 200 && length == RELAY_FRAME_MAX);
+  relay_pack_header(header, RELAY_DATA, 1, RELAY_FRAME_MAX + 1);
+  assert(relay_unpack_header(header, &type, &stream, &length) < 0);
+  relay_pack_header(header, RELAY_DATA, RELAY_STREAMS_MAX, 1);
+  assert(relay_unpack_header(header, &type, &stream, &length) < 0);
+  relay_pack_header(header, RELAY_CLOSE + 1, 1, 1);
+  assert(relay_unpack_header(header, &type, &stream, &length) < 0);
+
+  // Credit only goes back in steps
+  relay = relay_create(NULL, -1);
+  assert(relay->streams[3].credit == RELAY_WINDOW);
+  relay->streams[3].delivered = RELAY_CREDIT_STEP - 1;
+  assert(relay_consumed(relay, 3, RELAY_CREDIT_STEP - 1) == 0);
+  assert(relay->streams[3].credited == 0);
+  assert(relay->references == 1);
+  relay_put(relay);
+}
+
+/**
+ * A segment of the spill log is only recycled
+ * once every reader passed it
+ */
+static void spill_test()
+{
+  struct s_spill spill;
+  char data[32];
+  char *spilled;
+  int length;
+  int i;
+
+  for(i = 0; i < sizeof(data); i++) {
+    data[i] = i;
+  }
+  memset(&spill, 0, sizeof(struct s_spill));
+  snprintf(spill.dir, SPILL_DIR_MAX, "/tmp/dividi_spill_test.%d", getpid());
+  spill.segment_size = 16;
+  spill.segments = 2;
+  spill_create(&spill, 1);
+  assert(spill_append(&spill, data, 20, 0) == 0);
+  assert((spilled = spill_read(&spill, 0, &length)) != NULL);
+  assert(length == 16 && memcmp(spilled, data, 16) == 0);
+  assert((spilled = spill_read(&spill, 16, &length)) != NULL);
+  assert(length == 4 && memcmp(spilled, data + 16, 4) == 0);
+  assert(spill_read(&spill, 20, &length) == NULL);
+
+  // A reader at 0 holds both segments
+  assert(spill_room(&spill, 0) == 12);
+  assert(spill_append(&spill, data, 13, 0) < 0);
+  assert(spill_append(&spill, data + 20, 12, 0) == 0);
+  assert(spill_append(&spill, data, 1, 0) < 0);
+  assert(spill_oldest(&spill) == 0);
+
+  // Once it passed the first segment, that one is recycled
+  assert(spill_append(&spill, data, 1, 16) == 0);
+  assert(spill_oldest(&spill) == 16);
+  assert(spill_read(&spill, 0, &length) == NULL);
+  assert((spilled = spill_read(&spill, 16, &length)) != NULL);
+  assert(length == 16 && memcmp(spilled, data + 16, 16) == 0);
+  assert((spilled = spill_read(&spill, 32, &length)) != NULL);
+  assert(length == 1 && spilled[0] == data[0]);
+  rmdir(spill.dir);
+}
+
+/**
+ * Read the next record of a trace file and compare
+ * it, only the start of long data is compared
+ */
+static void capture_test_record(FILE *trace, int link, int client,
+                                enum e_capture_direction direction, char *data, int length)
+{
+  struct s_capture_record record;
+  char read_data[64];
+  int compared = (length < sizeof(read_data)) ? length : sizeof(read_data);
+
+  assert(fread(&record, sizeof(record), 1, trace) == 1);
+  assert(record.time > 0 && record.length == length && record.client == client);
+  assert(record.link == link && record.direction == direction);
+  assert(record.reserved == 0 && record.file == 0);
+  assert(fread(read_data, 1, compared, trace) == compared);
+  assert(memcmp(read_data, data, compared) == 0);
+  assert(fseek(trace, length - compared, SEEK_CUR) == 0);
+}
+
+/**
+ * Chunks wrapping the ring of a thread end up
+ * unchanged in the trace file
+ */
+static void capture_test()
+{
+  struct s_capture_header header;
+  struct s_capture_ring *thread_ring;
+  char path[64];
+  char *big;
+  FILE *trace;
+  unsigned long long dropped;
+  int big_length = CAPTURE_WRITE_SIZE - sizeof(struct s_capture_record);
+  int file;
+  int i;
+
+  snprintf(path, sizeof(path), "/tmp/dividi_capture_test.%d", getpid());
+  assert((file = capture_open(path)) > 0);
+  assert(capture_open(path) == file);
+  thread_ring = capture_ring();
+  assert(thread_ring != NULL && thread_ring->head == 0);
+
+  // The record of the first chunk wraps, the data of the second
+  thread_ring->head = thread_ring->tail = CAPTURE_RING_SIZE - 8;
+  capture_add(file, 1100, 0, CAPTURE_FROM_SERIAL, "hello", 5);
+  assert(thread_ring->head == CAPTURE_RING_SIZE - 8 + sizeof(struct s_capture_record) + 5);
+  capture_drain(thread_ring);
+  thread_ring->head = thread_ring->tail = 2 * CAPTURE_RING_SIZE - sizeof(struct s_capture_record) - 2;
+  capture_add(file, 1200, 7, CAPTURE_TO_SERIAL, "world\n", 6);
+  capture_drain(thread_ring);
+  assert(thread_ring->tail == thread_ring->head);
+
+  // A full ring drops the chunk and keeps the ones it holds
+  dropped = capture_dropped();
+  big = (char *) malloc(big_length);
+  memset(big, 'b', big_length);
+  for(i = 0; i < CAPTURE_RING_SIZE / CAPTURE_WRITE_SIZE; i++) {
+    capture_add(file, 1300, 2, CAPTURE_TO_SERIAL, big, big_length);
+  }
+  assert(capture_dropped() == dropped);
+  capture_add(file, 1300, 2, CAPTURE_TO_SERIAL, "x", 1);
+  assert(capture_dropped() == dropped + 1);
+  // A chunk bigger than the staging buffer never fits
+  capture_add(file, 1300, 2, CAPTURE_TO_SERIAL, big, big_length + 1);
+  assert(capture_dropped() == dropped + 2);
+  capture_drain(thread_ring);
+  capture_flush(&files[file - 1]);
+
+  assert((trace = fopen(path, "rb")) != NULL);
+  assert(fread(&header, sizeof(header), 1, trace) == 1);
+  assert(memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) == 0);
+  assert(header.version == CAPTURE_VERSION && header.reserved == 0);
+  capture_test_record(trace, 1100, 0, CAPTURE_FROM_SERIAL, "hello", 5);
+  capture_test_record(trace, 1200, 7, CAPTURE_TO_SERIAL, "world\n", 6);
+  for(i = 0; i < CAPTURE_RING_SIZE / CAPTURE_WRITE_SIZE; i++) {
+    capture_test_record(trace, 1300, 2, CAPTURE_TO_SERIAL, big, big_length);
+  }
+  assert(fgetc(trace) == EOF);
+  fclose(trace);
+  free(big);
+  unlink(path);
+}
+
+/**
+ * The rings of a shared memory segment, dividi
+ * detaches a client that corrupts them
+ */
+static void shm_test()
+{
+  struct s_shm shm;
+  struct dividi_shm client;
+  struct dividi_shm_ring *ring;
+  uint32_t length;
+  char buf[16];
+  char *record;
+  int record_length;
+
+  memset(&shm, 0, sizeof(struct s_shm));
+  snprintf(shm.path, SHM_PATH_MAX, "/tmp/dividi_shm_test.%d", getpid());
+  shm.size = 4096;
+  shm_create(&shm);
+  assert(dividi_shm_attach(&client, shm.path) == 0);
+  assert(shm_attached(&shm));
+  assert(dividi_shm_write(&client, "AT\r", 3, 0) == 3);
+  assert((record = shm_receive(&shm, &record_length)) != NULL);
+  assert(record_length == 3 && memcmp(record, "AT\r", 3) == 0);
+  free(record);
+  assert(shm_receive(&shm, &record_length) == NULL);
+  assert(shm_send(&shm, "OK\r\n", 4) == 0);
+  assert(dividi_shm_read(&client, buf, sizeof(buf), 0) == 4 && memcmp(buf, "OK\r\n", 4) == 0);
+
+  // A record longer than the ring
+  ring = &shm.header->to_serial;
+  length = 0x80000000;
+  dividi_shm_copy_in(shm.header, ring, ring->head, &length, DIVIDI_SHM_RECORD_HEADER);
+  ring->head += DIVIDI_SHM_RECORD_HEADER;
+  assert(shm_receive(&shm, &record_length) == NULL);
+  assert(shm_detached(&shm));
+  shm_reset(&shm);
+
+  // A head further than a ring ahead
+  assert(dividi_shm_attach(&client, shm.path) == 0);
+  ring->head = shm.size + 1;
+  assert(shm_receive(&shm, &record_length) == NULL);
+  assert(shm_detached(&shm));
+  shm_reset(&shm);
+  // A tail ahead of the head keeps the ring full
+  shm.header->to_client.tail = 1;
+  assert(shm_send(&shm, "OK", 2) < 0);
+  shm_destroy(&shm);
+}
+
+/**
+ * Frames of an aggregate can arrive in pieces
+ */
+static void aggregate_test()
+{
+  struct s_aggregate_parser parser;
+  char data[AGGREGATE_PAYLOAD_MAX + 1];
+  char *frame;
+  char *payload;
+  int frame_length;
+  int payload_length;
+  int tag;
+
+  memset(&parser, 0, sizeof(struct s_aggregate_parser));
+  frame = aggregate_frame(5, "hello", 5, &frame_length);
+  assert(frame_length == AGGREGATE_HEADER_SIZE + 5);
+  // A header split over two reads
+  assert(aggregate_parse(&parser, frame, 2, &tag, &payload, &payload_length) == 2);
+  assert(payload_length == 0);
+  assert(aggregate_parse(&parser, frame + 2, 3, &tag, &payload, &payload_length) == 3);
+  assert(tag == 5 && payload_length == 2 && memcmp(payload, "he", 2) == 0);
+  assert(aggregate_parse(&parser, frame + 5, 3, &tag, &payload, &payload_length) == 3);
+  assert(tag == 5 && payload_length == 3 && memcmp(payload, "llo", 3) == 0);
+  assert(parser.remaining == 0);
+  free(frame);
+
+  // Long output is split over frames
+  memset(data, 'a', sizeof(data));
+  frame = aggregate_frame(1, data, sizeof(data), &frame_length);
+  assert(frame_length == sizeof(data) + 2 * AGGREGATE_HEADER_SIZE);
+  assert(aggregate_parse(&parser, frame, frame_length, &tag, &payload,
+                         &payload_length) == AGGREGATE_HEADER_SIZE + AGGREGATE_PAYLOAD_MAX);
+  assert(tag == 1 && payload_length == AGGREGATE_PAYLOAD_MAX);
+  free(frame);
+}
+
+/**
+ * Clients of the shared port name the link
+ */
+static void route_test()
+{
+  strcpy(links[1].server_name, "rack1");
+  assert(route_link("RACK1", 5) == &links[1]);
+  // Only the whole name matches
+  assert(route_link("rack1.example", 13) == NULL);
+  assert(route_link("rack", 4) == NULL);
+  assert(route_link("rack12", 6) == NULL);
+  links[1].server_name[0] = '\0';
+}
+
+/**
+ * The port a listener got from the kernel
+ */
+static int listener_test_port(int fd)
+{
+  struct sockaddr_storage address;
+  socklen_t length = sizeof(address);
+
+  assert(getsockname(fd, (struct sockaddr *) &address, &length) == 0);
+  if(address.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6 *) &address)->sin6_port);
+  }
+  return ntohs(((struct sockaddr_in *) &address)->sin_port);
+}
+
+/**
+ * A listener per address, the IPv6 ones
+ * leave the IPv4 port alone
+ */
+static void listener_test()
+{
+  struct sockaddr_in6 loopback;
+  int fd, fd6;
+  int port;
+  int err;
+
+  fd = open_listener(0, "", "127.0.0.1", 1);
+  assert(get_option(fd, SOL_SOCKET, SO_ACCEPTCONN) == 1);
+  assert(get_option(fd, SOL_SOCKET, SO_REUSEPORT) == 1);
+  assert(get_option(fd, SOL_SOCKET, SO_REUSEADDR) == 1);
+  close(fd);
+  fd = open_listener(0, "", "127.0.0.1", 0);
+  assert(get_option(fd, SOL_SOCKET, SO_REUSEPORT) == 0);
+  close(fd);
+
+  // Only when the host has IPv6
+  memset(&loopback, 0, sizeof(loopback));
+  loopback.sin6_family = AF_INET6;
+  loopback.sin6_addr = in6addr_loopback;
+  if((fd6 = socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+    return;
+  }
+  err = bind(fd6, (struct sockaddr *) &loopback, sizeof(loopback));
+  close(fd6);
+  if(err < 0) {
+    return;
+  }
+  fd6 = open_listener(0, "", "::1", 1);
+  assert(get_option(fd6, IPPROTO_IPV6, IPV6_V6ONLY) == 1);
+  assert(get_option(fd6, SOL_SOCKET, SO_REUSEPORT) == 1);
+  close(fd6);
+  // "::" next to "0.0.0.0" on the same port
+  fd = open_listener(0, "", "0.0.0.0", 0);
+  port = listener_test_port(fd);
+  fd6 = open_listener(port, "", "::", 0);
+  assert(listener_test_port(fd6) == port);
+  assert(get_option(fd6, IPPROTO_IPV6, IPV6_V6ONLY) == 1);
+  close(fd6);
+  close(fd);
+}
+
+/**
+ * The options of the socket profiles as the kernel reports them
+ */
+static void socket_profile_test()
+{
+  int fd;
+  int sndbuf;
+  int rcvbuf;
+  int err;
+
+  assert(socket_profile_from_string("low_latency") == SOCKET_PROFILE_LOW_LATENCY);
+  assert(socket_profile_from_string("throughput") == SOCKET_PROFILE_THROUGHPUT);
+  assert(socket_profile_from_string("fast") < 0);
+
+  assert((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+  assert(get_option(fd, IPPROTO_TCP, TCP_NODELAY) == 0);
+  assert(socket_apply_profile(fd, SOCKET_PROFILE_DEFAULT) == 0);
+  assert(get_option(fd, IPPROTO_TCP, TCP_NODELAY) == 0);
+  // SO_BUSY_POLL is refused without CAP_NET_ADMIN
+  err = socket_apply_profile(fd, SOCKET_PROFILE_LOW_LATENCY);
+  assert(get_option(fd, IPPROTO_TCP, TCP_NODELAY) == 1);
+#ifdef SO_BUSY_POLL
+  assert(err < 0 || get_option(fd, SOL_SOCKET, SO_BUSY_POLL) == SOCKET_BUSY_POLL_US);
+#endif
+#ifdef TCP_QUICKACK
+  assert(get_option(fd, IPPROTO_TCP, TCP_QUICKACK) == 1);
+#endif
+  close(fd);
+
+  assert((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0);
+  sndbuf = get_option(fd, SOL_SOCKET, SO_SNDBUF);
+  rcvbuf = get_option(fd, SOL_SOCKET, SO_RCVBUF);
+  assert(socket_apply_profile(fd, SOCKET_PROFILE_THROUGHPUT) == 0);
+  // Capped by wmem_max and rmem_max, the kernel doubles the request
+  assert(get_option(fd, SOL_SOCKET, SO_SNDBUF) > sndbuf);
+  assert(get_option(fd, SOL_SOCKET, SO_RCVBUF) > rcvbuf);
+  assert(get_option(fd, SOL_SOCKET, SO_SNDBUF) <= 2 * SOCKET_BUFFER_SIZE);
+#ifdef TCP_CORK
+  assert(get_option(fd, IPPROTO_TCP, TCP_CORK) == 1);
+#endif
+  assert(get_option(fd, IPPROTO_TCP, TCP_NODELAY) == 0);
+  close(fd);
+}
+
+/**
+ * A read into a registered buffer and the timeout
+ * of the serial worker, skipped without io_uring
+ */
+static void uring_test()
+{
+#ifdef HAVE_URING
+  struct s_uring ring;
+  struct s_link port;
+  struct s_link *ports[1];
+  struct iovec buffers[1];
+  struct io_uring_cqe *cqe;
+  char data[SERIAL_DATA_CHUNK_SIZE];
+  int fds[2];
+
+  if(!uring_available()) {
+    return;
+  }
+  memset(&port, 0, sizeof(struct s_link));
+  assert(pipe(fds) == 0);
+  port.serial.serial_port = fds[0];
+  ports[0] = &port;
+  buffers[0].iov_base = data;
+  buffers[0].iov_len = sizeof(data);
+  assert(uring_create(&ring, 2) == 0);
+  assert(uring_register_buffers(&ring, buffers, 1) == 0);
+  uring_arm(&ring, ports, buffers, 0);
+  assert(write(fds[1], "uring\n", 6) == 6);
+  assert(uring_submit_and_wait(&ring, 1) == 1);
+  assert((cqe = uring_peek_cqe(&ring)) != NULL);
+  assert(cqe->user_data == 0 && cqe->res == 6);
+  assert(memcmp(data, "uring\n", 6) == 0);
+  uring_cqe_seen(&ring);
+  assert(uring_peek_cqe(&ring) == NULL);
+
+  // Without input only the timeout completes
+  uring_arm(&ring, ports, buffers, 0);
+  uring_arm(&ring, ports, buffers, URING_TIMEOUT);
+  assert(uring_submit_and_wait(&ring, 1) == 2);
+  assert((cqe = uring_peek_cqe(&ring)) != NULL);
+  assert(cqe->user_data == URING_TIMEOUT && cqe->res == -ETIME);
+  uring_cqe_seen(&ring);
+  assert(uring_peek_cqe(&ring) == NULL);
+  // The armed read still gets the next input
+  assert(write(fds[1], "x", 1) == 1);
+  assert(uring_submit_and_wait(&ring, 1) == 0);
+  assert((cqe = uring_peek_cqe(&ring)) != NULL);
+  assert(cqe->user_data == 0 && cqe->res == 1 && data[0] == 'x');
+  uring_cqe_seen(&ring);
+  uring_destroy(&ring);
+  close(fds[0]);
+  close(fds[1]);
+#endif
+}
+
+/**
+ * A TLS session over a bio pair that holds less than a record,
+ * the session holds the last reference to the contexts
+ */
+static void tls_test_open(SSL **server, SSL **client, BIO **server_bio)
+{
+  SSL_CTX *server_ctx = SSL_CTX_new(TLS_server_method());
+  SSL_CTX *client_ctx = SSL_CTX_new(TLS_client_method());
+  BIO *client_bio;
+  int i;
+
+  *server = SSL_new(server_ctx);
+  *client = SSL_new(client_ctx);
+  SSL_CTX_free(server_ctx);
+  SSL_CTX_free(client_ctx);
+  assert(SSL_use_certificate_file(*server, "examples/cert/server.crt", SSL_FILETYPE_PEM) == 1);
+  assert(SSL_use_PrivateKey_file(*server, "examples/cert/server.key", SSL_FILETYPE_PEM) == 1);
+  assert(BIO_new_bio_pair(server_bio, 4096, &client_bio, 4096) == 1);
+  SSL_set_bio(*server, *server_bio, *server_bio);
+  SSL_set_bio(*client, client_bio, client_bio);
+  SSL_set_mode(*server, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SSL_set_accept_state(*server);
+  SSL_set_connect_state(*client);
+  for(i = 0; i < 100 && !(SSL_is_init_finished(*server) && SSL_is_init_finished(*client)); i++) {
+    SSL_do_handshake(*client);
+    SSL_do_handshake(*server);
+  }
+  assert(SSL_is_init_finished(*server) && SSL_is_init_finished(*client));
+}
+
+/**
+ * Output is collected into TLS records, a record the
+ * socket has no room for is kept untill it fits
+ */
+static void batch_test()
+{
+  SSL *server;
+  SSL *client;
+  BIO *server_bio;
+  struct s_conn conn;
+  struct s_link link;
+  char data[TLS_RECORD_MAX + 10];
+  char received[TLS_RECORD_MAX];
+  int total = 0;
+  int bytes;
+  int i;
+
+  tls_test_open(&server, &client, &server_bio);
+  memset(&link, 0, sizeof(struct s_link));
+  memset(&conn, 0, sizeof(struct s_conn));
+  conn.link = &link;
+  conn.socket = server;
+  BIO_set_callback_arg(server_bio, (char *) &conn);
+  BIO_set_callback_ex(server_bio, batch_count_writes);
+  memset(data, 'b', sizeof(data));
+
+  // Small output waits for the flush
+  assert(client_send(&conn, data, 100) == 0);
+  assert(client_send(&conn, data, 100) == 0);
+  assert(conn.batch.records == 0 && conn.batch.syscalls == 0);
+  assert(client_flush(&conn) == 0);
+  assert(conn.batch.records == 1 && conn.batch.syscalls == 1);
+  assert(SSL_read(client, received, sizeof(received)) == 200);
+
+  // A full record goes out right away, it waits for the client to read
+  assert(client_send(&conn, data, sizeof(data)) == 1);
+  assert(conn.batch.blocked == TLS_RECORD_MAX && conn.batch.records == 1);
+  assert(client_flush(&conn) == 1);
+  for(i = 0; i < 1000 && total < sizeof(data); i++) {
+    if((bytes = SSL_read(client, received, sizeof(received))) > 0) {
+      total += bytes;
+    } else {
+      assert(batch_write_rest(&conn) >= 0);
+    }
+  }
+  assert(total == sizeof(data));
+  assert(conn.batch.records == 3 && conn.batch.syscalls > 3);
+  assert(conn.batch.blocked == 0 && conn.batch.length == 0);
+
+  free(conn.batch.data);
+  SSL_free(server);
+  SSL_free(client);
+}
+
+/**
+ * Send the out queue of a session test client and
+ * read what the client gets
+ *
+ * @return the amount of received bytes
+ */
+static int session_test_read(struct s_conn *conn, SSL *client, char *received, int size)
+{
+  struct s_entry *entry;
+  int total = 0;
+  int bytes;
+
+  while((entry = queue_get_timeout(&conn->out_queue, 0)) != NULL) {
+    assert(client_send_entry(conn, entry) == 0);
+    free(entry->message);
+    free(entry);
+  }
+  assert(client_flush(conn) == 0);
+  while(total < size && (bytes = SSL_read(client, received + total, size - total)) > 0) {
+    total += bytes;
+  }
+  return total;
+}
+
+/**
+ * A client of a compressing link without history gets the
+ * output of the handshake wait, with or without handshake
+ */
+static void session_test()
+{
+  SSL *server;
+  SSL *client;
+  BIO *server_bio;
+  struct s_conn conn;
+  struct s_link link;
+  char early[] = "early\n";
+  char later[] = "later\n";
+  char received[128];
+  char inflated[16];
+  int sv[2];
+  int bytes;
+  z_stream stream;
+
+  memset(&link, 0, sizeof(struct s_link));
+  mutex_create(&link.conns_lock);
+  link.compression = COMPRESSION_ZLIB;
+  link.compression_level = DEFAULT_COMPRESSION_LEVEL;
+  link.resume_timeout = 10;
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+  // No handshake, the output of the wait is queued
+  tls_test_open(&server, &client, &server_bio);
+  memset(&conn, 0, sizeof(struct s_conn));
+  conn.link = &link;
+  conn.socket = server;
+  conn.tcp_socket = sv[0];
+  conn.running = 1;
+  queue_create(&conn.out_queue);
+  assert(attach_connection(&conn) == 0 && conn.live);
+  link_output(&link, early, 6);
+  assert(session_start(&conn, &bytes) == NULL && bytes == 0);
+  assert(session_test_read(&conn, client, received, 6) == 6);
+  assert(memcmp(received, "early\n", 6) == 0);
+  assert(!conn.compress.active);
+  link.conns[0] = NULL;
+  free(conn.batch.data);
+  queue_destroy(&conn.out_queue);
+  SSL_free(server);
+  SSL_free(client);
+
+  // The reply splits the plain output from the compressed output
+  tls_test_open(&server, &client, &server_bio);
+  memset(&conn, 0, sizeof(struct s_conn));
+  conn.link = &link;
+  conn.socket = server;
+  conn.tcp_socket = sv[0];
+  conn.running = 1;
+  queue_create(&conn.out_queue);
+  assert(attach_connection(&conn) == 0);
+  link_output(&link, early, 6);
+  assert(SSL_write(client, "DIVIDI COMPRESS zlib\n", 21) == 21);
+  assert(write(sv[1], "x", 1) == 1);
+  assert(session_start(&conn, &bytes) == NULL);
+  link_output(&link, later, 6);
+  bytes = session_test_read(&conn, client, received, sizeof(received));
+  assert(bytes > 27 && memcmp(received, "early\nDIVIDI COMPRESS zlib\n", 27) == 0);
+  memset(&stream, 0, sizeof(z_stream));
+  assert(inflateInit(&stream) == Z_OK);
+  stream.next_in = (unsigned char *) received + 27;
+  stream.avail_in = bytes - 27;
+  stream.next_out = (unsigned char *) inflated;
+  stream.avail_out = sizeof(inflated);
+  assert(inflate(&stream, Z_SYNC_FLUSH) == Z_OK);
+  assert(sizeof(inflated) - stream.avail_out == 6 && memcmp(inflated, "later\n", 6) == 0);
+  inflateEnd(&stream);
+  link.conns[0] = NULL;
+  compress_end(&conn.compress);
+  free(conn.batch.data);
+  queue_destroy(&conn.out_queue);
+  SSL_free(server);
+  SSL_free(client);
+  close(sv[0]);
+  close(sv[1]);
+}
 
 int main(int argc, char *argv[])
 {
-  int index;
   int i,j;
   struct s_conn conn;
+  struct s_link link;
   char **message;
-  SSL ssl;
+  char setting[16];
 
+  memset(links, 0, sizeof(links));
+  assert(thread_cpu_valid(0));
+  assert(!thread_cpu_valid(-1) && !thread_cpu_valid(1 << 20));
+  strcpy(setting, "0, 1");
+  set_worker_cpus(setting);
+  assert(total_worker_cpus == 2 && worker_cpus[1] == 1);
+  total_worker_cpus = 0;
+  affinity_test();
+  set_workers("2");
+  add_link("/dev/ttyS10", "1100");
+  add_link("/dev/ttyS11", "1200");
+  add_link("/dev/ttyS10", "1300");
   init();
+  // Links sharing a serial device end up on the same worker
+  assert(links[0].worker == &workers[0]);
+  assert(links[1].worker == &workers[1]);
+  assert(links[2].worker == &workers[0]);
+  assert(workers[0].total_links == 2);
   sleep(2);
-  index = tcp2serial_queue_index;
-  conn.socket = &ssl;
-  conn.link = (struct s_link *) malloc(sizeof(struct s_link));
-  conn.link->serial.serial_port = 1;
+
+  memset(&conn, 0, sizeof(struct s_conn));
+  conn.link = &links[1];
+  conn.running = 1;
+  // Held by the test, the queue may never free conn
+  conn.references = 1;
+  sched_init_conn(&conn);
   message = (char **) malloc(NBR_OF_MESSAGES*sizeof(char *));
   for(j=0;j<NBR_OF_MESSAGES; j++) {
     message[j]= (char *) malloc(10+1);
@@ -65,10 +1221,35 @@ int main(int argc, char *argv[])
     }
     message[j][i]='\n';
     message[j][i+1] = '\0';
-    tcp2serial_queue_add(&conn, message[j]);
+    tcp2serial_queue_add(&conn, message[j], strlen(message[j]), 0);
   }
-  assert(tcp2serial_queue_index == index+NBR_OF_MESSAGES);
-  release_queue_sem(DIVIDI_TCP2SERIAL_QUEUE, NBR_OF_MESSAGES);
   sleep(1);
   assert(serial_write_calls == NBR_OF_MESSAGES);
+  assert(conn.references == 1);
+
+  memset(&link, 0, sizeof(struct s_link));
+  mutex_create(&link.conns_lock);
+  link.port = &link;
+  fair_test(&link);
+  rs485_test(&link);
+  backpressure_test();
+  modbus_test();
+  request_reply_test();
+  cache_test();
+  history_test();
+  vserial_test();
+  compress_test();
+  pool_test();
+  spill_test();
+  capture_test();
+  shm_test();
+  relay_test();
+  aggregate_test();
+  route_test();
+  listener_test();
+  socket_profile_test();
+  uring_test();
+  batch_test();
+  session_test();
+  return 0;
 }
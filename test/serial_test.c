@@ -1,4 +1,21 @@
+#include "thread.c"
 #include "serial.c"
+#include "queue.c"
+#include "uring.c"
+#include "net.c"
+#include "fair.c"
+#include "modbus.c"
+#include "cache.c"
+#include "shm.c"
+#include "history.c"
+#include "spill.c"
+#include "capture.c"
+#include "vserial.c"
+#include "compress.c"
+#include "pool.c"
+#include "relay.c"
+#include "aggregate.c"
+#include "metrics.c"
 #include "dividi.c"
 #include "conf.c"
 #include "util.c"
@@ -9,6 +26,62 @@
 #include "dividi.h"
 
 
+/**
+ * The line rate of a few framings and the
+ * write budget for a given driver backlog
+ */
+static void write_budget_test()
+{
+  struct s_serial serial;
+  int wait_ms = 0;
+  int master;
+
+  memset(&serial, 0, sizeof(struct s_serial));
+  serial.baudrate = 9600;
+  assert(serial_line_rate(&serial) == 960);
+  serial.parity = PARITY_EVEN;
+  assert(serial_line_rate(&serial) == 872);
+  serial.baudrate = 115200;
+  serial.data_bits = 7;
+  serial.parity = PARITY_ODD;
+  serial.stop_bits = 2;
+  assert(serial_line_rate(&serial) == 10472);
+  // The rate the driver settled on wins
+  serial.actual_baudrate = 111111;
+  serial.data_bits = 8;
+  serial.parity = PARITY_NONE;
+  serial.stop_bits = 1;
+  assert(serial_line_rate(&serial) == 11111);
+  serial.baudrate = serial.actual_baudrate = 0;
+  assert(serial_line_rate(&serial) == 0);
+
+  // 50ms at 960 bytes per second, refilled per quarter
+  assert(serial_budget(960, 50, 0, &wait_ms) == 48);
+  assert(serial_budget(960, 50, 36, &wait_ms) == 12);
+  assert(serial_budget(960, 50, 37, &wait_ms) == 0 && wait_ms == 2);
+  assert(serial_budget(10472, 10, 100, &wait_ms) == 0 && wait_ms == 3);
+  // A slow port still gets a byte at a time
+  assert(serial_budget(30, 10, 0, &wait_ms) == 1);
+  assert(serial_budget(30, 10, 1, &wait_ms) == 0 && wait_ms == 34);
+
+  // TIOCOUTQ of an idle pty
+  assert((master = posix_openpt(O_RDWR | O_NOCTTY)) >= 0);
+  assert(grantpt(master) == 0 && unlockpt(master) == 0);
+  assert((serial.serial_port = open(ptsname(master), O_RDWR | O_NOCTTY)) >= 0);
+  serial.baudrate = 9600;
+  assert(serial_write_budget(&serial, &wait_ms) < 0);
+  serial.write_latency = 50;
+  assert(serial_output_pending(serial.serial_port) == 0);
+  assert(serial_write_budget(&serial, &wait_ms) == 48);
+  close(serial.serial_port);
+  close(master);
+  // Not a tty, the backlog is unknown
+  serial.serial_port = open("test/dummy/serial.io", O_RDONLY);
+  assert(serial_output_pending(serial.serial_port) < 0);
+  assert(serial_write_budget(&serial, &wait_ms) < 0);
+  close(serial.serial_port);
+}
+
 int main(int argc, char *argv[])
 {
   char *data = NULL;
@@ -20,6 +93,7 @@ int main(int argc, char *argv[])
   int fd = open("test/dummy/serial.io", O_RDWR);
 
   memset(&serial, 0, sizeof(struct s_serial));
+  write_budget_test();
 
   assert(fd > 0);
   file_length = lseek(fd, 0, SEEK_END);
@@ -31,7 +105,7 @@ int main(int argc, char *argv[])
     printf("%c", data[i]);
   assert(bytes_read == file_length);
   lseek(fd, 0L, SEEK_SET);
-  bytes_written = serial_write(fd, data);
+  bytes_written = serial_write(fd, data, bytes_read);
   printf("Bytes written length: %d\n", bytes_written);
   assert(bytes_written == file_length);
   close(fd);
@@ -39,6 +113,9 @@ int main(int argc, char *argv[])
   sprintf(serial.str_serial_port, "/dev/ttyS12");
   fd = serial_open(&serial);
   assert(fd == 0);
+  // Without a baudrate the driver keeps its rate
+  assert(serial.actual_baudrate == 0);
+  serial_report(&serial);
   // Serial port timeout test
   struct timeval tval_before, tval_after, tval_result;
   for(i = 500; i<5000; i+=500) {
@@ -0,0 +1,527 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+/**
+ * Replay a dividi trace against a running dividi, the tool is
+ * the device on the master side of a pty and the clients on
+ * the TCP side. The serial output is written to the pty and the
+ * writes of the clients are sent over their own connection, at
+ * the recorded times or as fast as possible. Throughput and
+ * latency are reported for both directions.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "capture.h"
+
+#define REPLAY_CLIENTS_MAX               64
+#define REPLAY_CONNECT_TIMEOUT_MS        10000
+#define REPLAY_IDLE_TIMEOUT_MS           2000
+#define REPLAY_READ_SIZE                 65536
+
+struct s_chunk {
+  unsigned long long time;
+  int client;
+  int direction;
+  int length;
+  unsigned char *data;
+};
+
+/**
+ * A recorded client, replayed over its own connection
+ */
+struct s_client {
+  unsigned int id;
+  int link;
+  int fd;
+  SSL *ssl;
+  // serial output received
+  unsigned long long received;
+  // serial output chunk that has to arrive next
+  int next;
+};
+
+/**
+ * Latency samples of one direction
+ */
+struct s_stats {
+  unsigned long long bytes;
+  long long *samples;
+  int total;
+};
+
+static struct s_chunk *chunks = NULL;
+static int total_chunks = 0;
+static struct s_client clients[REPLAY_CLIENTS_MAX];
+static int total_clients = 0;
+// serial output: cumulative offset and write time of every chunk
+static unsigned long long *in_offsets;
+static long long *in_times;
+static int total_in = 0;
+// client writes: cumulative offset and write time of every chunk
+static unsigned long long *out_offsets;
+static long long *out_times;
+static int total_out = 0;
+static unsigned long long out_written = 0;
+static unsigned long long out_received = 0;
+static int out_next = 0;
+static struct s_stats in_stats;
+static struct s_stats out_stats;
+
+static void print_help()
+{
+  printf("Usage: dividi-replay [options] trace\n");
+  printf("  -p, --pty <path>         symlink to the slave of the pty, the serial port in the dividi config\n");
+  printf("  -e, --exec <command>     start dividi once the pty exists, stopped at the end\n");
+  printf("  -t, --host <address>     address of dividi, 127.0.0.1 by default\n");
+  printf("  -o, --port-offset <n>    connect to the recorded port + n\n");
+  printf("  -c, --cert <file>        client certificate\n");
+  printf("  -k, --key <file>         client key\n");
+  printf("  -f, --fast               replay as fast as possible instead of at the recorded times\n");
+}
+
+/**
+ * Monotonic time in microseconds
+ */
+static long long now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Read all chunks of a trace
+ */
+static void load_trace(char *path)
+{
+  struct s_capture_header header;
+  struct s_capture_record record;
+  struct s_chunk *chunk;
+  FILE *file;
+  int allocated = 0;
+  int listen_link = 0;
+  int i;
+
+  if((file = fopen(path, "rb")) == NULL) {
+    perror("fopen failed");
+    exit(-1);
+  }
+  if(fread(&header, sizeof(header), 1, file) != 1 ||
+     memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+     header.version != CAPTURE_VERSION) {
+    fprintf(stderr, "%s is not a dividi trace\n", path);
+    exit(-1);
+  }
+  while(fread(&record, sizeof(record), 1, file) == 1) {
+    if(total_chunks == allocated) {
+      allocated = allocated ? allocated * 2 : 1024;
+      chunks = (struct s_chunk *) realloc(chunks, allocated * sizeof(struct s_chunk));
+    }
+    // Nothing replays what dividi wrote itself
+    if(record.direction == CAPTURE_TO_SERIAL && record.client == 0) {
+      fseek(file, record.length, SEEK_CUR);
+      continue;
+    }
+    chunk = &chunks[total_chunks];
+    chunk->time = record.time;
+    chunk->client = record.client;
+    chunk->direction = record.direction;
+    chunk->length = record.length;
+    chunk->data = (unsigned char *) malloc(record.length);
+    if(fread(chunk->data, 1, record.length, file) != record.length) {
+      fprintf(stderr, "truncated chunk\n");
+      free(chunk->data);
+      break;
+    }
+    total_chunks++;
+    if(chunk->direction == CAPTURE_FROM_SERIAL) {
+      listen_link = record.link;
+      continue;
+    }
+    for(i = 0; i < total_clients && clients[i].id != record.client; i++);
+    if(i == total_clients && i < REPLAY_CLIENTS_MAX) {
+      clients[total_clients].id = record.client;
+      clients[total_clients++].link = record.link;
+    }
+  }
+  fclose(file);
+  // A trace without writes is replayed with one client listening
+  if(total_clients == 0 && listen_link) {
+    clients[total_clients].id = 0;
+    clients[total_clients++].link = listen_link;
+  }
+}
+
+/**
+ * Compare chunks on time, the threads that recorded
+ * them didn't write them in order
+ */
+static int chunk_compare(const void *a, const void *b)
+{
+  const struct s_chunk *x = (const struct s_chunk *) a;
+  const struct s_chunk *y = (const struct s_chunk *) b;
+
+  return (x->time > y->time) - (x->time < y->time);
+}
+
+/**
+ * Create the pty of the device
+ *
+ * @return the master
+ */
+static int open_device(char *link_path)
+{
+  struct termios tio;
+  int master;
+
+  if((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master) < 0 ||
+     unlockpt(master) < 0) {
+    perror("pty failed");
+    exit(-1);
+  }
+  tcgetattr(master, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(master, TCSANOW, &tio);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  if(link_path != NULL) {
+    unlink(link_path);
+    if(symlink(ptsname(master), link_path) < 0) {
+      perror("symlink failed");
+      exit(-1);
+    }
+  }
+  printf("device %s\n", ptsname(master));
+  return master;
+}
+
+/**
+ * Connect a client, retried while dividi is starting
+ */
+static void connect_client(struct s_client *client, SSL_CTX *ctx, char *host, int port)
+{
+  struct sockaddr_in addr;
+  long long deadline = now_us() + REPLAY_CONNECT_TIMEOUT_MS * 1000LL;
+  int one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  inet_pton(AF_INET, host, &addr.sin_addr);
+  while(1) {
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+      break;
+    }
+    close(client->fd);
+    if(now_us() > deadline) {
+      fprintf(stderr, "connecting to port %d failed\n", port);
+      exit(-1);
+    }
+    usleep(100000);
+  }
+  setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  client->ssl = SSL_new(ctx);
+  SSL_set_fd(client->ssl, client->fd);
+  if(SSL_connect(client->ssl) <= 0) {
+    ERR_print_errors_fp(stderr);
+    exit(-1);
+  }
+  fcntl(client->fd, F_SETFL, O_NONBLOCK);
+}
+
+/**
+ * Take a latency sample
+ */
+static void add_sample(struct s_stats *stats, long long latency)
+{
+  stats->samples[stats->total++] = latency;
+}
+
+/**
+ * Read what arrived on the pty and the connections
+ *
+ * @return the amount of bytes read
+ */
+static int receive(int master, int timeout_ms)
+{
+  struct pollfd fds[REPLAY_CLIENTS_MAX + 1];
+  static char buffer[REPLAY_READ_SIZE];
+  struct s_client *client;
+  long long now;
+  int progress = 0;
+  int bytes;
+  int i;
+
+  fds[0].fd = master;
+  fds[0].events = POLLIN;
+  for(i = 0; i < total_clients; i++) {
+    fds[i + 1].fd = clients[i].fd;
+    fds[i + 1].events = POLLIN;
+  }
+  // SSL can hold decrypted data the socket doesn't show
+  for(i = 0; i < total_clients; i++) {
+    if(SSL_pending(clients[i].ssl) > 0) {
+      timeout_ms = 0;
+    }
+  }
+  poll(fds, total_clients + 1, timeout_ms);
+  now = now_us();
+  while((bytes = read(master, buffer, sizeof(buffer))) > 0) {
+    out_received += bytes;
+    progress += bytes;
+    while(out_next < total_out && out_offsets[out_next] <= out_received) {
+      add_sample(&out_stats, now - out_times[out_next++]);
+    }
+  }
+  for(i = 0; i < total_clients; i++) {
+    client = &clients[i];
+    while((bytes = SSL_read(client->ssl, buffer, sizeof(buffer))) > 0) {
+      client->received += bytes;
+      progress += bytes;
+      while(client->next < total_in && in_offsets[client->next] <= client->received) {
+        add_sample(&in_stats, now - in_times[client->next++]);
+      }
+    }
+  }
+  return progress;
+}
+
+/**
+ * Write all of a chunk, reading in between so
+ * neither side stalls
+ */
+static void send_chunk(int master, struct s_chunk *chunk)
+{
+  struct s_client *client = NULL;
+  int offset = 0;
+  int bytes;
+  int i;
+
+  for(i = 0; i < total_clients && chunk->direction == CAPTURE_TO_SERIAL; i++) {
+    if(clients[i].id == (unsigned int) chunk->client) {
+      client = &clients[i];
+    }
+  }
+  if(chunk->direction == CAPTURE_TO_SERIAL && client == NULL) {
+    return;
+  }
+  while(offset < chunk->length) {
+    if(client == NULL) {
+      bytes = write(master, chunk->data + offset, chunk->length - offset);
+    } else {
+      bytes = SSL_write(client->ssl, chunk->data + offset, chunk->length - offset);
+    }
+    if(bytes > 0) {
+      offset += bytes;
+    } else {
+      receive(master, 1);
+    }
+  }
+  if(client == NULL) {
+    in_stats.bytes += chunk->length;
+    in_offsets[total_in] = in_stats.bytes;
+    in_times[total_in++] = now_us();
+  } else {
+    out_written += chunk->length;
+    out_stats.bytes += chunk->length;
+    out_offsets[total_out] = out_written;
+    out_times[total_out++] = now_us();
+  }
+}
+
+static int long_compare(const void *a, const void *b)
+{
+  long long x = *(const long long *) a;
+  long long y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Print the throughput and latency of a direction
+ */
+static void report(char *name, struct s_stats *stats, unsigned long long received,
+                   double seconds)
+{
+  long long total = 0;
+  int i;
+
+  printf("%s: %llu bytes sent, %llu received, %.1f kB/s", name, stats->bytes, received,
+         seconds > 0 ? received / seconds / 1000 : 0.0);
+  if(stats->total == 0) {
+    printf("\n");
+    return;
+  }
+  qsort(stats->samples, stats->total, sizeof(long long), long_compare);
+  for(i = 0; i < stats->total; i++) {
+    total += stats->samples[i];
+  }
+  printf(", latency us avg %lld p50 %lld p99 %lld max %lld\n", total / stats->total,
+         stats->samples[stats->total / 2], stats->samples[stats->total * 99 / 100],
+         stats->samples[stats->total - 1]);
+}
+
+int main(int argc, char **argv)
+{
+  char *pty = NULL;
+  char *command = NULL;
+  char *host = "127.0.0.1";
+  char *cert = NULL;
+  char *key = NULL;
+  int offset = 0;
+  int fast = 0;
+  int master;
+  int opt;
+  int i;
+  pid_t child = 0;
+  SSL_CTX *ctx;
+  long long start, idle, first;
+  unsigned long long in_received;
+  static struct option long_options[] = {
+    {"pty",         required_argument, 0, 'p'},
+    {"exec",        required_argument, 0, 'e'},
+    {"host",        required_argument, 0, 't'},
+    {"port-offset", required_argument, 0, 'o'},
+    {"cert",        required_argument, 0, 'c'},
+    {"key",         required_argument, 0, 'k'},
+    {"fast",        no_argument,       0, 'f'},
+    {"help",        no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while((opt = getopt_long(argc, argv, "p:e:t:o:c:k:fh", long_options, NULL)) != -1) {
+    switch(opt) {
+    case 'p':
+      pty = optarg;
+      break;
+    case 'e':
+      command = optarg;
+      break;
+    case 't':
+      host = optarg;
+      break;
+    case 'o':
+      offset = atoi(optarg);
+      break;
+    case 'c':
+      cert = optarg;
+      break;
+    case 'k':
+      key = optarg;
+      break;
+    case 'f':
+      fast = 1;
+      break;
+    default:
+      print_help();
+      return opt != 'h';
+    }
+  }
+  if(optind != argc - 1) {
+    print_help();
+    return 1;
+  }
+  load_trace(argv[optind]);
+  if(total_chunks == 0) {
+    fprintf(stderr, "empty trace\n");
+    return 1;
+  }
+  qsort(chunks, total_chunks, sizeof(struct s_chunk), chunk_compare);
+  in_offsets = (unsigned long long *) malloc(total_chunks * sizeof(unsigned long long));
+  in_times = (long long *) malloc(total_chunks * sizeof(long long));
+  out_offsets = (unsigned long long *) malloc(total_chunks * sizeof(unsigned long long));
+  out_times = (long long *) malloc(total_chunks * sizeof(long long));
+  // every client samples every serial output chunk
+  in_stats.samples = (long long *) malloc(total_chunks * (total_clients + 1) * sizeof(long long));
+  out_stats.samples = (long long *) malloc(total_chunks * sizeof(long long));
+
+  signal(SIGPIPE, SIG_IGN);
+  master = open_device(pty);
+  if(command != NULL && (child = fork()) == 0) {
+    setpgid(0, 0);
+    execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+    _exit(127);
+  }
+  SSL_library_init();
+  SSL_load_error_strings();
+  ctx = SSL_CTX_new(TLS_client_method());
+  if(cert != NULL && (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) <= 0 ||
+                      SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0)) {
+    ERR_print_errors_fp(stderr);
+    return 1;
+  }
+  for(i = 0; i < total_clients; i++) {
+    connect_client(&clients[i], ctx, host, clients[i].link + offset);
+  }
+  printf("%d chunks, %d clients\n", total_chunks, total_clients);
+  // Let dividi attach the clients before the device talks
+  usleep(200000);
+
+  start = now_us();
+  first = chunks[0].time;
+  for(i = 0; i < total_chunks; i++) {
+    while(!fast && now_us() - start < (long long) (chunks[i].time - first)) {
+      receive(master, (chunks[i].time - first - (now_us() - start)) / 1000);
+    }
+    send_chunk(master, &chunks[i]);
+    receive(master, 0);
+  }
+  // Wait untill everything arrived or nothing moves anymore
+  idle = now_us();
+  while(now_us() - idle < REPLAY_IDLE_TIMEOUT_MS * 1000LL) {
+    in_received = 0;
+    for(i = 0; i < total_clients; i++) {
+      in_received += clients[i].received;
+    }
+    if(in_received >= in_stats.bytes * total_clients && out_received >= out_written) {
+      break;
+    }
+    if(receive(master, 10) > 0) {
+      idle = now_us();
+    }
+  }
+  in_received = 0;
+  for(i = 0; i < total_clients; i++) {
+    in_received += clients[i].received;
+  }
+  printf("replayed in %.3fs, recorded %.3fs\n", (now_us() - start) / 1e6,
+         (chunks[total_chunks - 1].time - first) / 1e6);
+  report("serial -> clients", &in_stats, in_received, (now_us() - start) / 1e6);
+  report("clients -> serial", &out_stats, out_received, (now_us() - start) / 1e6);
+  for(i = 0; i < total_clients; i++) {
+    SSL_free(clients[i].ssl);
+    close(clients[i].fd);
+  }
+  if(child > 0) {
+    kill(-child, SIGTERM);
+    waitpid(child, NULL, 0);
+  }
+  if(pty != NULL) {
+    unlink(pty);
+  }
+  return 0;
+}
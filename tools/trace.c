@@ -0,0 +1,158 @@
+/*****************************************************************************
+ *
+ * Dividi : A ComPort TCP share tool
+ *
+ *          Copyright (c) 2016. Some rights reserved.
+ *          See LICENSE and COPYING for usage.
+ *
+ * Authors: Roel Postelmans
+ *
+ ****************************************************************************/
+/**
+ * Dump the chunks of a dividi trace file, see capture.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include "capture.h"
+
+struct s_filter {
+  int link;
+  int client;
+  int direction;
+  int hex;
+};
+
+static void print_help()
+{
+  printf("Usage: dividi-trace [options] file\n");
+  printf("  -l, --link <port>      only the chunks of a link\n");
+  printf("  -c, --client <id>      only the chunks of a client, 0 is the serial output\n");
+  printf("  -d, --direction <dir>  only the chunks from (in) or to (out) the serial port\n");
+  printf("  -x, --hex              dump the data in hex\n");
+}
+
+/**
+ * Print data, escaping what isn't printable
+ */
+static void print_data(unsigned char *data, int length, int hex)
+{
+  int i;
+
+  for(i = 0; i < length; i++) {
+    if(hex) {
+      printf("%s%02x", i ? " " : "", data[i]);
+    } else if(data[i] == '\\') {
+      printf("\\\\");
+    } else if(isprint(data[i])) {
+      putchar(data[i]);
+    } else if(data[i] == '\r') {
+      printf("\\r");
+    } else if(data[i] == '\n') {
+      printf("\\n");
+    } else {
+      printf("\\x%02x", data[i]);
+    }
+  }
+  putchar('\n');
+}
+
+/**
+ * Check a chunk against the filter
+ */
+static int matches(struct s_capture_record *record, struct s_filter *filter)
+{
+  return (filter->link < 0 || record->link == filter->link) &&
+         (filter->client < 0 || record->client == (unsigned int) filter->client) &&
+         (filter->direction < 0 || record->direction == filter->direction);
+}
+
+int main(int argc, char **argv)
+{
+  struct s_filter filter = {-1, -1, -1, 0};
+  struct s_capture_header header;
+  struct s_capture_record record;
+  unsigned long long start = 0;
+  unsigned char *data = NULL;
+  FILE *file;
+  int opt;
+  static struct option long_options[] = {
+    {"link",      required_argument, 0, 'l'},
+    {"client",    required_argument, 0, 'c'},
+    {"direction", required_argument, 0, 'd'},
+    {"hex",       no_argument,       0, 'x'},
+    {"help",      no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while((opt = getopt_long(argc, argv, "l:c:d:xh", long_options, NULL)) != -1) {
+    switch(opt) {
+    case 'l':
+      filter.link = atoi(optarg);
+      break;
+    case 'c':
+      filter.client = atoi(optarg);
+      break;
+    case 'd':
+      if(strcmp(optarg, "in") == 0) {
+        filter.direction = CAPTURE_FROM_SERIAL;
+      } else if(strcmp(optarg, "out") == 0) {
+        filter.direction = CAPTURE_TO_SERIAL;
+      } else {
+        print_help();
+        return 1;
+      }
+      break;
+    case 'x':
+      filter.hex = 1;
+      break;
+    default:
+      print_help();
+      return opt != 'h';
+    }
+  }
+  if(optind != argc - 1) {
+    print_help();
+    return 1;
+  }
+  if((file = fopen(argv[optind], "rb")) == NULL) {
+    perror("fopen failed");
+    return 1;
+  }
+  if(fread(&header, sizeof(header), 1, file) != 1 ||
+     memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s is not a dividi trace\n", argv[optind]);
+    return 1;
+  }
+  if(header.version != CAPTURE_VERSION) {
+    fprintf(stderr, "unsupported trace version %u\n", header.version);
+    return 1;
+  }
+  // The chunks of different threads aren't ordered,
+  // times are relative to the oldest one
+  while(fread(&record, sizeof(record), 1, file) == 1 &&
+        fseek(file, record.length, SEEK_CUR) == 0) {
+    if(start == 0 || record.time < start) {
+      start = record.time;
+    }
+  }
+  fseek(file, sizeof(header), SEEK_SET);
+  while(fread(&record, sizeof(record), 1, file) == 1) {
+    data = (unsigned char *) realloc(data, record.length + 1);
+    if(fread(data, 1, record.length, file) != record.length) {
+      fprintf(stderr, "truncated chunk\n");
+      break;
+    }
+    if(!matches(&record, &filter)) {
+      continue;
+    }
+    printf("%12.6f port %u client %u %s %u: ", (record.time - start) / 1e6, record.link,
+           record.client, record.direction == CAPTURE_FROM_SERIAL ? "in " : "out", record.length);
+    print_data(data, record.length, filter.hex);
+  }
+  free(data);
+  fclose(file);
+  return 0;
+}